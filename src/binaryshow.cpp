@@ -0,0 +1,472 @@
+/* binaryshow.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "binaryshow.h"
+
+#include <string.h>
+#include <assert.h>
+#include <QtEndian>
+#include <boost/make_shared.hpp>
+#include "log.h"
+
+/// Size of the fixed part of a node record.
+#define NODE_HEADER (32)
+/// Size of a slot index entry.
+#define INDEX_ENTRY (24)
+
+static void putU32(QByteArray &b, const quint32 v)
+{
+    const quint32 le = qToLittleEndian(v);
+    b.append((const char *)&le,4);
+}
+
+static void putU64(QByteArray &b, const quint64 v)
+{
+    const quint64 le = qToLittleEndian(v);
+    b.append((const char *)&le,8);
+}
+
+static quint32 getU32(const uchar *p)
+{
+    return qFromLittleEndian<quint32>(p);
+}
+
+static quint64 getU64(const uchar *p)
+{
+    return qFromLittleEndian<quint64>(p);
+}
+
+static quint64 alignUp(const quint64 v, const quint64 align)
+{
+    return (v + align - 1) / align * align;
+}
+
+BinaryShowWriter::BinaryShowWriter(QIODevice* out_)
+{
+    out = out_;
+    pos = 0;
+    slotCount_ = 0;
+    pending = false;
+    children = 0;
+    dataOffset = 0;
+    dataSize = 0;
+    error = false;
+    // Room for the header, it is written once we know where everything went
+    const QByteArray blank(BINARY_SHOW_DATA_START,0);
+    put(blank.constData(),blank.size());
+}
+
+BinaryShowWriter::~BinaryShowWriter()
+{
+}
+
+QString BinaryShowWriter::errorString() const
+{
+    return errorString_;
+}
+
+void BinaryShowWriter::put(const void* data, const size_t size)
+{
+    if (error || !size) {
+        return;
+    }
+    if (out->write((const char *)data,size) != (qint64) size) {
+        error = true;
+        errorString_ = out->errorString();
+        slog()->errorStream() << "Binary show write failed : " << errorString_.toStdString();
+        return;
+    }
+    pos += size;
+}
+
+void BinaryShowWriter::pad(const size_t align)
+{
+    const quint64 next = alignUp(pos,align);
+    if (next != pos) {
+        const QByteArray blank(next - pos,0);
+        put(blank.constData(),blank.size());
+    }
+}
+
+void BinaryShowWriter::writeNode(const std::string name_, const std::string description_, const unsigned int children_)
+{
+    flushNode();
+    pending = true;
+    name = QByteArray(name_.data(),name_.size());
+    description = QByteArray(description_.data(),description_.size());
+    params.clear();
+    children = children_;
+    dataOffset = 0;
+    dataSize = 0;
+}
+
+void BinaryShowWriter::writeParams(const QByteArray params_)
+{
+    params = params_;
+}
+
+void BinaryShowWriter::writeData(const void* data, const size_t size)
+{
+    pad(BINARY_SHOW_ALIGN);
+    dataOffset = pos;
+    dataSize = size;
+    put(data,size);
+}
+
+void BinaryShowWriter::flushNode()
+{
+    if (!pending) {
+        return;
+    }
+    pending = false;
+    putU32(nodes,name.size());
+    putU32(nodes,description.size());
+    putU32(nodes,params.size());
+    putU32(nodes,children);
+    putU64(nodes,dataOffset);
+    putU64(nodes,dataSize);
+    nodes.append(name);
+    nodes.append(description);
+    nodes.append(params);
+    nodes.append(QByteArray(alignUp(nodes.size(),8) - nodes.size(),0));
+}
+
+bool BinaryShowWriter::writeSlot(const size_t position, SourceImplPtr fs)
+{
+    if (!fs) {
+        return !error;
+    }
+    const quint64 start = nodes.size();
+    fs->saveFrames(this);
+    flushNode();
+    // Offsets in the index are relative to the node area until finish() knows where that is
+    putU64(index,position);
+    putU64(index,start);
+    putU64(index,nodes.size() - start);
+    slotCount_++;
+    return !error;
+}
+
+bool BinaryShowWriter::finish()
+{
+    flushNode();
+    const quint64 dataEnd = pos;
+    pad(8);
+    const quint64 nodesOffset = pos;
+    put(nodes.constData(),nodes.size());
+    const quint64 indexOffset = pos;
+    // Now the node area is placed, make the index offsets absolute
+    for (unsigned int i = 0; i < slotCount_; i++) {
+        uchar *p = (uchar *) index.data() + i * INDEX_ENTRY + 8;
+        qToLittleEndian<quint64>(getU64(p) + nodesOffset,p);
+    }
+    put(index.constData(),index.size());
+    const quint64 fileSize = pos;
+    QByteArray h(BINARY_SHOW_MAGIC,8);
+    putU32(h,BINARY_SHOW_VERSION);
+    putU32(h,slotCount_);
+    putU64(h,indexOffset);
+    putU64(h,nodesOffset);
+    putU64(h,nodes.size());
+    putU64(h,BINARY_SHOW_DATA_START);
+    putU64(h,dataEnd - BINARY_SHOW_DATA_START);
+    putU64(h,fileSize);
+    if (!error && !out->seek(0)) {
+        error = true;
+        errorString_ = out->errorString();
+    }
+    put(h.constData(),h.size());
+    if (!error) {
+        out->seek(fileSize);
+        slog()->infoStream() << "Wrote binary show : " << slotCount_ << " slots, " << nodes.size() << " bytes of nodes, "
+                             << dataEnd - BINARY_SHOW_DATA_START << " bytes of data";
+    }
+    return !error;
+}
+
+BinaryShowReader::BinaryShowReader(BinaryShowFilePtr file_, const BinaryShowSlot& slot)
+{
+    f = file_;
+    pos = slot.offset;
+    end = slot.offset + slot.size;
+    name_ = description_ = params_ = data_ = NULL;
+    nameSize = descriptionSize = paramsSize = children_ = 0;
+    dataSize_ = 0;
+    error = false;
+}
+
+bool BinaryShowReader::readNode()
+{
+    if (error || (pos + NODE_HEADER > end)) {
+        return false;
+    }
+    const uchar *h = f->at(pos,NODE_HEADER);
+    if (!h) {
+        error = true;
+        return false;
+    }
+    nameSize = getU32(h);
+    descriptionSize = getU32(h + 4);
+    paramsSize = getU32(h + 8);
+    children_ = getU32(h + 12);
+    const quint64 dataOffset = getU64(h + 16);
+    dataSize_ = getU64(h + 24);
+    const quint64 strings = (quint64) nameSize + descriptionSize + paramsSize;
+    name_ = f->at(pos + NODE_HEADER,strings);
+    if (!name_ || (pos + NODE_HEADER + strings > end) || (dataOffset % BINARY_SHOW_ALIGN)) {
+        slog()->errorStream() << "Malformed binary show node record at " << pos;
+        error = true;
+        return false;
+    }
+    description_ = name_ + nameSize;
+    params_ = description_ + descriptionSize;
+    data_ = NULL;
+    if (dataSize_) {
+        data_ = f->at(dataOffset,dataSize_);
+        if (!data_) {
+            slog()->errorStream() << "Binary show node at " << pos << " has data outside the file";
+            error = true;
+            return false;
+        }
+    }
+    pos = alignUp(pos + NODE_HEADER + strings,8);
+    return true;
+}
+
+std::string BinaryShowReader::name() const
+{
+    return std::string((const char *)name_,nameSize);
+}
+
+std::string BinaryShowReader::description() const
+{
+    return std::string((const char *)description_,descriptionSize);
+}
+
+QByteArray BinaryShowReader::params() const
+{
+    return QByteArray::fromRawData((const char *)params_,paramsSize);
+}
+
+unsigned int BinaryShowReader::children() const
+{
+    return children_;
+}
+
+const uchar* BinaryShowReader::data() const
+{
+    return data_;
+}
+
+quint64 BinaryShowReader::dataSize() const
+{
+    return dataSize_;
+}
+
+BinaryShowFilePtr BinaryShowReader::file() const
+{
+    return f;
+}
+
+bool BinaryShowReader::hasError() const
+{
+    return error;
+}
+
+BinaryShowFile::BinaryShowFile()
+{
+    map = NULL;
+    size = 0;
+}
+
+BinaryShowFile::~BinaryShowFile()
+{
+    if (map) {
+        file.unmap((uchar *)map);
+    }
+    file.close();
+    slog()->debugStream() << "Unmapped binary show : " << file.fileName().toStdString();
+}
+
+bool BinaryShowFile::isBinaryShow(const QString filename)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    return f.read(8) == QByteArray(BINARY_SHOW_MAGIC,8);
+}
+
+BinaryShowFilePtr BinaryShowFile::open(const QString filename)
+{
+    BinaryShowFilePtr f(new BinaryShowFile());
+    f->file.setFileName(filename);
+    if (!f->file.open(QIODevice::ReadOnly)) {
+        slog()->errorStream() << "Couldn't open binary show : " << f->file.errorString().toStdString();
+        return BinaryShowFilePtr();
+    }
+    f->size = f->file.size();
+    if (f->size < BINARY_SHOW_HEADER) {
+        slog()->errorStream() << "Binary show too short : " << filename.toStdString();
+        return BinaryShowFilePtr();
+    }
+    f->map = f->file.map(0,f->size);
+    if (!f->map) {
+        slog()->errorStream() << "Couldn't map binary show : " << f->file.errorString().toStdString();
+        return BinaryShowFilePtr();
+    }
+    const uchar *h = f->map;
+    if (memcmp(h,BINARY_SHOW_MAGIC,8)) {
+        slog()->errorStream() << "Not a binary show : " << filename.toStdString();
+        return BinaryShowFilePtr();
+    }
+    if (getU32(h + 8) != BINARY_SHOW_VERSION) {
+        slog()->errorStream() << "Unsupported binary show version " << getU32(h + 8) << " : " << filename.toStdString();
+        return BinaryShowFilePtr();
+    }
+    const quint32 count = getU32(h + 12);
+    const quint64 indexOffset = getU64(h + 16);
+    if (getU64(h + 56) != f->size) {
+        slog()->errorStream() << "Binary show is truncated : " << filename.toStdString();
+        return BinaryShowFilePtr();
+    }
+    const uchar *idx = f->at(indexOffset,(quint64) count * INDEX_ENTRY);
+    if (!idx) {
+        slog()->errorStream() << "Binary show index is outside the file : " << filename.toStdString();
+        return BinaryShowFilePtr();
+    }
+    f->index.resize(count);
+    for (unsigned int i = 0; i < count; i++) {
+        BinaryShowSlot &s = f->index[i];
+        s.position = getU64(idx + i * INDEX_ENTRY);
+        s.offset = getU64(idx + i * INDEX_ENTRY + 8);
+        s.size = getU64(idx + i * INDEX_ENTRY + 16);
+        if (!f->at(s.offset,s.size)) {
+            slog()->errorStream() << "Binary show slot " << s.position << " is outside the file";
+            return BinaryShowFilePtr();
+        }
+    }
+    slog()->infoStream() << "Mapped binary show : " << filename.toStdString() << ", " << count << " slots";
+    return f;
+}
+
+size_t BinaryShowFile::slotCount() const
+{
+    return index.size();
+}
+
+BinaryShowSlot BinaryShowFile::slot(const size_t n) const
+{
+    assert (n < index.size());
+    return index[n];
+}
+
+const uchar* BinaryShowFile::at(const quint64 offset, const quint64 len) const
+{
+    if ((offset > size) || (len > size - offset)) {
+        return NULL;
+    }
+    return map + offset;
+}
+
+SourceImplPtr BinaryShowFile::loadSlot(const size_t n)
+{
+    BinaryShowReader r(shared_from_this(),slot(n));
+    SourceImplPtr fs = FrameSource_impl::loadFrames(&r);
+    if (r.hasError()) {
+        slog()->errorStream() << "Binary show slot " << index[n].position << " is malformed";
+        return SourceImplPtr();
+    }
+    return fs;
+}
+
+void BinaryShowFile::warm(const size_t n)
+{
+    BinaryShowReader r(shared_from_this(),slot(n));
+    // The reads have to happen, so make them volatile
+    volatile uchar sink = 0;
+    while (r.readNode()) {
+        const uchar *d = r.data();
+        for (quint64 i = 0; i < r.dataSize(); i += 4096) {
+            sink = sink + d[i];
+        }
+    }
+}
+
+BinaryShowStub::BinaryShowStub(BinaryShowFilePtr file_, const size_t slot_) : FrameSource_impl(NOTHING,NONE,"Binary_show_stub")
+{
+    file = file_;
+    slot = slot_;
+}
+
+BinaryShowStub::~BinaryShowStub()
+{
+}
+
+SourceImplPtr BinaryShowStub::resolve() const
+{
+    return file->loadSlot(slot);
+}
+
+void BinaryShowStub::warm() const
+{
+    file->warm(slot);
+}
+
+FramePtr BinaryShowStub::nextFrame(PlaybackImplPtr)
+{
+    return FramePtr();
+}
+
+size_t BinaryShowStub::frames()
+{
+    return 0;
+}
+
+size_t BinaryShowStub::pos(PlaybackImplPtr)
+{
+    return 0;
+}
+
+void BinaryShowStub::reset(PlaybackImplPtr)
+{
+}
+
+FrameGui* BinaryShowStub::controls(QWidget*)
+{
+    return NULL;
+}
+
+void BinaryShowStub::save(QXmlStreamWriter*)
+{
+}
+
+void BinaryShowStub::load(QXmlStreamReader*)
+{
+}
+
+PlaybackImplPtr BinaryShowStub::newPlayback()
+{
+    return boost::make_shared<Playback_impl>();
+}
+
+void BinaryShowStub::copyDataTo(SourceImplPtr) const
+{
+    // Never registered so never cloned, the engine resolves stubs before handing them out
+    assert (0);
+}
@@ -0,0 +1,198 @@
+/* binaryshow.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BINARYSHOW_INCL
+#define BINARYSHOW_INCL
+
+#include <string>
+#include <vector>
+#include <QtCore>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include "framesource_impl.h"
+
+/// The native binary show format (.lsb).
+
+/// XML (.lsf) remains the interchange format, this one exists so that loading a show costs
+/// time in proportion to its metadata rather than its point count. Everything is little endian.
+///
+/// Header, 64 bytes at offset 0:
+///   char magic[8] "LUCIFLSB", u32 version, u32 slots, u64 index offset, u64 nodes offset,
+///   u64 nodes size, u64 data offset, u64 data size, u64 file size.
+/// Data area, from BINARY_SHOW_DATA_START (one page in, so it maps page aligned):
+///   Bulk data blobs (StaticFrame points as raw ILDAPoint arrays), each BINARY_SHOW_ALIGN aligned.
+/// Node records, one tree per slot in pre order, each 8 byte aligned:
+///   u32 name size, u32 description size, u32 params size, u32 children,
+///   u64 data offset, u64 data size, then name, description and params bytes.
+///   Params are the node's xml start tag with the attributes its save() writes.
+/// Slot index, after the node records:
+///   u64 position, u64 offset of the root node record, u64 size of the slot's records.
+
+#define BINARY_SHOW_MAGIC "LUCIFLSB"
+#define BINARY_SHOW_VERSION (1)
+#define BINARY_SHOW_HEADER (64)
+#define BINARY_SHOW_DATA_START (4096)
+#define BINARY_SHOW_ALIGN (16)
+
+class BinaryShowFile;
+typedef boost::shared_ptr<BinaryShowFile> BinaryShowFilePtr;
+
+/// \brief Writes a binary show, the data area is streamed out as the trees are walked.
+/// The device must be seekable as the header is written last.
+class BinaryShowWriter
+{
+public:
+    BinaryShowWriter (QIODevice *out);
+    ~BinaryShowWriter ();
+    /// \brief Write the whole tree under fs as the sequence at slot position pos.
+    /// @return false on a write error.
+    bool writeSlot (const size_t pos, SourceImplPtr fs);
+    /// \brief Write the node records, the index and finally the header.
+    /// @return false on a write error.
+    bool finish ();
+    QString errorString () const;
+    /// \brief Start a node record, used by FrameSource_impl::saveFrames.
+    void writeNode (const std::string name, const std::string description, const unsigned int children);
+    /// \brief Set the parameter block for the current node.
+    void writeParams (const QByteArray params);
+    /// \brief Append a blob to the data area and attach it to the current node.
+    void writeData (const void *data, const size_t size);
+private:
+    void flushNode ();
+    void put (const void *data, const size_t size);
+    void pad (const size_t align);
+    QIODevice *out;
+    quint64 pos;
+    QByteArray nodes;
+    QByteArray index;
+    unsigned int slotCount_;
+    // The node record being built
+    bool pending;
+    QByteArray name;
+    QByteArray description;
+    QByteArray params;
+    unsigned int children;
+    quint64 dataOffset;
+    quint64 dataSize;
+    bool error;
+    QString errorString_;
+};
+
+/// \brief One entry in the slot index.
+class BinaryShowSlot
+{
+public:
+    size_t position;
+    quint64 offset;
+    quint64 size;
+};
+
+/// \brief A cursor over the node records of one slot, the binary counterpart of QXmlStreamReader.
+class BinaryShowReader
+{
+public:
+    BinaryShowReader (BinaryShowFilePtr file, const BinaryShowSlot &slot);
+    /// \brief Move to the next node record.
+    /// @return false at the end of the slot or on a malformed record.
+    bool readNode ();
+    std::string name () const;
+    std::string description () const;
+    /// The parameter block, this references the mapping so is only good while file() is held.
+    QByteArray params () const;
+    unsigned int children () const;
+    /// The bulk data for this node, pointing straight into the mapping, or NULL.
+    const uchar * data () const;
+    quint64 dataSize () const;
+    /// The file, anything holding on to data() must hold on to this too.
+    BinaryShowFilePtr file () const;
+    bool hasError () const;
+private:
+    BinaryShowFilePtr f;
+    quint64 pos;
+    quint64 end;
+    const uchar *name_;
+    quint32 nameSize;
+    const uchar *description_;
+    quint32 descriptionSize;
+    const uchar *params_;
+    quint32 paramsSize;
+    quint32 children_;
+    const uchar *data_;
+    quint64 dataSize_;
+    bool error;
+};
+
+/// \brief A memory mapped binary show, the mapping lives as long as anything points into it.
+class BinaryShowFile : public boost::enable_shared_from_this<BinaryShowFile>
+{
+public:
+    ~BinaryShowFile ();
+    /// \brief Check the magic number without mapping anything.
+    static bool isBinaryShow (const QString filename);
+    /// \brief Map a binary show and check its header and index.
+    /// @return the file or a null pointer on error, which is logged.
+    static BinaryShowFilePtr open (const QString filename);
+    /// @return the number of slots in the index.
+    size_t slotCount () const;
+    /// @return the index entry for a slot.
+    BinaryShowSlot slot (const size_t n) const;
+    /// \brief Build the tree for one slot, bulk data is referenced rather than read.
+    /// @return the tree, or a null pointer if it is malformed.
+    SourceImplPtr loadSlot (const size_t n);
+    /// @return a pointer to size bytes at offset, or NULL if that is not all within the file.
+    const uchar * at (const quint64 offset, const quint64 size) const;
+    /// \brief Fault in the pages holding a slot's bulk data, so using it later does not.
+    void warm (const size_t n);
+private:
+    BinaryShowFile ();
+    QFile file;
+    const uchar *map;
+    quint64 size;
+    std::vector<BinaryShowSlot> index;
+};
+
+/// \brief Stands in for a slot of a lazily loaded binary show until something needs the tree.
+/// It plays as an empty source. The engine swaps in the real tree the first time the slot is
+/// asked for, see Engine::getFrameSource, so these only ever live in the engine's table.
+class BinaryShowStub : public FrameSource_impl
+{
+public:
+    BinaryShowStub (BinaryShowFilePtr file, const size_t slot);
+    ~BinaryShowStub ();
+    /// \brief Decode the real tree, the stub itself is left as it was.
+    SourceImplPtr resolve () const;
+    /// \brief Fault in the slot's point data.
+    void warm () const;
+    FramePtr nextFrame (PlaybackImplPtr pb);
+    size_t frames ();
+    size_t pos (PlaybackImplPtr p);
+    void reset (PlaybackImplPtr p);
+    FrameGui * controls (QWidget *parent);
+protected:
+    void save (QXmlStreamWriter *w);
+    void load (QXmlStreamReader *r);
+private:
+    PlaybackImplPtr newPlayback ();
+    void copyDataTo (SourceImplPtr f) const;
+    BinaryShowFilePtr file;
+    size_t slot;
+};
+
+typedef boost::shared_ptr<BinaryShowStub> BinaryShowStubPtr;
+
+#endif
@@ -30,6 +30,7 @@ ButtonGrid::ButtonGrid (EnginePtr engine_, unsigned int num_x, unsigned int num_
     num_y_ = num_y;
     offset_=offset;
     engine = engine_;
+    stale = false;
     setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
     QVBoxLayout *l = new QVBoxLayout(this);
     layout = new QGridLayout ();
@@ -82,9 +83,24 @@ ScreenDisplay * ButtonGrid::at (unsigned int x, unsigned int y)
     return (ScreenDisplay *) layout->itemAtPosition(x,y)->widget();
 }
 
+void ButtonGrid::showEvent(QShowEvent* e)
+{
+    QWidget::showEvent(e);
+    if (stale) {
+        stale = false;
+        for (unsigned int i = 0; i < num_x_ * num_y_; i++) {
+            frameSourceChanged(offset_ + i);
+        }
+    }
+}
+
 void ButtonGrid::frameSourceChanged(long unsigned int pos)
 {
     if ((pos >= offset_) && ((pos - offset_) <(num_x_ * num_y_))) {
+        if (!isVisible()) {
+            stale = true;
+            return;
+        }
         // it is one of ours
         pos -= offset_;
         unsigned int x = pos % num_x_;
@@ -61,7 +61,13 @@ public slots:
     /// @param [in] text is the text to display.
     /// @param [in] time is the time in ms for which the text should be displayed.
     void message (QString text, int time);
+protected:
+    /// \brief Catch up with any framesource changes made while hidden.
+    void showEvent (QShowEvent *e);
 private:
+    /// Set when a change was ignored because the grid was hidden, previews are only built
+    /// for grids on screen so a lazily loaded show is only decoded as it is looked at.
+    bool stale;
     QGridLayout * layout;
     QSignalMapper * mapper;
     QStatusBar *statusbar;
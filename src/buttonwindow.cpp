@@ -82,30 +82,19 @@ ButtonWindow::ButtonWindow(EnginePtr e, QWidget* parent): QMainWindow(parent)
     frame->setLayout(vlayout);
     tabs = new QTabWidget();
     tabs->setSizePolicy(QSizePolicy::Expanding,QSizePolicy::Expanding);
-    QFrame *headframe = new QFrame();
-    vlayout->addWidget(headframe);
+    headFrame = new QFrame();
+    vlayout->addWidget(headFrame);
     vlayout->addWidget(tabs);
-    headframe->setFixedHeight(128);
-    headframe->setFixedWidth(138 * MAX_HEADS);
-    headframe->setFrameStyle(QFrame::Box | QFrame::Raised);
-    QHBoxLayout *hlayout = new QHBoxLayout ();
-    headframe->setLayout(hlayout);
+    headFrame->setFixedHeight(128);
+    headFrame->setFrameStyle(QFrame::Box | QFrame::Raised);
+    headLayout = new QHBoxLayout ();
+    headFrame->setLayout(headLayout);
     // Heads
-    QSignalMapper *map = new QSignalMapper(this);
-    connect (map,SIGNAL(mapped(int)),&(*engine),SLOT(selectHead(int)));
+    headMap = new QSignalMapper(this);
+    connect (headMap,SIGNAL(mapped(int)),&(*engine),SLOT(selectHead(int)));
     connect (&(*engine),SIGNAL(headSelectionChanged(int)),this,SLOT(headSelectionChanged(int)));
-    for (unsigned int i=0; i < MAX_HEADS; i++) {
-        OutputView *ov = new OutputView (false,this);
-        ov->setFixedWidth(128);
-        ov->setTitle(QString().sprintf("Head %d",i+1));
-        ov->setBorderWidth(5);
-        ov->setIndicatorWidth(5);
-        outputs[i] = ov;
-        hlayout->addWidget(ov);
-        connect ((&(*engine->getHead(i))),SIGNAL(newFrame(FramePtr)),ov,SLOT(updateDisplay(FramePtr)));
-        map->setMapping(ov,i);
-        connect (ov,SIGNAL(leftClicked()),map,SLOT(map()));
-    }
+    connect (&(*engine),SIGNAL(headCountChanged(size_t)),this,SLOT(headCountChanged(size_t)));
+    headCountChanged(engine->headCount());
     headSelectionChanged(0);
     ButtonGrid *g = new ButtonGrid(engine, 8,8,0,this);
     grids.push_back (g);
@@ -139,10 +128,36 @@ ButtonWindow::ButtonWindow(EnginePtr e, QWidget* parent): QMainWindow(parent)
     setCurrentFile(QString());
 }
 
+void ButtonWindow::headCountChanged(size_t count)
+{
+    while (outputs.size() > count) {
+        delete outputs.back();
+        outputs.pop_back();
+    }
+    while (outputs.size() < count) {
+        const unsigned int i = outputs.size();
+        LaserHeadPtr h = engine->getHead(i);
+        if (!h) {
+            break;
+        }
+        OutputView *ov = new OutputView (false,this);
+        ov->setFixedWidth(128);
+        ov->setTitle(QString().sprintf("Head %d",i+1));
+        ov->setBorderWidth(5);
+        ov->setIndicatorWidth(5);
+        outputs.push_back(ov);
+        headLayout->addWidget(ov);
+        connect ((&(*h)),SIGNAL(newFrame(FramePtr)),ov,SLOT(updateDisplay(FramePtr)));
+        headMap->setMapping(ov,i);
+        connect (ov,SIGNAL(leftClicked()),headMap,SLOT(map()));
+    }
+    headFrame->setFixedWidth(138 * outputs.size());
+}
+
 void ButtonWindow::headSelectionChanged(int head)
 {
     slog()->debugStream() << "head selection change : " << head;
-    for (int i=0; i < MAX_HEADS; i++) {
+    for (int i=0; i < (int) outputs.size(); i++) {
         if (i == head) {
             outputs[i]->setBorderColour(Qt::red);
         } else {
@@ -243,7 +258,7 @@ bool ButtonWindow::saveFile()
 bool ButtonWindow::saveAsFile()
 {
     QString fn = QFileDialog::getSaveFileName(this,
-                 tr("Save File"), pathName, tr("Lucifer show (*.lsf)"));
+                 tr("Save File"), pathName, tr("Lucifer show (*.lsf);;Lucifer binary show (*.lsb)"));
     if (fn.isEmpty()) {
         return false;
     }
@@ -292,7 +307,7 @@ void ButtonWindow::openFile()
 {
     if (maybeSave()) {
         QString fn = QFileDialog::getOpenFileName(this,
-                     tr("Load File"), pathName, tr("Lucifer show (*.lsf)"));
+                     tr("Load File"), pathName, tr("Lucifer show (*.lsf *.lsb)"));
         if (!fn.isEmpty())
         {
             loadFile(fn);
@@ -357,7 +372,7 @@ void ButtonWindow::clearFullScreen()
 
 void ButtonWindow::selectionModeData(int mode)
 {
-    for (unsigned int i = 0; i < MAX_HEADS; i++) {
+    for (unsigned int i = 0; i < engine->headCount(); i++) {
         LaserHeadPtr h = engine->getHead(i);
         if (h) {
             h->setSelectionMode((PlaybackList::SelectionModes)mode);
@@ -367,7 +382,7 @@ void ButtonWindow::selectionModeData(int mode)
 
 void ButtonWindow::stepModeData(int mode)
 {
-    for (unsigned int i = 0; i < MAX_HEADS; i++) {
+    for (unsigned int i = 0; i < engine->headCount(); i++) {
         LaserHeadPtr h = engine->getHead(i);
         if (h) {
             h->setStepMode((PlaybackList::StepModes) mode);
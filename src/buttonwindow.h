@@ -57,6 +57,8 @@ private slots:
     void selectionModeData (int);
     void stepModeData (int);
     void headSelectionChanged (int);
+    /// Add or remove head output views to match the engine.
+    void headCountChanged (size_t);
 protected:
     void keyPressEvent(QKeyEvent *event);
 private:
@@ -96,7 +98,10 @@ private:
 
     EnginePtr engine;
 
-    OutputView *outputs[MAX_HEADS];
+    std::vector<OutputView *> outputs;
+    QFrame *headFrame;
+    QHBoxLayout *headLayout;
+    QSignalMapper *headMap;
 
     bool saveAs();
     void setCurrentFile(const QString &fn);
@@ -0,0 +1,249 @@
+/* channelmap.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <string.h>
+#include <QSettings>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "channelmap.h"
+#include "log.h"
+
+static const char * sourceNames[] = {"None","X","Y","Red","Green","Blue","Intensity",NULL};
+
+ChannelMap::ChannelMap()
+{
+    nchan = 0;
+    mix[0] = mix[1] = mix[2] = 1.0f/3.0f;
+    build();
+}
+
+ChannelMap::ChannelMap(const unsigned int channels)
+{
+    nchan = (channels > MAX_MAP_CHANNELS) ? MAX_MAP_CHANNELS : channels;
+    mix[0] = mix[1] = mix[2] = 1.0f/3.0f;
+    for (unsigned int i=0; i < MAX_MAP_CHANNELS; i++) {
+        // X,Y,R,G,B,I then nothing
+        source[i] = (i < 6) ? (SOURCE)(i + 1) : NONE;
+        invert[i] = false;
+        offset[i] = 0.0f;
+        gain[i] = 1.0f;
+    }
+    build();
+}
+
+ChannelMap ChannelMap::load(const unsigned int channels, const QString group)
+{
+    ChannelMap m(channels);
+    QSettings settings;
+    settings.beginGroup(group);
+    m.mix[0] = settings.value("Intensity Red",m.mix[0]).toFloat();
+    m.mix[1] = settings.value("Intensity Green",m.mix[1]).toFloat();
+    m.mix[2] = settings.value("Intensity Blue",m.mix[2]).toFloat();
+    for (unsigned int i=0; i < m.nchan; i++) {
+        settings.beginGroup(QString().sprintf("Channel %d",i+1));
+        QString s = settings.value("Source",sourceNames[m.source[i]]).toString();
+        for (unsigned int j=0; sourceNames[j]; j++) {
+            if (s == sourceNames[j]) {
+                m.source[i] = (SOURCE) j;
+            }
+        }
+        m.invert[i] = settings.value("Invert",false).toBool();
+        m.offset[i] = settings.value("Offset",0.0f).toFloat();
+        m.gain[i] = settings.value("Gain",1.0f).toFloat();
+        settings.endGroup();
+    }
+    settings.endGroup();
+    m.build();
+    return m;
+}
+
+void ChannelMap::save(const QString group) const
+{
+    QSettings settings;
+    settings.beginGroup(group);
+    settings.setValue("Intensity Red",mix[0]);
+    settings.setValue("Intensity Green",mix[1]);
+    settings.setValue("Intensity Blue",mix[2]);
+    for (unsigned int i=0; i < nchan; i++) {
+        settings.beginGroup(QString().sprintf("Channel %d",i+1));
+        settings.setValue("Source",sourceNames[source[i]]);
+        settings.setValue("Invert",invert[i]);
+        settings.setValue("Offset",offset[i]);
+        settings.setValue("Gain",gain[i]);
+        settings.endGroup();
+    }
+    settings.endGroup();
+}
+
+void ChannelMap::setChannel(const unsigned int chan, const ChannelMap::SOURCE s, const bool inv, const float off, const float g)
+{
+    if (chan >= nchan) {
+        slog()->errorStream() << "Attempted to map channel " << chan << " of " << nchan;
+        return;
+    }
+    source[chan] = s;
+    invert[chan] = inv;
+    offset[chan] = off;
+    gain[chan] = g;
+    build();
+}
+
+void ChannelMap::setIntensityMix(const float r, const float g, const float b)
+{
+    mix[0] = r;
+    mix[1] = g;
+    mix[2] = b;
+    build();
+}
+
+unsigned int ChannelMap::channels() const
+{
+    return nchan;
+}
+
+void ChannelMap::build()
+{
+    memset(matrix,0,sizeof(matrix));
+    for (unsigned int c=0; c < nchan; c++) {
+        const float g = invert[c] ? -gain[c] : gain[c];
+        switch (source[c]) {
+        case X:
+            matrix[0][c] = g;
+            break;
+        case Y:
+            matrix[1][c] = g;
+            break;
+        case RED:
+            matrix[2][c] = g;
+            break;
+        case GREEN:
+            matrix[3][c] = g;
+            break;
+        case BLUE:
+            matrix[4][c] = g;
+            break;
+        case INTENSITY:
+            matrix[2][c] = g * mix[0];
+            matrix[3][c] = g * mix[1];
+            matrix[4][c] = g * mix[2];
+            break;
+        case NONE:
+        default:
+            break;
+        }
+        matrix[5][c] = offset[c];
+    }
+}
+
+void ChannelMap::run(const PointF* in, const size_t count, float* out, const unsigned int stride) const
+{
+#ifdef __SSE__
+    // Four channels per step, the last partial group goes via a scratch register so we
+    // never write past the end of a frame (and so never past the end of the buffer).
+    const unsigned int full = nchan & ~3u;
+    for (size_t i=0; i < count; i++) {
+        const PointF &p = in[i];
+        const __m128 x = _mm_set1_ps(p.x);
+        const __m128 y = _mm_set1_ps(p.y);
+        const __m128 r = _mm_set1_ps(p.r);
+        const __m128 g = _mm_set1_ps(p.g);
+        const __m128 b = _mm_set1_ps(p.b);
+        float *o = out + i * stride;
+        unsigned int c;
+        for (c=0; c < nchan; c += 4) {
+            __m128 v = _mm_load_ps(&matrix[5][c]);
+            v = _mm_add_ps(v,_mm_mul_ps(x,_mm_load_ps(&matrix[0][c])));
+            v = _mm_add_ps(v,_mm_mul_ps(y,_mm_load_ps(&matrix[1][c])));
+            v = _mm_add_ps(v,_mm_mul_ps(r,_mm_load_ps(&matrix[2][c])));
+            v = _mm_add_ps(v,_mm_mul_ps(g,_mm_load_ps(&matrix[3][c])));
+            v = _mm_add_ps(v,_mm_mul_ps(b,_mm_load_ps(&matrix[4][c])));
+            if (c < full) {
+                _mm_storeu_ps(o + c,v);
+            } else {
+                float tmp[4] __attribute__ ((aligned (16)));
+                _mm_store_ps(tmp,v);
+                for (unsigned int k=0; c + k < nchan; k++) {
+                    o[c + k] = tmp[k];
+                }
+            }
+        }
+    }
+#else
+    for (size_t i=0; i < count; i++) {
+        const PointF &p = in[i];
+        float *o = out + i * stride;
+        for (unsigned int c=0; c < nchan; c++) {
+            o[c] = matrix[5][c] + p.x * matrix[0][c] + p.y * matrix[1][c] +
+                   p.r * matrix[2][c] + p.g * matrix[3][c] + p.b * matrix[4][c];
+        }
+    }
+#endif
+}
+
+void ChannelMap::run(const PointF* in, const size_t count, float** out) const
+{
+    // Channel at a time, each inner loop is a straight line the compiler can vectorise
+    for (unsigned int c=0; c < nchan; c++) {
+        float *o = out[c];
+        if (!o) {
+            continue;
+        }
+        const float mx = matrix[0][c];
+        const float my = matrix[1][c];
+        const float mr = matrix[2][c];
+        const float mg = matrix[3][c];
+        const float mb = matrix[4][c];
+        const float k = matrix[5][c];
+        for (size_t i=0; i < count; i++) {
+            o[i] = k + in[i].x * mx + in[i].y * my + in[i].r * mr + in[i].g * mg + in[i].b * mb;
+        }
+    }
+}
+
+void ChannelMap::fill(const PointF& p, const size_t count, float* out, const unsigned int stride) const
+{
+    float frame[MAX_MAP_CHANNELS];
+    run(&p,1,frame,MAX_MAP_CHANNELS);
+    for (size_t i=0; i < count; i++) {
+        memcpy(out + i * stride,frame,sizeof(float) * nchan);
+    }
+}
+
+void ChannelMap::fill(const PointF& p, const size_t count, float** out) const
+{
+    for (unsigned int c=0; c < nchan; c++) {
+        float *o = out[c];
+        if (!o) {
+            continue;
+        }
+        const float v = matrix[5][c] + p.x * matrix[0][c] + p.y * matrix[1][c] +
+                        p.r * matrix[2][c] + p.g * matrix[3][c] + p.b * matrix[4][c];
+        for (size_t i=0; i < count; i++) {
+            o[i] = v;
+        }
+    }
+}
+
+PointF ChannelMap::dark(const PointF& p)
+{
+    PointF d = p;
+    d.r = d.g = d.b = 0.0f;
+    return d;
+}
@@ -0,0 +1,82 @@
+/* channelmap.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef CHANNEL_MAP_INCL
+#define CHANNEL_MAP_INCL
+
+#include <QString>
+#include "driver.h"
+
+/// Most output channels a map can drive.
+#define MAX_MAP_CHANNELS (32)
+
+/// \brief Maps PointF values onto DAC output channels.
+///
+/// Each output channel is a weighted sum of x, y, r, g and b plus an offset, so channel
+/// selection, intensity mixing, inversion and offsets all fold into a single matrix that is
+/// built once when the driver connects. The realtime side is then one multiply accumulate
+/// pass over the points with no per sample branching.
+class ChannelMap
+{
+public:
+    /// What a channel carries.
+    enum SOURCE {NONE, X, Y, RED, GREEN, BLUE, INTENSITY};
+    ChannelMap();
+    /// \brief Build the default (X,Y,R,G,B,I) map for a number of channels.
+    ChannelMap (const unsigned int channels);
+    /// \brief Build a map from the settings stored in the QSettings group given.
+    /// Missing settings give the default layout.
+    static ChannelMap load (const unsigned int channels, const QString group);
+    /// \brief Store this maps settings to the QSettings group given.
+    void save (const QString group) const;
+    /// \brief Configure a channel.
+    void setChannel (const unsigned int chan, const SOURCE s, const bool invert = false,
+                     const float offset = 0.0f, const float gain = 1.0f);
+    /// \brief Set the r, g, b weights used to make the intensity channel.
+    void setIntensityMix (const float r, const float g, const float b);
+    unsigned int channels () const;
+    /// \brief Map a run of points to interleaved output.
+    /// @param[in] in is the points.
+    /// @param[in] count is the number of points.
+    /// @param[out] out is the first output sample, channel 0 of the first frame.
+    /// @param[in] stride is the number of floats between frames, at least channels().
+    void run (const PointF *in, const size_t count, float *out, const unsigned int stride) const;
+    /// \brief Map a run of points to one buffer per channel (JACK style).
+    void run (const PointF *in, const size_t count, float **out) const;
+    /// \brief Hold one point for a run of output frames, interleaved.
+    /// Blanking and underruns go through here rather than writing zeros, so an inverted or
+    /// offset channel still ends up dark.
+    void fill (const PointF &p, const size_t count, float *out, const unsigned int stride) const;
+    /// \brief Hold one point for a run of output frames, one buffer per channel.
+    void fill (const PointF &p, const size_t count, float **out) const;
+    /// @return p with the beam off, where to park while blanked.
+    static PointF dark (const PointF &p);
+private:
+    void build ();
+    unsigned int nchan;
+    SOURCE source[MAX_MAP_CHANNELS];
+    bool invert[MAX_MAP_CHANNELS];
+    float offset[MAX_MAP_CHANNELS];
+    float gain[MAX_MAP_CHANNELS];
+    float mix[3];
+    /// The matrix, column major, one row of MAX_MAP_CHANNELS per input (x,y,r,g,b,constant)
+    /// so the realtime loop works on four channels at a time.
+    float matrix[6][MAX_MAP_CHANNELS] __attribute__ ((aligned (16)));
+};
+
+#endif
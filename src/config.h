@@ -1,7 +1,15 @@
 #ifndef CONF_INCL
 #define CONF_INCL
 
-#define MAX_HEADS (8)
+/// Number of laser heads started when Engine/Heads has not been set.
+#define DEFAULT_HEADS (8)
+/// Journal size in bytes at which it is compacted when Engine/Journal/Compact size has not been set.
+#define JOURNAL_COMPACT_SIZE (16 * 1024 * 1024)
+/// Decimation tolerance in ILDA units when Engine/Import/Decimate tolerance has not been set.
+#define DECIMATE_TOLERANCE (16)
+/// Longest step in ILDA units decimation may leave between lit points when
+/// Engine/Import/Decimate max step has not been set, about what scanners can follow at 30k pps.
+#define DECIMATE_MAX_STEP (1024)
 
 
 #endif
\ No newline at end of file
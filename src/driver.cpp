@@ -22,9 +22,13 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <map>
 #include <vector>
+#include <string.h>
+#include <time.h>
 
 Driver::Driver()
 {
+    blank.store(0);
+    blankTimeNs.store(0);
     slog()->debugStream() << "Created output driver " << this;
 }
 
@@ -99,24 +103,117 @@ unsigned int Driver::ILDAHwPointsPerSecond()
     return 0;
 }
 
+size_t Driver::ILDAHwPeriod()
+{
+    return 0;
+}
+
+bool Driver::ILDARealTime()
+{
+    return true;
+}
+
 size_t Driver::ILDABufferFillStatus()
 {
-    assert (false);
+    assert (flags() & Driver::OUTPUTS_ILDA);
+    if (ildaRing) {
+        return ildaRing->writeSpace();
+    }
     return 0;
 }
 
-size_t Driver::ILDANewPoints(std::vector< PointF >&, size_t)
+size_t Driver::ILDABufferOccupancy()
 {
-    assert (false);
+    assert (flags() & Driver::OUTPUTS_ILDA);
+    if (ildaRing) {
+        return ildaRing->occupancy();
+    }
     return 0;
 }
 
+unsigned long Driver::ILDAUnderruns()
+{
+    if (ildaRing) {
+        return ildaRing->underruns();
+    }
+    return 0;
+}
+
+size_t Driver::ILDAReserve(PointF** region, size_t wanted)
+{
+    assert (flags() & Driver::OUTPUTS_ILDA);
+    if (ildaRing) {
+        return ildaRing->writeRegion(region,wanted);
+    }
+    *region = NULL;
+    return 0;
+}
+
+void Driver::ILDACommit(size_t count)
+{
+    assert (flags() & Driver::OUTPUTS_ILDA);
+    if (ildaRing) {
+        ildaRing->commitWrite(count);
+    }
+}
+
+size_t Driver::ILDANewPoints(std::vector< PointF >& pts, size_t offset)
+{
+    size_t done = 0;
+    while (offset + done < pts.size()) {
+        PointF *region;
+        const size_t n = ILDAReserve(&region,pts.size() - offset - done);
+        if (!n) {
+            break;
+        }
+        memcpy(region,&pts[offset + done],n * sizeof(PointF));
+        ILDACommit(n);
+        done += n;
+    }
+    return done;
+}
+
 bool Driver::ILDARequestMorePoints()
 {
     emit ILDARequestMoreData();
     return true;
 }
 
+void Driver::ILDABlank(const BLANK reason, const bool state)
+{
+    if (state) {
+        if (!blank.load()) {
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC,&ts);
+            blankTimeNs.store(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+        }
+        blank.fetch_or(reason);
+    } else {
+        blank.fetch_and(~reason);
+    }
+}
+
+unsigned int Driver::ILDABlanked() const
+{
+    return blank.load();
+}
+
+bool Driver::ILDABlankFlush()
+{
+    if (!blank.load(boost::memory_order_acquire)) {
+        return false;
+    }
+    if (ildaRing) {
+        ildaRing->discard(ildaRing->readAvailable());
+    }
+    return true;
+}
+
+double Driver::ILDABlankTime() const
+{
+    return blankTimeNs.load() * 1e-9;
+}
+
 std::vector<float> Driver::readAudio()
 {
     assert (false);
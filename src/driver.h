@@ -25,8 +25,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <vector>
 #include <qobject.h>
 #include "point.h"
+#include "pointring.h"
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/atomic.hpp>
 
 /// A fully floating point version of a Point, used in the output pipeline for improved
 /// precision when doing gamma calculations and the like and to avoid rounding errors in the resampler.
@@ -77,13 +79,47 @@ public:
     /// This can optionally be used to allow the software to control the safety interlock, set true on startup
     /// and false on failure of any of the self tests, assertions and watchdog timeouts.
     virtual bool ILDAInterlock (bool);
+    /// Returns the free space in the output buffer in points (NOT the number of points queued).
     virtual size_t ILDABufferFillStatus();
-    /// This is called to add new points to the output.
+    /// Returns the number of points queued for output.
+    virtual size_t ILDABufferOccupancy();
+    /// Returns the number of times the output ran dry.
+    virtual unsigned long ILDAUnderruns();
+    /// \brief Zero copy output, ask the driver for a writable region of its own buffer.
+    /// The head renders straight into the region then calls ILDACommit with the number of
+    /// points actually written. Only the head thread may call this pair.
+    /// @param[out] region is set to the start of the writable area.
+    /// @param[in] wanted is the most points the caller wants to write.
+    /// @return the number of points that may be written, 0 if the buffer is full.
+    virtual size_t ILDAReserve(PointF **region, size_t wanted);
+    /// \brief Hand count points written into the last reserved region to the hardware.
+    virtual void ILDACommit(size_t count);
+    /// This is called to add new points to the output, it copies them in with reserve/commit.
     virtual size_t ILDANewPoints(std::vector<PointF> &pts, size_t offset);
     /// Called to find out how many points per second the hardware can manage
     virtual unsigned int ILDAHwPointsPerSecond();
-    /// Call this from the driver to request the application to supply some more points
+    /// Returns the number of points the hardware takes from the buffer in one go (0 if unknown),
+    /// the head always keeps more than this queued whatever its latency setting.
+    virtual size_t ILDAHwPeriod();
+    /// Returns false if the driver takes points as fast as they can be made (rendering to a
+    /// file and the like), the head then fills its buffer flat out rather then pacing itself
+    /// against the point rate, and does not pad with blanking when there is nothing to play.
+    virtual bool ILDARealTime();
+    /// Call this from the driver to request the application to supply some more points.
+    /// Heads no longer wait for this, they refill the ring on their own deadline, it is
+    /// kept for drivers that want to nudge something else.
     bool ILDARequestMorePoints();
+    /// Reasons for blanking the output, any one of them set keeps it dark.
+    /// BLANK_TEST is the simulator's kill soak, so clearing it can never lift a real kill.
+    enum BLANK {BLANK_KILL=1, BLANK_WATCHDOG=2, BLANK_TEST=4};
+    /// \brief Emergency stop, safe to call from any thread.
+    /// While any reason is set every output callback emits zeros and throws away whatever the
+    /// head has queued, so the light goes out within one hardware buffer rather than when the
+    /// ring drains. The ring has a single consumer, which is why the flush happens in the
+    /// callback and not here.
+    void ILDABlank (const BLANK reason, const bool state);
+    /// @return the reasons the output is currently blanked for, 0 if it is not.
+    unsigned int ILDABlanked () const;
 
     /// DMX 512 interfacing functions
     /// Write a new block of values to the DMX TX buffer
@@ -121,5 +157,19 @@ public:
 		void AudioRequestMoreData();
 
     /// User configuration options for the drivers
+protected:
+    /// \brief The point ring between the head and the driver callback.
+    /// Drivers that create one get the ILDA buffer methods above for free, the head is the
+    /// producer and the driver output callback is the only consumer, see pointring.h.
+    PointRingPtr ildaRing;
+    /// \brief Call at the top of every output callback, from the consumer thread only.
+    /// @return true if the output is blanked, in which case the ring has been flushed and the
+    /// callback must output zeros for this buffer.
+    bool ILDABlankFlush ();
+    /// @return the monotonic time in seconds at which the output was last blanked.
+    double ILDABlankTime () const;
+private:
+    boost::atomic<unsigned int> blank;
+    boost::atomic<unsigned long long> blankTimeNs;
 };
 #endif
@@ -19,13 +19,14 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "driver_dummy_ilda.h"
 
 
-#define BUFFER_SZ (2000)
+#define BUFFER_SZ (4096)
+#define TICK_MS (10)
 
 
 Dummy_ILDA::Dummy_ILDA() : Driver()
 {
     connected_ = false;
-    buffer_fill_ = 0;
+    ildaRing = boost::make_shared<PointRing>(BUFFER_SZ);
     timer_ = new QTimer(this);
     QObject::connect(timer_,SIGNAL(timeout()),this,SLOT(timeout()));
 }
@@ -40,8 +41,7 @@ bool Dummy_ILDA::connect(unsigned int index)
         return false;
     }
     connected_ = true;
-    buffer_fill_ = 0;
-    timer_->start(33);
+    timer_->start(TICK_MS);
     return true;
 }
 
@@ -84,30 +84,17 @@ bool Dummy_ILDA::connnected()
     return connected_;
 }
 
-size_t Dummy_ILDA::ILDANewPoints(std::vector< PointF >& pts, size_t offset)
-{
-    size_t space = BUFFER_SZ - buffer_fill_;
-    size_t used = pts.size() - offset;
-    if (space < used) {
-        used = space;
-    }
-    buffer_fill_ += used;
-    return used;
-}
-
-size_t Dummy_ILDA::ILDABufferFillStatus()
-{
-    return BUFFER_SZ - buffer_fill_;
-}
-
 void Dummy_ILDA::timeout()
 {
-    if (buffer_fill_ > 1000) {
-        buffer_fill_ -= 1000;
-    } else {
-        buffer_fill_ = 0;
+    // Throw away one ticks worth of points, this is the only consumer of the ring.
+    if (ILDABlankFlush()) {
+        return;
+    }
+    const size_t want = ILDAHwPointsPerSecond() * TICK_MS / 1000;
+    const size_t got = ildaRing->discard(want);
+    if (got < want) {
+        ildaRing->noteUnderrun(want - got);
     }
-    ILDARequestMorePoints();
 }
 
 /// This boilerplate registers the driver with the system so that it can appear in menus and the like
@@ -35,13 +35,10 @@ public:
 
     bool ILDAShutter (bool);
     bool ILDAInterlock (bool);
-    size_t ILDABufferFillStatus();
-    size_t ILDANewPoints (std::vector<PointF> &pts, size_t offset);
     unsigned int ILDAHwPointsPerSecond();
 private:
     bool connected_;
     QTimer *timer_;
-    size_t buffer_fill_;
 private slots:
     void timeout();
 };
@@ -0,0 +1,643 @@
+/* driver_etherdream.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "driver_etherdream.h"
+#include "etherdream_emulator.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <QSettings>
+#include <boost/make_shared.hpp>
+#include "log.h"
+
+/// Ring size in points.
+#define ED_RING_SZ (16384)
+/// Time to listen for DAC broadcasts, they come once a second.
+#define ED_DISCOVERY_MS (1200)
+/// Aim for batches of about this much output, more if the round trip is slow.
+#define ED_BATCH_MS (5)
+/// Limits on a single data command.
+#define ED_MIN_BATCH (64)
+#define ED_MAX_BATCH (1024)
+/// Smallest buffer we will drive, three minimum batches. A unit claiming less is broken or
+/// still booting, and a capacity of 0 would wrap the fill target round to SIZE_MAX.
+#define ED_MIN_CAPACITY (3 * ED_MIN_BATCH)
+/// How much output to keep queued in the DAC.
+#define ED_TARGET_MS (12)
+/// Ping the DAC if nothing else has been sent for this long.
+#define ED_PING_MS (100)
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void edPut16(unsigned char* buf, const unsigned short v)
+{
+    buf[0] = v & 0xff;
+    buf[1] = v >> 8;
+}
+
+void edPut32(unsigned char* buf, const unsigned int v)
+{
+    buf[0] = v & 0xff;
+    buf[1] = (v >> 8) & 0xff;
+    buf[2] = (v >> 16) & 0xff;
+    buf[3] = v >> 24;
+}
+
+unsigned short edGet16(const unsigned char* buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+unsigned int edGet32(const unsigned char* buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((unsigned int) buf[3] << 24);
+}
+
+static inline float clampf(const float v, const float lo, const float hi)
+{
+    return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+void edPackPoint(unsigned char* buf, const PointF& p)
+{
+    const float r = clampf(p.r,0.0f,1.0f);
+    const float g = clampf(p.g,0.0f,1.0f);
+    const float b = clampf(p.b,0.0f,1.0f);
+    float i = (r > g) ? r : g;
+    i = (i > b) ? i : b;
+    edPut16(buf,0); // control
+    edPut16(buf + 2,(unsigned short)(short)(clampf(p.x,-1.0f,1.0f) * 32767.0f));
+    edPut16(buf + 4,(unsigned short)(short)(clampf(p.y,-1.0f,1.0f) * 32767.0f));
+    edPut16(buf + 6,(unsigned short)(r * 65535.0f));
+    edPut16(buf + 8,(unsigned short)(g * 65535.0f));
+    edPut16(buf + 10,(unsigned short)(b * 65535.0f));
+    edPut16(buf + 12,(unsigned short)(i * 65535.0f));
+    edPut16(buf + 14,0);
+    edPut16(buf + 16,0);
+}
+
+bool edSendAll(int fd, const unsigned char* buf, size_t len)
+{
+    while (len) {
+        const ssize_t n = send(fd,buf,len,MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool edRecvAll(int fd, unsigned char* buf, size_t len, int timeoutMs)
+{
+    while (len) {
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        const int r = poll(&pfd,1,timeoutMs);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        const ssize_t n = recv(fd,buf,len,0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+EtherDreamStatus::EtherDreamStatus()
+{
+    protocol = 0;
+    lightEngineState = ED_LIGHT_READY;
+    playbackState = ED_PLAYBACK_IDLE;
+    source = 0;
+    lightEngineFlags = 0;
+    playbackFlags = 0;
+    sourceFlags = 0;
+    bufferFullness = 0;
+    pointRate = 0;
+    pointCount = 0;
+}
+
+void EtherDreamStatus::pack(unsigned char* buf) const
+{
+    buf[0] = protocol;
+    buf[1] = lightEngineState;
+    buf[2] = playbackState;
+    buf[3] = source;
+    edPut16(buf + 4,lightEngineFlags);
+    edPut16(buf + 6,playbackFlags);
+    edPut16(buf + 8,sourceFlags);
+    edPut16(buf + 10,bufferFullness);
+    edPut32(buf + 12,pointRate);
+    edPut32(buf + 16,pointCount);
+}
+
+void EtherDreamStatus::unpack(const unsigned char* buf)
+{
+    protocol = buf[0];
+    lightEngineState = buf[1];
+    playbackState = buf[2];
+    source = buf[3];
+    lightEngineFlags = edGet16(buf + 4);
+    playbackFlags = edGet16(buf + 6);
+    sourceFlags = edGet16(buf + 8);
+    bufferFullness = edGet16(buf + 10);
+    pointRate = edGet32(buf + 12);
+    pointCount = edGet32(buf + 16);
+}
+
+EtherDreamThread::EtherDreamThread(EtherDream_ILDA* d, const EtherDreamDAC& da, const unsigned int r) : QThread()
+{
+    driver = d;
+    dac = da;
+    rate = r;
+    sock = -1;
+    statusTime = now();
+    rtt = 0.001;
+    packet.resize(3 + ED_MAX_BATCH * ED_POINT_SZ);
+    batch_.store(ED_MIN_BATCH);
+    stopping.store(false);
+    up_.store(false);
+}
+
+EtherDreamThread::~EtherDreamThread()
+{
+    stop();
+    wait();
+}
+
+void EtherDreamThread::stop()
+{
+    stopping.store(true);
+}
+
+bool EtherDreamThread::up() const
+{
+    return up_.load();
+}
+
+size_t EtherDreamThread::batch() const
+{
+    return batch_.load();
+}
+
+void EtherDreamThread::run()
+{
+    slog()->infoStream() << "Ether Dream thread started for " << dac.name;
+    while (!stopping.load()) {
+        if (!session() && !stopping.load()) {
+            slog()->errorStream() << "Lost connection to " << dac.name << ", retrying";
+            // Keep the head running while we are down, nothing would play anyway
+            driver->ildaRing->discard(driver->ildaRing->capacity());
+            usleep(500000);
+        }
+    }
+    slog()->infoStream() << "Ether Dream thread for " << dac.name << " exited";
+}
+
+bool EtherDreamThread::session()
+{
+    sock = socket(AF_INET,SOCK_STREAM,0);
+    if (sock < 0) {
+        return false;
+    }
+    // Connect with a timeout so a vanished DAC cannot hang the thread
+    fcntl(sock,F_SETFL,fcntl(sock,F_GETFL) | O_NONBLOCK);
+    int r = ::connect(sock,(sockaddr *)&dac.addr,sizeof(dac.addr));
+    if (r < 0 && errno == EINPROGRESS) {
+        pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLOUT;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if ((poll(&pfd,1,1000) == 1) && !getsockopt(sock,SOL_SOCKET,SO_ERROR,&err,&len) && !err) {
+            r = 0;
+        }
+    }
+    if (r < 0) {
+        close(sock);
+        sock = -1;
+        return false;
+    }
+    fcntl(sock,F_SETFL,fcntl(sock,F_GETFL) & ~O_NONBLOCK);
+    int one = 1;
+    setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    // The DAC greets us with its status
+    unsigned char buf[ED_RESPONSE_SZ];
+    bool ok = edRecvAll(sock,buf,ED_RESPONSE_SZ,1000);
+    if (ok) {
+        status.unpack(buf + 2);
+        statusTime = now();
+        slog()->infoStream() << "Connected to " << dac.name;
+        up_.store(true);
+        ok = stream();
+        up_.store(false);
+        if (ok) {
+            command(ED_CMD_STOP);
+        }
+    }
+    close(sock);
+    sock = -1;
+    return ok;
+}
+
+char EtherDreamThread::command(const unsigned char* buf, const size_t len)
+{
+    const double t0 = now();
+    unsigned char resp[ED_RESPONSE_SZ];
+    if (!edSendAll(sock,buf,len) || !edRecvAll(sock,resp,ED_RESPONSE_SZ,1000)) {
+        return 0;
+    }
+    if (resp[1] != buf[0]) {
+        slog()->errorStream() << "Ether Dream response for '" << (char) resp[1] << "' when we sent '" << (char) buf[0] << "'";
+        return 0;
+    }
+    status.unpack(resp + 2);
+    statusTime = now();
+    rtt = 0.9 * rtt + 0.1 * (statusTime - t0);
+    return (char) resp[0];
+}
+
+char EtherDreamThread::command(const char c)
+{
+    const unsigned char buf = c;
+    return command(&buf,1);
+}
+
+size_t EtherDreamThread::estimateFullness() const
+{
+    if (status.playbackState != ED_PLAYBACK_PLAYING) {
+        return status.bufferFullness;
+    }
+    const double played = (now() - statusTime) * status.pointRate;
+    if (played >= status.bufferFullness) {
+        return 0;
+    }
+    return status.bufferFullness - (size_t) played;
+}
+
+bool EtherDreamThread::sendData(size_t n)
+{
+    PointRingPtr ring = driver->ildaRing;
+    packet[0] = ED_CMD_DATA;
+    size_t done = 0;
+    while (done < n) {
+        const PointF *span;
+        const size_t got = ring->readRegion(&span,n - done);
+        if (!got) {
+            break;
+        }
+        for (size_t i=0; i < got; i++) {
+            edPackPoint(&packet[3 + (done + i) * ED_POINT_SZ],span[i]);
+        }
+        ring->commitRead(got);
+        done += got;
+    }
+    edPut16(&packet[1],done);
+    const char r = command(&packet[0],3 + done * ED_POINT_SZ);
+    if (!r) {
+        return false;
+    }
+    if (r == ED_NAK_FULL) {
+        // Our estimate was off, the status we just got will put it right
+        slog()->debugStream() << "Ether Dream buffer full, dropped " << done << " points";
+    }
+    return true;
+}
+
+bool EtherDreamThread::stream()
+{
+    PointRingPtr ring = driver->ildaRing;
+    bool estopped = false;
+    double lastSend = now();
+    while (!stopping.load()) {
+        const bool blanked = driver->ILDABlankFlush();
+        if (blanked || !driver->interlock.load()) {
+            // Interlock open or output killed, stop the DAC dead and throw away whatever the head sends
+            if (!estopped) {
+                if (!command(ED_CMD_ESTOP)) {
+                    return false;
+                }
+                slog()->critStream() << (blanked ? "Output killed, " : "Interlock open, ") << dac.name << " emergency stopped";
+                estopped = true;
+                lastSend = now();
+            }
+            ring->discard(ring->capacity());
+            if (now() - lastSend > ED_PING_MS / 1000.0) {
+                if (!command(ED_CMD_PING)) {
+                    return false;
+                }
+                lastSend = now();
+            }
+            usleep(5000);
+            continue;
+        }
+        if (status.lightEngineState == ED_LIGHT_ESTOP) {
+            if (!command(ED_CMD_CLEAR_ESTOP)) {
+                return false;
+            }
+            estopped = false;
+            if (status.lightEngineState == ED_LIGHT_ESTOP) {
+                // Something on the DAC side is holding it stopped
+                ring->discard(ring->capacity());
+                usleep(100000);
+            }
+            continue;
+        }
+        if (status.playbackState == ED_PLAYBACK_IDLE) {
+            if (status.playbackFlags & ED_PLAYBACK_FLAG_UNDERFLOW) {
+                ring->noteUnderrun(0);
+                slog()->debugStream() << dac.name << " underflowed";
+            }
+            if (!command(ED_CMD_PREPARE)) {
+                return false;
+            }
+            lastSend = now();
+            continue;
+        }
+        // Batches must cover a couple of round trips or the DAC drains while we wait for acks
+        double batchTime = ED_BATCH_MS / 1000.0;
+        if (batchTime < 2.0 * rtt) {
+            batchTime = 2.0 * rtt;
+        }
+        size_t b = (size_t)(rate * batchTime);
+        b = (b < ED_MIN_BATCH) ? ED_MIN_BATCH : ((b > ED_MAX_BATCH) ? ED_MAX_BATCH : b);
+        if (b > dac.capacity / 3) {
+            b = dac.capacity / 3;
+        }
+        batch_.store(b);
+        size_t target = rate * ED_TARGET_MS / 1000;
+        if (target < 2 * b) {
+            target = 2 * b;
+        }
+        if (target > dac.capacity - 1) {
+            target = dac.capacity - 1;
+        }
+        const size_t full = estimateFullness();
+        const size_t want = (target > full) ? target - full : 0;
+        const size_t avail = ring->readAvailable();
+        const bool priming = status.playbackState == ED_PLAYBACK_PREPARED;
+        if (want && avail && ((want >= b && avail >= b) || priming)) {
+            size_t n = want;
+            n = (n > avail) ? avail : n;
+            n = (n > ED_MAX_BATCH) ? ED_MAX_BATCH : n;
+            if (!sendData(n)) {
+                return false;
+            }
+            lastSend = now();
+            if (priming && status.bufferFullness >= target) {
+                unsigned char begin[7];
+                begin[0] = ED_CMD_BEGIN;
+                edPut16(begin + 1,0);
+                edPut32(begin + 3,rate);
+                if (!command(begin,7)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+        if (now() - lastSend > ED_PING_MS / 1000.0) {
+            if (!command(ED_CMD_PING)) {
+                return false;
+            }
+            lastSend = now();
+            continue;
+        }
+        // Sleep until there will be room for a whole batch, or briefly if we are waiting on the head
+        double sleep = 0.001;
+        if ((avail >= b) && (full + b > target) && status.pointRate) {
+            sleep = (double)(full + b - target) / status.pointRate;
+        }
+        sleep = (sleep < 0.0005) ? 0.0005 : ((sleep > 0.01) ? 0.01 : sleep);
+        usleep((useconds_t)(sleep * 1e6));
+    }
+    return true;
+}
+
+EtherDream_ILDA::EtherDream_ILDA() : Driver()
+{
+    thread = NULL;
+    emulator = NULL;
+    rate = 0;
+    shutter = false;
+    interlock.store(true);
+    ildaRing = boost::make_shared<PointRing>(ED_RING_SZ);
+}
+
+EtherDream_ILDA::~EtherDream_ILDA()
+{
+    disconnect();
+}
+
+std::vector<std::string> EtherDream_ILDA::enumerateHardware()
+{
+    std::vector<std::string> res;
+    dacs.clear();
+    int fd = socket(AF_INET,SOCK_DGRAM,0);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+        sockaddr_in addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(ED_BROADCAST_PORT);
+        if (bind(fd,(sockaddr *)&addr,sizeof(addr))) {
+            slog()->errorStream() << "Could not listen for Ether Dream broadcasts : " << strerror(errno);
+        } else {
+            const double deadline = now() + ED_DISCOVERY_MS / 1000.0;
+            double t;
+            while ((t = now()) < deadline) {
+                pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = POLLIN;
+                if (poll(&pfd,1,(int)((deadline - t) * 1000) + 1) <= 0) {
+                    continue;
+                }
+                unsigned char buf[64];
+                sockaddr_in from;
+                socklen_t len = sizeof(from);
+                const ssize_t n = recvfrom(fd,buf,sizeof(buf),0,(sockaddr *)&from,&len);
+                if (n < ED_BROADCAST_SZ) {
+                    continue;
+                }
+                bool seen = false;
+                for (unsigned int i=0; i < dacs.size(); i++) {
+                    seen |= dacs[i].addr.sin_addr.s_addr == from.sin_addr.s_addr;
+                }
+                if (seen) {
+                    continue;
+                }
+                EtherDreamDAC d;
+                d.addr = from;
+                d.addr.sin_port = htons(ED_COMMAND_PORT);
+                d.capacity = edGet16(buf + 10);
+                if (d.capacity < ED_MIN_CAPACITY) {
+                    slog()->errorStream() << "Ignoring Ether Dream at " << inet_ntoa(from.sin_addr) << " reporting a "
+                                          << d.capacity << " point buffer";
+                    continue;
+                }
+                d.maxRate = edGet32(buf + 12);
+                d.emulated = false;
+                d.name = QString().sprintf("Ether Dream %02x%02x%02x at %s",buf[3],buf[4],buf[5],inet_ntoa(from.sin_addr)).toStdString();
+                dacs.push_back(d);
+                slog()->infoStream() << "Found " << d.name << " (" << d.capacity << " points, " << d.maxRate << " pps)";
+            }
+        }
+        close(fd);
+    }
+    // Always offer the emulator so the driver can be exercised without hardware
+    EtherDreamDAC e;
+    memset(&e.addr,0,sizeof(e.addr));
+    e.addr.sin_family = AF_INET;
+    e.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    e.capacity = ED_DEFAULT_CAPACITY;
+    e.maxRate = 100000;
+    e.emulated = true;
+    e.name = "Ether Dream emulator (loopback)";
+    dacs.push_back(e);
+    for (unsigned int i=0; i < dacs.size(); i++) {
+        res.push_back(dacs[i].name);
+    }
+    return res;
+}
+
+bool EtherDream_ILDA::connect(unsigned int index)
+{
+    if (index >= dacs.size()) {
+        slog()->errorStream() << "Attempted to connect to invalid Ether Dream";
+        return false;
+    }
+    disconnect();
+    EtherDreamDAC dac = dacs[index];
+    if (dac.emulated) {
+        emulator = new EtherDreamEmulator(dac.capacity,dac.maxRate);
+        emulator->start();
+        const unsigned short port = emulator->port();
+        if (!port) {
+            delete emulator;
+            emulator = NULL;
+            return false;
+        }
+        dac.addr.sin_port = htons(port);
+    }
+    QSettings settings;
+    settings.beginGroup("Drivers/Ether Dream (ILDA)");
+    rate = settings.value("Point rate",30000).toUInt();
+    settings.endGroup();
+    if (dac.maxRate && rate > dac.maxRate) {
+        rate = dac.maxRate;
+    }
+    ildaRing->discard(ildaRing->capacity());
+    thread = new EtherDreamThread(this,dac,rate);
+    thread->start(QThread::TimeCriticalPriority);
+    emit ILDAHwPPSChanged(rate);
+    slog()->infoStream() << "Streaming to " << dac.name << " at " << rate << " pps";
+    return true;
+}
+
+bool EtherDream_ILDA::connected()
+{
+    return thread && thread->up();
+}
+
+bool EtherDream_ILDA::disconnect()
+{
+    if (!thread) {
+        return false;
+    }
+    delete thread;
+    thread = NULL;
+    if (emulator) {
+        slog()->infoStream() << "Emulator received " << emulator->pointsReceived() << " points, played "
+                             << emulator->pointsPlayed() << ", " << emulator->underflows() << " underflows";
+        delete emulator;
+        emulator = NULL;
+    }
+    return true;
+}
+
+Driver::FLAGS EtherDream_ILDA::flags()
+{
+    return Driver::OUTPUTS_ILDA;
+}
+
+bool EtherDream_ILDA::ILDAInterlock(bool state)
+{
+    interlock.store(state);
+    return state;
+}
+
+bool EtherDream_ILDA::ILDAShutter(bool state)
+{
+    shutter = state;
+    return state;
+}
+
+unsigned int EtherDream_ILDA::ILDAHwPointsPerSecond()
+{
+    return rate;
+}
+
+size_t EtherDream_ILDA::ILDAHwPeriod()
+{
+    return thread ? thread->batch() : 0;
+}
+
+/// This boilerplate registers the driver with the system so that it can appear in menus and the like
+
+static DriverPtr makeEtherDreamILDA()
+{
+    return boost::make_shared<EtherDream_ILDA>();
+}
+
+class GenEtherDream_ILDA
+{
+public:
+    GenEtherDream_ILDA () {
+        Driver::registerDriverFactory ("Ether Dream (ILDA)",makeEtherDreamILDA);
+    }
+};
+
+static GenEtherDream_ILDA etherdream_ilda;
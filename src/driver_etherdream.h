@@ -0,0 +1,180 @@
+/* driver_etherdream.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef DRIVER_ETHERDREAM_INCL
+#define DRIVER_ETHERDREAM_INCL
+
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <QtCore>
+#include <boost/atomic.hpp>
+#include "driver.h"
+
+/// Ether Dream compatible network DAC.
+
+/// The DAC announces itself with a UDP broadcast on ED_BROADCAST_PORT once a second and
+/// takes commands over TCP on ED_COMMAND_PORT. Every command gets a 22 byte response
+/// carrying the DAC status, including how full its point buffer is, which is all the flow
+/// control there is. All multi byte values are little endian on the wire.
+
+#define ED_COMMAND_PORT (7765)
+#define ED_BROADCAST_PORT (7654)
+/// Bytes in a status block, a response and a point.
+#define ED_STATUS_SZ (20)
+#define ED_RESPONSE_SZ (22)
+#define ED_POINT_SZ (18)
+/// Bytes in a broadcast packet.
+#define ED_BROADCAST_SZ (36)
+/// Point buffer size of a real Ether Dream.
+#define ED_DEFAULT_CAPACITY (1799)
+
+/// Light engine states.
+enum {ED_LIGHT_READY = 0, ED_LIGHT_WARMUP = 1, ED_LIGHT_COOLDOWN = 2, ED_LIGHT_ESTOP = 3};
+/// Playback states.
+enum {ED_PLAYBACK_IDLE = 0, ED_PLAYBACK_PREPARED = 1, ED_PLAYBACK_PLAYING = 2};
+/// Playback flags.
+#define ED_PLAYBACK_FLAG_UNDERFLOW (4)
+/// Response codes.
+#define ED_ACK ('a')
+#define ED_NAK_FULL ('F')
+#define ED_NAK_INVALID ('I')
+#define ED_NAK_STOP ('!')
+/// Command codes.
+#define ED_CMD_PREPARE ('p')
+#define ED_CMD_BEGIN ('b')
+#define ED_CMD_RATE ('q')
+#define ED_CMD_DATA ('d')
+#define ED_CMD_STOP ('s')
+#define ED_CMD_ESTOP ((char)0xff)
+#define ED_CMD_CLEAR_ESTOP ('c')
+#define ED_CMD_PING ('?')
+
+/// \brief The status block sent with every response and broadcast, in host order.
+class EtherDreamStatus
+{
+public:
+    EtherDreamStatus();
+    unsigned char protocol;
+    unsigned char lightEngineState;
+    unsigned char playbackState;
+    unsigned char source;
+    unsigned short lightEngineFlags;
+    unsigned short playbackFlags;
+    unsigned short sourceFlags;
+    unsigned short bufferFullness;
+    unsigned int pointRate;
+    unsigned int pointCount;
+    void pack (unsigned char *buf) const;
+    void unpack (const unsigned char *buf);
+};
+
+/// Wire helpers shared with the emulator.
+void edPut16 (unsigned char *buf, const unsigned short v);
+void edPut32 (unsigned char *buf, const unsigned int v);
+unsigned short edGet16 (const unsigned char *buf);
+unsigned int edGet32 (const unsigned char *buf);
+/// \brief Convert one point to the 18 byte wire format.
+void edPackPoint (unsigned char *buf, const PointF &p);
+/// \brief Send all of a buffer, false if the connection failed.
+bool edSendAll (int fd, const unsigned char *buf, size_t len);
+/// \brief Receive exactly len bytes, false on error, disconnection or timeout.
+bool edRecvAll (int fd, unsigned char *buf, size_t len, int timeoutMs);
+
+class EtherDream_ILDA;
+class EtherDreamEmulator;
+
+/// \brief One DAC found by enumerateHardware.
+class EtherDreamDAC
+{
+public:
+    std::string name;
+    sockaddr_in addr;
+    unsigned int capacity;
+    unsigned int maxRate;
+    /// True for the loopback emulator entry.
+    bool emulated;
+};
+
+/// \brief Owns the TCP connection to the DAC and is the consumer of the point ring.
+/// Points are sent in batches sized to the point rate and the measured round trip time,
+/// only as many as the DAC is estimated to have room for given the fullness it last
+/// reported and the time since. The connection is re established if it drops.
+class EtherDreamThread : public QThread
+{
+    Q_OBJECT
+public:
+    EtherDreamThread (EtherDream_ILDA *driver, const EtherDreamDAC &dac, const unsigned int rate);
+    ~EtherDreamThread();
+    void run();
+    /// \brief Ask the thread to close the connection and exit.
+    void stop();
+    bool up () const;
+    /// @return the current batch size in points.
+    size_t batch () const;
+private:
+    bool session ();
+    bool stream ();
+    /// \brief Send a command and wait for its response, updating the status.
+    /// @return the response code or 0 if the connection failed.
+    char command (const unsigned char *buf, const size_t len);
+    char command (const char c);
+    bool sendData (size_t n);
+    size_t estimateFullness () const;
+    EtherDream_ILDA *driver;
+    EtherDreamDAC dac;
+    unsigned int rate;
+    int sock;
+    EtherDreamStatus status;
+    /// When the status was received, for estimating how much the DAC has played since.
+    double statusTime;
+    /// Smoothed command round trip time in seconds.
+    double rtt;
+    std::vector<unsigned char> packet;
+    boost::atomic<size_t> batch_;
+    boost::atomic<bool> stopping;
+    boost::atomic<bool> up_;
+};
+
+class EtherDream_ILDA : public Driver
+{
+public:
+    EtherDream_ILDA();
+    ~EtherDream_ILDA();
+    Driver::FLAGS flags();
+    std::vector<std::string> enumerateHardware();
+    bool connect (unsigned int index);
+    bool connected();
+    bool disconnect();
+
+    bool ILDAShutter (bool);
+    bool ILDAInterlock (bool);
+    unsigned int ILDAHwPointsPerSecond();
+    size_t ILDAHwPeriod();
+private:
+    std::vector<EtherDreamDAC> dacs;
+    EtherDreamThread *thread;
+    EtherDreamEmulator *emulator;
+    unsigned int rate;
+    bool shutter;
+    /// Cleared by ILDAInterlock(false), the socket thread then estops the DAC.
+    boost::atomic<bool> interlock;
+    friend class EtherDreamThread;
+};
+
+#endif
@@ -0,0 +1,369 @@
+/* driver_filesink.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "driver_filesink.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <QSettings>
+#include <boost/make_shared.hpp>
+#include "log.h"
+
+/// Ring size in points, big so the head can run well ahead of the disk.
+#define SINK_RING_SZ (65536)
+/// Most points taken from the ring in one go.
+#define SINK_CHUNK (4096)
+/// WAV output channels, X,Y,R,G,B,I.
+#define SINK_WAV_CHANNELS (6)
+/// Bytes of WAV header before the sample data.
+#define SINK_WAV_HEADER (58)
+/// Bytes in an ILDA section header and a format 5 point.
+#define SINK_ILDA_HEADER (32)
+#define SINK_ILDA_POINT (8)
+
+static const char * formatNames[] = {"Raw float (x,y,r,g,b)","WAV (float, X,Y,R,G,B,I)","ILDA (format 5)"};
+static const char * formatExtensions[] = {"f32","wav","ild"};
+
+static void put16le(char *buf, const unsigned int v)
+{
+    buf[0] = v & 0xff;
+    buf[1] = (v >> 8) & 0xff;
+}
+
+static void put32le(char *buf, const unsigned int v)
+{
+    put16le(buf,v & 0xffff);
+    put16le(buf + 2,v >> 16);
+}
+
+static void put16be(char *buf, const unsigned int v)
+{
+    buf[0] = (v >> 8) & 0xff;
+    buf[1] = v & 0xff;
+}
+
+static inline float clampf(const float v, const float lo, const float hi)
+{
+    return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+FileSinkThread::FileSinkThread(FileSink_ILDA* d, const QString filename, const FileSinkThread::FORMAT f, const unsigned int p) :
+    QThread(), file(filename)
+{
+    driver = d;
+    format = f;
+    pps = p;
+    points = 0;
+    ildaPoints = 0;
+    stopping.store(false);
+    map = ChannelMap::load(SINK_WAV_CHANNELS,"Drivers/File sink (ILDA)");
+    QSettings settings;
+    settings.beginGroup("Drivers/File sink (ILDA)");
+    ildaFramePoints = settings.value("ILDA frame points",1000).toUInt();
+    settings.endGroup();
+    if (ildaFramePoints < 1 || ildaFramePoints > 0xffff) {
+        ildaFramePoints = 1000;
+    }
+    ok_ = file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    if (!ok_) {
+        slog()->errorStream() << "File sink could not open " << filename.toStdString() << " for writing";
+    }
+}
+
+FileSinkThread::~FileSinkThread()
+{
+    stop();
+    wait();
+}
+
+void FileSinkThread::stop()
+{
+    stopping.store(true);
+}
+
+bool FileSinkThread::ok() const
+{
+    return ok_;
+}
+
+void FileSinkThread::run()
+{
+    if (!ok_) {
+        return;
+    }
+    writeHeader();
+    PointRingPtr ring = driver->ildaRing;
+    QTime timer;
+    timer.start();
+    int lastReport = 0;
+    while (true) {
+        if (driver->ILDABlankFlush()) {
+            // Killed output is simply left out of the render
+            if (stopping.load()) {
+                break;
+            }
+            usleep(1000);
+            continue;
+        }
+        const PointF *span;
+        const size_t got = ring->readRegion(&span,SINK_CHUNK);
+        if (got) {
+            writePoints(span,got);
+            ring->commitRead(got);
+            points += got;
+        } else if (stopping.load()) {
+            break;
+        } else {
+            usleep(1000);
+        }
+        if (timer.elapsed() - lastReport > 5000) {
+            lastReport = timer.elapsed();
+            slog()->debugStream() << "File sink " << points << " points written, "
+                                  << (double) points * 1000.0 / lastReport << " points per second";
+        }
+    }
+    finish();
+    const double secs = timer.elapsed() / 1000.0;
+    slog()->infoStream() << "File sink wrote " << points << " points (" << (double) points / pps << "s of output) to "
+                         << file.fileName().toStdString() << " in " << secs << "s, "
+                         << ((secs > 0.0) ? points / secs : 0.0) << " points per second, "
+                         << ((secs > 0.0) ? file.size() / secs / 1048576.0 : 0.0) << " MB/s";
+    file.close();
+}
+
+void FileSinkThread::writeHeader()
+{
+    if (format == WAV) {
+        // Sizes are patched in by finish()
+        char h[SINK_WAV_HEADER];
+        memcpy(h,"RIFF",4);
+        put32le(h + 4,0);
+        memcpy(h + 8,"WAVEfmt ",8);
+        put32le(h + 16,18);
+        put16le(h + 20,3); // IEEE float
+        put16le(h + 22,SINK_WAV_CHANNELS);
+        put32le(h + 24,pps);
+        put32le(h + 28,pps * SINK_WAV_CHANNELS * sizeof(float));
+        put16le(h + 32,SINK_WAV_CHANNELS * sizeof(float));
+        put16le(h + 34,32);
+        put16le(h + 36,0);
+        memcpy(h + 38,"fact",4);
+        put32le(h + 42,4);
+        put32le(h + 46,0);
+        memcpy(h + 50,"data",4);
+        put32le(h + 54,0);
+        file.write(h,SINK_WAV_HEADER);
+    }
+}
+
+void FileSinkThread::writePoints(const PointF* p, const size_t n)
+{
+    switch (format) {
+    case RAW:
+        file.write((const char *)p,n * sizeof(PointF));
+        break;
+    case WAV:
+        samples.resize(n * SINK_WAV_CHANNELS);
+        map.run(p,n,&samples[0],SINK_WAV_CHANNELS);
+        file.write((const char *)&samples[0],samples.size() * sizeof(float));
+        break;
+    case ILDA:
+        for (size_t i=0; i < n; i++) {
+            if (ildaPoints == ildaFramePoints) {
+                flushILDAFrame();
+            }
+            if (ildaFrame.size() < (size_t)(ildaPoints + 1) * SINK_ILDA_POINT) {
+                ildaFrame.resize((ildaPoints + 1) * SINK_ILDA_POINT);
+            }
+            char *d = &ildaFrame[ildaPoints * SINK_ILDA_POINT];
+            const unsigned char r = (unsigned char)(clampf(p[i].r,0.0f,1.0f) * 255.0f);
+            const unsigned char g = (unsigned char)(clampf(p[i].g,0.0f,1.0f) * 255.0f);
+            const unsigned char b = (unsigned char)(clampf(p[i].b,0.0f,1.0f) * 255.0f);
+            put16be(d,(unsigned short)(short)(clampf(p[i].x,-1.0f,1.0f) * 32767.0f));
+            put16be(d + 2,(unsigned short)(short)(clampf(p[i].y,-1.0f,1.0f) * 32767.0f));
+            d[4] = (r | g | b) ? 0 : 64;
+            d[5] = b;
+            d[6] = g;
+            d[7] = r;
+            ildaPoints++;
+        }
+        break;
+    }
+}
+
+void FileSinkThread::flushILDAFrame()
+{
+    char h[SINK_ILDA_HEADER];
+    memset(h,0,SINK_ILDA_HEADER);
+    memcpy(h,"ILDA",4);
+    h[7] = 5;
+    memcpy(h + 8,"render  ",8);
+    memcpy(h + 16,"lucifer ",8);
+    put16be(h + 24,ildaPoints);
+    put16be(h + 26,ildaHeaders.size());
+    // Total frames goes in at the end
+    ildaHeaders.push_back(file.pos());
+    file.write(h,SINK_ILDA_HEADER);
+    if (ildaPoints) {
+        ildaFrame[(ildaPoints - 1) * SINK_ILDA_POINT + 4] |= 128; // Last point
+        file.write(&ildaFrame[0],ildaPoints * SINK_ILDA_POINT);
+    }
+    ildaPoints = 0;
+}
+
+void FileSinkThread::finish()
+{
+    char b[4];
+    if (format == WAV) {
+        const qint64 size = file.pos();
+        put32le(b,(unsigned int)(size - 8));
+        file.seek(4);
+        file.write(b,4);
+        put32le(b,(unsigned int)points);
+        file.seek(46);
+        file.write(b,4);
+        put32le(b,(unsigned int)(size - SINK_WAV_HEADER));
+        file.seek(54);
+        file.write(b,4);
+        if (size > 0xffffffffLL) {
+            slog()->errorStream() << "File sink WAV output is over 4GB, the header sizes are wrong";
+        }
+    } else if (format == ILDA) {
+        if (ildaPoints) {
+            flushILDAFrame();
+        }
+        const unsigned int frames = ildaHeaders.size();
+        flushILDAFrame();
+        put16be(b,frames);
+        for (unsigned int i=0; i < frames; i++) {
+            file.seek(ildaHeaders[i] + 28);
+            file.write(b,2);
+        }
+    }
+}
+
+FileSink_ILDA::FileSink_ILDA() : Driver()
+{
+    thread = NULL;
+    pps = 30000;
+    ildaRing = boost::make_shared<PointRing>(SINK_RING_SZ);
+}
+
+FileSink_ILDA::~FileSink_ILDA()
+{
+    disconnect();
+}
+
+std::vector<std::string> FileSink_ILDA::enumerateHardware()
+{
+    std::vector<std::string> res;
+    for (unsigned int i=0; i < 3; i++) {
+        res.push_back(formatNames[i]);
+    }
+    return res;
+}
+
+bool FileSink_ILDA::connect(unsigned int index)
+{
+    if (index > FileSinkThread::ILDA) {
+        slog()->errorStream() << "Attempted to connect to invalid file sink format";
+        return false;
+    }
+    disconnect();
+    static unsigned int serial = 0;
+    QSettings settings;
+    settings.beginGroup("Drivers/File sink (ILDA)");
+    QString dir = settings.value("Directory",QDir::homePath()).toString();
+    pps = settings.value("Point rate",30000).toUInt();
+    settings.endGroup();
+    if (!pps) {
+        pps = 30000;
+    }
+    QString name = QDir(dir).filePath(QString("lucifer-%1-%2.%3")
+                                      .arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss"))
+                                      .arg(++serial)
+                                      .arg(formatExtensions[index]));
+    ildaRing->discard(ildaRing->capacity());
+    thread = new FileSinkThread(this,name,(FileSinkThread::FORMAT) index,pps);
+    if (!thread->ok()) {
+        delete thread;
+        thread = NULL;
+        return false;
+    }
+    thread->start();
+    emit ILDAHwPPSChanged(pps);
+    slog()->infoStream() << "Rendering " << formatNames[index] << " to " << name.toStdString() << " at " << pps << " pps";
+    return true;
+}
+
+bool FileSink_ILDA::connected()
+{
+    return thread ? true : false;
+}
+
+bool FileSink_ILDA::disconnect()
+{
+    if (!thread) {
+        return false;
+    }
+    delete thread;
+    thread = NULL;
+    return true;
+}
+
+Driver::FLAGS FileSink_ILDA::flags()
+{
+    return Driver::OUTPUTS_ILDA;
+}
+
+bool FileSink_ILDA::ILDAInterlock(bool state)
+{
+    return state;
+}
+
+bool FileSink_ILDA::ILDAShutter(bool state)
+{
+    return state;
+}
+
+unsigned int FileSink_ILDA::ILDAHwPointsPerSecond()
+{
+    return pps;
+}
+
+bool FileSink_ILDA::ILDARealTime()
+{
+    return false;
+}
+
+/// This boilerplate registers the driver with the system so that it can appear in menus and the like
+
+static DriverPtr makeFileSinkILDA()
+{
+    return boost::make_shared<FileSink_ILDA>();
+}
+
+class GenFileSink_ILDA
+{
+public:
+    GenFileSink_ILDA () {
+        Driver::registerDriverFactory ("File sink (ILDA)",makeFileSinkILDA);
+    }
+};
+
+static GenFileSink_ILDA filesink_ilda;
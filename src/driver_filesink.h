@@ -0,0 +1,93 @@
+/* driver_filesink.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef DRIVER_FILESINK_INCL
+#define DRIVER_FILESINK_INCL
+
+#include <vector>
+#include <QtCore>
+#include <boost/atomic.hpp>
+#include "driver.h"
+#include "channelmap.h"
+
+/// Offline rendering output.
+
+/// Writes the exact post pipeline point stream to a file as fast as the head can make it,
+/// there is no real time pacing so this doubles as a measure of pipeline throughput.
+/// The output directory and point rate come from Drivers/File sink (ILDA)/Directory and
+/// Point rate, each connect starts a new time stamped file.
+
+class FileSink_ILDA;
+
+/// \brief The writer, the consumer side of the point ring.
+class FileSinkThread : public QThread
+{
+    Q_OBJECT
+public:
+    /// The hardware list, in the order enumerateHardware returns it.
+    enum FORMAT {RAW, WAV, ILDA};
+    FileSinkThread (FileSink_ILDA *driver, const QString filename, const FORMAT format, const unsigned int pps);
+    ~FileSinkThread();
+    void run();
+    /// \brief Write out whatever is left in the ring, finish the file and exit.
+    void stop();
+    /// @return false if the file could not be opened.
+    bool ok () const;
+private:
+    void writeHeader ();
+    void writePoints (const PointF *p, const size_t n);
+    /// \brief Write the points collected so far as an ILDA section, with none it is the end marker.
+    void flushILDAFrame ();
+    void finish ();
+    FileSink_ILDA *driver;
+    QFile file;
+    FORMAT format;
+    unsigned int pps;
+    ChannelMap map;
+    std::vector<float> samples;
+    std::vector<char> ildaFrame;
+    unsigned int ildaFramePoints;
+    unsigned int ildaPoints;
+    std::vector<qint64> ildaHeaders;
+    unsigned long long points;
+    boost::atomic<bool> stopping;
+    bool ok_;
+};
+
+class FileSink_ILDA : public Driver
+{
+public:
+    FileSink_ILDA();
+    ~FileSink_ILDA();
+    Driver::FLAGS flags();
+    std::vector<std::string> enumerateHardware();
+    bool connect (unsigned int index);
+    bool connected();
+    bool disconnect();
+
+    bool ILDAShutter (bool);
+    bool ILDAInterlock (bool);
+    unsigned int ILDAHwPointsPerSecond();
+    bool ILDARealTime();
+private:
+    FileSinkThread *thread;
+    unsigned int pps;
+    friend class FileSinkThread;
+};
+
+#endif
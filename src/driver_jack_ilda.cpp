@@ -0,0 +1,254 @@
+/* driver_jack_ilda.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "driver_jack_ilda.h"
+
+#include <string.h>
+#include <QSettings>
+#include <boost/make_shared.hpp>
+#include "log.h"
+
+static const char * portNames[JACK_ILDA_PORTS] = {"X","Y","R","G","B","I"};
+
+JACK_ILDA::JACK_ILDA() : Driver()
+{
+    client = NULL;
+    for (unsigned int i=0; i < JACK_ILDA_PORTS; i++) {
+        ports[i] = NULL;
+    }
+    sr.store(0);
+    period.store(0);
+    zombie.store(false);
+    shutter = false;
+    memset(&last,0,sizeof(last));
+    ildaRing = boost::make_shared<PointRing>(JACK_BUFFER_SZ);
+}
+
+JACK_ILDA::~JACK_ILDA()
+{
+    disconnect();
+}
+
+std::vector<std::string> JACK_ILDA::enumerateHardware()
+{
+    // There is only ever the one server as far as we are concerned, but only offer
+    // it if it is actually running, we do not want to start one behind the users back.
+    std::vector<std::string> res;
+    jack_status_t status;
+    jack_client_t *probe = jack_client_open("lucifer-probe",JackNoStartServer,&status);
+    if (probe) {
+        res.push_back(std::string("JACK server"));
+        jack_client_close(probe);
+        slog()->infoStream() << "Found JACK server";
+    } else {
+        slog()->debugStream() << "No JACK server running";
+    }
+    return res;
+}
+
+bool JACK_ILDA::connect(unsigned int index)
+{
+    if (index != 0) {
+        slog()->errorStream() << "Attempted to connect to invalid JACK server";
+        return false;
+    }
+    if (client) {
+        disconnect();
+    }
+    jack_status_t status;
+    client = jack_client_open("lucifer",JackNoStartServer,&status);
+    if (!client) {
+        slog()->errorStream() << "Couldn't connect to the JACK server, status : " << (int) status;
+        return false;
+    }
+    slog()->infoStream() << "Connected to JACK as : " << std::string(jack_get_client_name(client));
+    for (unsigned int i=0; i < JACK_ILDA_PORTS; i++) {
+        ports[i] = jack_port_register(client,portNames[i],JACK_DEFAULT_AUDIO_TYPE,JackPortIsOutput,0);
+        if (!ports[i]) {
+            slog()->errorStream() << "Couldn't register JACK port " << portNames[i];
+            disconnect();
+            return false;
+        }
+    }
+    map = ChannelMap::load(JACK_ILDA_PORTS,"Drivers/JACK (ILDA)");
+    zombie.store(false);
+    sr.store(jack_get_sample_rate(client));
+    period.store(jack_get_buffer_size(client));
+    jack_set_process_callback(client,processCallback,this);
+    jack_set_buffer_size_callback(client,bufferSizeCallback,this);
+    jack_set_sample_rate_callback(client,sampleRateCallback,this);
+    jack_on_shutdown(client,shutdownCallback,this);
+    if (jack_activate(client)) {
+        slog()->errorStream() << "Couldn't activate JACK client";
+        disconnect();
+        return false;
+    }
+    slog()->infoStream() << "JACK running at " << sr.load() << " pps, " << period.load() << " points per period";
+    emit ILDAHwPPSChanged(sr.load());
+
+    // Optionally wire the ports to the first physical outputs in order.
+    QSettings settings;
+    settings.beginGroup("Drivers/JACK (ILDA)");
+    if (settings.value("Auto connect",false).toBool()) {
+        const char **phys = jack_get_ports(client,NULL,JACK_DEFAULT_AUDIO_TYPE,JackPortIsPhysical | JackPortIsInput);
+        if (phys) {
+            for (unsigned int i=0; (i < JACK_ILDA_PORTS) && phys[i]; i++) {
+                if (jack_connect(client,jack_port_name(ports[i]),phys[i])) {
+                    slog()->errorStream() << "Couldn't connect " << portNames[i] << " to " << phys[i];
+                }
+            }
+            jack_free(phys);
+        }
+    }
+    settings.endGroup();
+    return true;
+}
+
+bool JACK_ILDA::connected()
+{
+    return client && !zombie.load();
+}
+
+bool JACK_ILDA::disconnect()
+{
+    if (!client) {
+        return false;
+    }
+    // Deactivating waits for any process callback in flight, after that the ring is ours again.
+    if (!zombie.load()) {
+        jack_deactivate(client);
+    }
+    jack_client_close(client);
+    client = NULL;
+    for (unsigned int i=0; i < JACK_ILDA_PORTS; i++) {
+        ports[i] = NULL;
+    }
+    return true;
+}
+
+Driver::FLAGS JACK_ILDA::flags()
+{
+    return Driver::OUTPUTS_ILDA;
+}
+
+bool JACK_ILDA::ILDAInterlock(bool state)
+{
+    return state;
+}
+
+bool JACK_ILDA::ILDAShutter(bool state)
+{
+    shutter = state;
+    return state;
+}
+
+unsigned int JACK_ILDA::ILDAHwPointsPerSecond()
+{
+    return sr.load();
+}
+
+size_t JACK_ILDA::ILDAHwPeriod()
+{
+    return period.load();
+}
+
+int JACK_ILDA::processCallback(jack_nframes_t nframes, void* arg)
+{
+    // JACK realtime thread, the ring is the only thing we share with the head.
+    JACK_ILDA *t = (JACK_ILDA *) arg;
+    float *bufs[JACK_ILDA_PORTS];
+    for (unsigned int i=0; i < JACK_ILDA_PORTS; i++) {
+        bufs[i] = (float *) jack_port_get_buffer(t->ports[i],nframes);
+    }
+    if (t->ILDABlankFlush()) {
+        t->last = ChannelMap::dark(t->last);
+        t->map.fill(t->last,nframes,bufs);
+        return 0;
+    }
+    jack_nframes_t done = 0;
+    while (done < nframes) {
+        const PointF *span;
+        const size_t got = t->ildaRing->readRegion(&span,nframes - done);
+        if (!got) {
+            break;
+        }
+        float *out[JACK_ILDA_PORTS];
+        for (unsigned int i=0; i < JACK_ILDA_PORTS; i++) {
+            out[i] = bufs[i] + done;
+        }
+        t->map.run(span,got,out);
+        t->last = span[got - 1];
+        t->ildaRing->commitRead(got);
+        done += got;
+    }
+    if (done < nframes) {
+        t->ildaRing->noteUnderrun(nframes - done);
+        float *out[JACK_ILDA_PORTS];
+        for (unsigned int i=0; i < JACK_ILDA_PORTS; i++) {
+            out[i] = bufs[i] + done;
+        }
+        t->last = ChannelMap::dark(t->last);
+        t->map.fill(t->last,nframes - done,out);
+    }
+    return 0;
+}
+
+int JACK_ILDA::bufferSizeCallback(jack_nframes_t nframes, void* arg)
+{
+    // Not the process thread, but keep it short anyway.
+    JACK_ILDA *t = (JACK_ILDA *) arg;
+    t->period.store(nframes);
+    slog()->infoStream() << "JACK period now " << nframes << " points";
+    // The head picks up the new period on its next refill, nudge it so it resizes its target now.
+    emit t->ILDAHwPPSChanged(t->sr.load());
+    return 0;
+}
+
+int JACK_ILDA::sampleRateCallback(jack_nframes_t nframes, void* arg)
+{
+    JACK_ILDA *t = (JACK_ILDA *) arg;
+    t->sr.store(nframes);
+    slog()->infoStream() << "JACK sample rate now " << nframes;
+    emit t->ILDAHwPPSChanged(nframes);
+    return 0;
+}
+
+void JACK_ILDA::shutdownCallback(void* arg)
+{
+    // We may not call back into JACK from here, just mark the client dead.
+    JACK_ILDA *t = (JACK_ILDA *) arg;
+    t->zombie.store(true);
+    slog()->critStream() << "JACK server shut down, laser output stopped";
+}
+
+/// This boilerplate registers the driver with the system so that it can appear in menus and the like
+
+static DriverPtr makeJACKILDA()
+{
+    return boost::make_shared<JACK_ILDA>();
+}
+
+class GenJACK_ILDA
+{
+public:
+    GenJACK_ILDA () {
+        Driver::registerDriverFactory ("JACK (ILDA)",makeJACKILDA);
+    }
+};
+
+static GenJACK_ILDA jack_ilda;
@@ -0,0 +1,72 @@
+/* driver_jack_ilda.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef DRIVER_JACK_ILDA
+#define DRIVER_JACK_ILDA
+#include "driver.h"
+#include "channelmap.h"
+#include <jack/jack.h>
+#include <boost/atomic.hpp>
+
+/// DAC modified soundcard driven through the JACK audio server.
+
+/// Each head gets its own JACK client with X, Y, R, G, B and I output ports, routing them
+/// to the hardware is left to the JACK patchbay unless auto connection is turned on in the
+/// settings (Drivers/JACK (ILDA)/Auto connect). The process callback maps points straight
+/// out of the ring into the port buffers so nothing in there can block.
+
+/// Number of output ports, X,Y,R,G,B,I.
+#define JACK_ILDA_PORTS (6)
+/// Ring size in points, about 170ms at 192k.
+#define JACK_BUFFER_SZ (32768)
+
+class JACK_ILDA : public Driver
+{
+public:
+    JACK_ILDA();
+    ~JACK_ILDA();
+    Driver::FLAGS flags();
+    std::vector<std::string> enumerateHardware();
+    bool connect (unsigned int index);
+    bool connected();
+    bool disconnect();
+
+    bool ILDAShutter (bool);
+    bool ILDAInterlock (bool);
+    unsigned int ILDAHwPointsPerSecond();
+    size_t ILDAHwPeriod();
+private:
+    static int processCallback (jack_nframes_t nframes, void *arg);
+    static int bufferSizeCallback (jack_nframes_t nframes, void *arg);
+    static int sampleRateCallback (jack_nframes_t nframes, void *arg);
+    static void shutdownCallback (void *arg);
+    jack_client_t *client;
+    jack_port_t *ports[JACK_ILDA_PORTS];
+    /// Written from the JACK notification thread, read by the head.
+    boost::atomic<unsigned int> sr;
+    boost::atomic<unsigned int> period;
+    /// Set if the server went away under us.
+    boost::atomic<bool> zombie;
+    bool shutter;
+    /// Built in connect, only read by the process callback while the client is active.
+    ChannelMap map;
+    /// Where the beam was last sent, blanking parks it there. Only the callback uses it.
+    PointF last;
+};
+
+#endif
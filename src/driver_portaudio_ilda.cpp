@@ -24,42 +24,34 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <string.h>
 
 
-/// This bit of bletcherousnes is because portaudio needs to be
-/// initialised precisely once....
-int pa_usecount = 0;
-
 PA_ILDA::PA_ILDA() : Driver()
 {
-    /// PortAudio is a single instance library, so we cheat.
-    if (pa_usecount == 0) {
-        pa_usecount ++;
-        PaError err = Pa_Initialize();
-        if (err != paNoError) {
-            pa_usecount--;
-            slog()->errorStream() << "Couldn't initialise portaudio";
-        }
+    // Portaudio reference counts initialisation itself, so every driver takes a reference
+    // and gives back exactly the one it got.
+    initialised = (Pa_Initialize() == paNoError);
+    if (!initialised) {
+        slog()->errorStream() << "Couldn't initialise portaudio";
     }
     stream = NULL;
     sr = 44100;
     shutter = false;
-		ringbuffer = new boost::circular_buffer<PointF>(BUFFER_SZ);
+    memset(&last,0,sizeof(last));
+    ildaRing = boost::make_shared<PointRing>(BUFFER_SZ);
 }
 
 PA_ILDA::~PA_ILDA()
 {
-    if (pa_usecount) {
-        pa_usecount --;
-    }
-    if (!pa_usecount) {
+    // The callback holds a pointer to us, so the stream goes before we do
+    disconnect();
+    if (initialised) {
         Pa_Terminate();
     }
-    delete ringbuffer;
 }
 
 std::vector<std::string> PA_ILDA::enumerateHardware()
 {
     std::vector<std::string> res;
-    if (!pa_usecount) {
+    if (!initialised) {
         return res;
     }
     int deviceCount = Pa_GetDeviceCount();
@@ -85,6 +77,8 @@ bool PA_ILDA::connect(unsigned int index)
         slog()->errorStream() << "Attempted to connect to invalid portaudio device";
         return false;
     }
+    // Reconnecting, the old stream must not still be calling back into us
+    disconnect();
     index = valid_devices[index];
     // index is the port audio device to use
     PaStreamParameters outputParameters;
@@ -93,6 +87,7 @@ bool PA_ILDA::connect(unsigned int index)
 		channels = Pa_GetDeviceInfo(index)->maxOutputChannels;
 		if (channels > 6) channels = 6; // Pulse audio playing silly buggers most likely
 		slog()->infoStream() << "With " << channels << " channels.";
+    map = ChannelMap::load(channels,"Drivers/SoundCard (ILDA)");
 
     //memset(&inputParameters, 0,sizeof(inputParameters));
 		// Turns out that not asking for any inputs does not work real well
@@ -134,7 +129,7 @@ bool PA_ILDA::connect(unsigned int index)
               NULL/*&inputParameters*/,
               &outputParameters,
               sr,
-              256,
+              PA_PERIOD,
               paNoFlag, //flags that can be used to define dither, clip settings and more
               paCallback,
               (void *)this );
@@ -142,7 +137,14 @@ bool PA_ILDA::connect(unsigned int index)
         slog()->errorStream() << "Portaudio reported "<< Pa_GetErrorText(err);
         return false;
     }
-
+    // The head keeps the ring topped up on its own, so we can start pulling straight away
+    err = Pa_StartStream(stream);
+    if (err != paNoError) {
+        slog()->errorStream() << "Portaudio failed to start stream : "<< Pa_GetErrorText(err);
+        Pa_CloseStream(stream);
+        stream = NULL;
+        return false;
+    }
     return true;
 }
 
@@ -156,6 +158,11 @@ unsigned int PA_ILDA::ILDAHwPointsPerSecond()
     return sr;
 }
 
+size_t PA_ILDA::ILDAHwPeriod()
+{
+    return PA_PERIOD;
+}
+
 Driver::FLAGS PA_ILDA::flags()
 {
     return Driver::OUTPUTS_ILDA;
@@ -175,6 +182,7 @@ bool PA_ILDA::ILDAShutter(bool state)
 bool PA_ILDA::disconnect()
 {
     if (stream) {
+        Pa_StopStream(stream);
         Pa_CloseStream(stream);
         stream = NULL;
         return true;
@@ -182,23 +190,6 @@ bool PA_ILDA::disconnect()
 		return false;
 }
 
-size_t PA_ILDA::ILDABufferFillStatus()
-{
-    return ringbuffer->capacity() - ringbuffer->size();
-}
-
-size_t PA_ILDA::ILDANewPoints(std::vector< PointF >& pts, size_t offset)
-{
-		size_t transfer = pts.size() - offset;
-		if (transfer > (ringbuffer->capacity()- ringbuffer->size())){
-			transfer = ringbuffer->capacity() - ringbuffer->size();
-		}
-    for (unsigned i=0; i < transfer; i++) {
-        ringbuffer->push_back(pts[i+offset]);
-    }
-    return transfer;
-}
-
 static int paCallback(const void *, void *outputBuffer,
                unsigned long framesPerBuffer,
                const PaStreamCallbackTimeInfo*,
@@ -207,41 +198,30 @@ static int paCallback(const void *, void *outputBuffer,
 {
     PA_ILDA *t = (PA_ILDA*) userData;
     float *out = (float*) outputBuffer;
-    unsigned int nf = framesPerBuffer;
-    if (t->ringbuffer->size() < nf) {
-        nf = t->ringbuffer->size();
+    if (t->ILDABlankFlush()) {
+        t->last = ChannelMap::dark(t->last);
+        t->map.fill(t->last,framesPerBuffer,out,t->channels);
+        return 0;
     }
-    for (unsigned int i=0; i < nf; i++) {
-        PointF p = t->ringbuffer->front();
-        t->ringbuffer->pop_front();
-        for (unsigned int j=0; j < t->channels; j++) {
-            switch (j) {
-            case 0:
-                *out = p.x;
-                break;
-            case 1:
-                *out = p.y;
-                break;
-            case 2:
-                *out = p.r;
-                break;
-            case 3:
-                *out = p.g;
-                break;
-            case 4:
-                *out = p.b;
-                break;
-            case 5: // Intensity - TODO a different matrix here might be better
-                *out = (p.r+p.g+p.b)/3.0;
-                break;
-            default:
-                break;
-            }
-            out ++;
+    // This runs in the portaudio thread, the ring is the only thing we touch that the head does.
+    // Map straight out of the ring, at most two spans either side of the wrap.
+    unsigned long nf = 0;
+    while (nf < framesPerBuffer) {
+        const PointF *span;
+        const size_t got = t->ildaRing->readRegion(&span,framesPerBuffer - nf);
+        if (!got) {
+            break;
         }
+        t->map.run(span,got,out,t->channels);
+        t->last = span[got - 1];
+        t->ildaRing->commitRead(got);
+        out += got * t->channels;
+        nf += got;
     }
     if (nf < framesPerBuffer) {
-        memset(out,0,sizeof(float) * t->channels * (framesPerBuffer - nf));
+        t->ildaRing->noteUnderrun(framesPerBuffer - nf);
+        t->last = ChannelMap::dark(t->last);
+        t->map.fill(t->last,framesPerBuffer - nf,out,t->channels);
     }
 	return 0;
 };
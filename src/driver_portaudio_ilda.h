@@ -19,12 +19,15 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #ifndef DRIVER_PORTAUDIO_ILDA
 #define DRIVER_PORTAUDIO_ILDA
 #include "driver.h"
+#include "channelmap.h"
 #include <portaudio.h>
-#include <boost/circular_buffer.hpp>
 
 /// Soundcard DAC using portaudio for ILDA
 
-#define BUFFER_SZ (1024)
+/// Ring size in points, about 170ms at 192k.
+#define BUFFER_SZ (32768)
+/// Frames per portaudio callback.
+#define PA_PERIOD (256)
 
 int static paCallback (const void *inputBuffer, void *outputBuffer,
                        unsigned long framesPerBuffer,
@@ -45,16 +48,20 @@ public:
 
     bool ILDAShutter (bool);
     bool ILDAInterlock (bool);
-    size_t ILDABufferFillStatus();
-    size_t ILDANewPoints (std::vector<PointF> &pts, size_t offset);
     unsigned int ILDAHwPointsPerSecond();
+    size_t ILDAHwPeriod();
 private:
     PaStream *stream;
+    /// True if our Pa_Initialize succeeded, and so is owed a Pa_Terminate.
+    bool initialised;
     std::vector<int> valid_devices;
     unsigned int sr;
     bool shutter;
     unsigned int channels;
-    boost::circular_buffer<PointF> *ringbuffer;
+    /// Built in connect, only read by the callback while the stream runs.
+    ChannelMap map;
+    /// Where the beam was last sent, blanking parks it there. Only the callback uses it.
+    PointF last;
     friend int paCallback(const void *inputBuffer, void *outputBuffer,
                           unsigned long framesPerBuffer,
                           const PaStreamCallbackTimeInfo* timeInfo,
@@ -0,0 +1,382 @@
+/* driver_portaudio_multi.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "driver_portaudio_multi.h"
+
+#include <map>
+#include <string.h>
+#include <unistd.h>
+#include <portaudio.h>
+#include <QMutex>
+#include <QSettings>
+#include <boost/atomic.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include "log.h"
+
+/// Ring size in points, about 170ms at 192k.
+#define MULTI_BUFFER_SZ (32768)
+/// Frames per portaudio callback.
+#define MULTI_PERIOD (256)
+/// Most channels we will open on one card.
+#define MULTI_MAX_CHANNELS (MAX_MULTI_GROUPS * 6)
+
+static const char * settingsGroup = "Drivers/SoundCard multichannel (ILDA)";
+
+static unsigned int groupWidth()
+{
+    QSettings settings;
+    settings.beginGroup(settingsGroup);
+    unsigned int w = settings.value("Channels per head",6).toUInt();
+    settings.endGroup();
+    if (w < 2) {
+        w = 2;
+    }
+    if (w > MAX_MAP_CHANNELS) {
+        w = MAX_MAP_CHANNELS;
+    }
+    return w;
+}
+
+/// \brief One open portaudio stream shared by every head using the card.
+/// The callback walks a fixed table of channel groups, a driver attaches by storing itself in
+/// its slot and detaches by clearing it and waiting out any callback that may still be
+/// using it, so the callback itself never takes a lock.
+class PAMultiStream
+{
+public:
+    /// \brief Get the stream for a device, opening it if no other head has.
+    static PAMultiStreamPtr get (const int device);
+    ~PAMultiStream();
+    bool attach (const unsigned int group, PA_MULTI *d);
+    void detach (const unsigned int group);
+    bool ok;
+    unsigned int sr;
+    unsigned int channels;
+    unsigned int width;
+private:
+    PAMultiStream (const int device);
+    static int callback (const void *inputBuffer, void *outputBuffer,
+                         unsigned long framesPerBuffer,
+                         const PaStreamCallbackTimeInfo* timeInfo,
+                         PaStreamCallbackFlags statusFlags,
+                         void *userData);
+    int device;
+    PaStream *stream;
+    /// True if our Pa_Initialize succeeded, and so is owed a Pa_Terminate.
+    bool initialised;
+    boost::atomic<PA_MULTI *> groups[MAX_MULTI_GROUPS];
+    boost::atomic<unsigned long> cycles;
+    static QMutex registryLock;
+    static std::map<int, boost::weak_ptr<PAMultiStream> > registry;
+};
+
+QMutex PAMultiStream::registryLock;
+std::map<int, boost::weak_ptr<PAMultiStream> > PAMultiStream::registry;
+
+PAMultiStreamPtr PAMultiStream::get(const int device)
+{
+    QMutexLocker l(&registryLock);
+    PAMultiStreamPtr s = registry[device].lock();
+    if (!s) {
+        s = PAMultiStreamPtr(new PAMultiStream(device));
+        if (!s->ok) {
+            return PAMultiStreamPtr();
+        }
+        registry[device] = s;
+    }
+    return s;
+}
+
+PAMultiStream::PAMultiStream(const int dev)
+{
+    ok = false;
+    initialised = false;
+    device = dev;
+    stream = NULL;
+    sr = 0;
+    width = groupWidth();
+    cycles.store(0);
+    for (unsigned int i=0; i < MAX_MULTI_GROUPS; i++) {
+        groups[i].store(NULL);
+    }
+    // Portaudio reference counts initialisation itself, so every stream just takes a reference.
+    // A stream that fails to open is deleted at once, which gives it back.
+    if (Pa_Initialize() != paNoError) {
+        slog()->errorStream() << "Couldn't initialise portaudio";
+        return;
+    }
+    initialised = true;
+    const PaDeviceInfo *info = Pa_GetDeviceInfo(device);
+    channels = info->maxOutputChannels;
+    if (channels > MULTI_MAX_CHANNELS) {
+        channels = MULTI_MAX_CHANNELS;
+    }
+    slog()->infoStream() << "Opening shared stream on : " << std::string(info->name) << " with " << channels << " channels";
+    PaStreamParameters outputParameters;
+    memset(&outputParameters,0,sizeof(outputParameters));
+    outputParameters.channelCount = channels;
+    outputParameters.device = device;
+    outputParameters.sampleFormat = paFloat32;
+    outputParameters.suggestedLatency = info->defaultLowOutputLatency;
+    outputParameters.hostApiSpecificStreamInfo = NULL;
+    /// Find the highest rate this card is capable of with every channel open.
+    unsigned int srates[]={192000,176400,96000,88200,48000,44100,0};
+    int j=0;
+    PaError err = paInvalidSampleRate;
+    while ((sr = srates[j])) {
+        err = Pa_IsFormatSupported(NULL,&outputParameters,sr);
+        if (err == paFormatIsSupported) {
+            break;
+        }
+        j++;
+    }
+    if (err != paFormatIsSupported) {
+        slog()->errorStream() << "Card supports no useful sample rates";
+        return;
+    }
+    err = Pa_OpenStream(&stream,NULL,&outputParameters,sr,MULTI_PERIOD,paNoFlag,callback,(void *)this);
+    if (err != paNoError) {
+        slog()->errorStream() << "Portaudio reported "<< Pa_GetErrorText(err);
+        stream = NULL;
+        return;
+    }
+    // Unclaimed groups output silence, so the stream can run before anyone attaches.
+    err = Pa_StartStream(stream);
+    if (err != paNoError) {
+        slog()->errorStream() << "Portaudio failed to start stream : "<< Pa_GetErrorText(err);
+        Pa_CloseStream(stream);
+        stream = NULL;
+        return;
+    }
+    slog()->infoStream() << "Shared stream running at " << sr << " pps";
+    ok = true;
+}
+
+PAMultiStream::~PAMultiStream()
+{
+    if (stream) {
+        Pa_StopStream(stream);
+        Pa_CloseStream(stream);
+        stream = NULL;
+        slog()->infoStream() << "Closed shared stream on device " << device;
+    }
+    if (initialised) {
+        Pa_Terminate();
+    }
+}
+
+bool PAMultiStream::attach(const unsigned int group, PA_MULTI* d)
+{
+    if ((group >= MAX_MULTI_GROUPS) || ((group + 1) * width > channels)) {
+        slog()->errorStream() << "Channel group " << group + 1 << " does not exist on this card";
+        return false;
+    }
+    PA_MULTI *expected = NULL;
+    if (!groups[group].compare_exchange_strong(expected,d)) {
+        slog()->errorStream() << "Channel group " << group + 1 << " is already in use by another head";
+        return false;
+    }
+    return true;
+}
+
+void PAMultiStream::detach(const unsigned int group)
+{
+    groups[group].store(NULL);
+    // A callback that loaded the old pointer before we cleared it may still be running,
+    // two completed cycles later it certainly is not.
+    const unsigned long c = cycles.load();
+    for (unsigned int i=0; (i < 500) && (cycles.load() - c < 2); i++) {
+        usleep(1000);
+    }
+}
+
+int PAMultiStream::callback(const void *, void *outputBuffer,
+                            unsigned long framesPerBuffer,
+                            const PaStreamCallbackTimeInfo*,
+                            PaStreamCallbackFlags,
+                            void *userData)
+{
+    PAMultiStream *s = (PAMultiStream *) userData;
+    float *out = (float *) outputBuffer;
+    const unsigned int stride = s->channels;
+    // Silence first for the unclaimed groups, which have no map of their own
+    memset(out,0,sizeof(float) * stride * framesPerBuffer);
+    for (unsigned int g=0; g < MAX_MULTI_GROUPS; g++) {
+        PA_MULTI *d = s->groups[g].load(boost::memory_order_acquire);
+        if (!d) {
+            continue;
+        }
+        float *base = out + g * s->width;
+        if (d->ILDABlankFlush()) {
+            d->last = ChannelMap::dark(d->last);
+            d->map.fill(d->last,framesPerBuffer,base,stride);
+            continue;
+        }
+        unsigned long nf = 0;
+        while (nf < framesPerBuffer) {
+            const PointF *span;
+            const size_t got = d->ildaRing->readRegion(&span,framesPerBuffer - nf);
+            if (!got) {
+                break;
+            }
+            d->map.run(span,got,base + nf * stride,stride);
+            d->last = span[got - 1];
+            d->ildaRing->commitRead(got);
+            nf += got;
+        }
+        if (nf < framesPerBuffer) {
+            d->ildaRing->noteUnderrun(framesPerBuffer - nf);
+            d->last = ChannelMap::dark(d->last);
+            d->map.fill(d->last,framesPerBuffer - nf,base + nf * stride,stride);
+        }
+    }
+    s->cycles.fetch_add(1,boost::memory_order_release);
+    return 0;
+}
+
+PA_MULTI::PA_MULTI() : Driver()
+{
+    group = 0;
+    sr.store(0);
+    shutter = false;
+    memset(&last,0,sizeof(last));
+    ildaRing = boost::make_shared<PointRing>(MULTI_BUFFER_SZ);
+}
+
+PA_MULTI::~PA_MULTI()
+{
+    disconnect();
+}
+
+std::vector<std::string> PA_MULTI::enumerateHardware()
+{
+    std::vector<std::string> res;
+    valid_groups.clear();
+    if (Pa_Initialize() != paNoError) {
+        slog()->errorStream() << "Couldn't initialise portaudio";
+        return res;
+    }
+    const unsigned int w = groupWidth();
+    int deviceCount = Pa_GetDeviceCount();
+    for (int i=0; i < deviceCount; i++) {
+        const PaDeviceInfo * deviceInfo = Pa_GetDeviceInfo(i);
+        unsigned int chans = deviceInfo->maxOutputChannels;
+        if (chans > MULTI_MAX_CHANNELS) {
+            chans = MULTI_MAX_CHANNELS;
+        }
+        // Only worth sharing if at least two heads fit
+        const unsigned int groups = chans / w;
+        if (groups < 2) {
+            continue;
+        }
+        for (unsigned int g=0; g < groups; g++) {
+            res.push_back(std::string(deviceInfo->name) + " : " +
+                          QString().sprintf("channels %d-%d",g * w + 1,(g + 1) * w).toStdString());
+            valid_groups.push_back(std::pair<int, unsigned int>(i,g));
+        }
+        slog()->infoStream() << "Found multichannel device : '" << std::string(deviceInfo->name) << "' with " << groups << " heads";
+    }
+    Pa_Terminate();
+    return res;
+}
+
+bool PA_MULTI::connect(unsigned int index)
+{
+    if (index >= valid_groups.size()) {
+        slog()->errorStream() << "Attempted to connect to invalid channel group";
+        return false;
+    }
+    disconnect();
+    PAMultiStreamPtr s = PAMultiStream::get(valid_groups[index].first);
+    if (!s) {
+        return false;
+    }
+    group = valid_groups[index].second;
+    map = ChannelMap::load(s->width,QString(settingsGroup) + QString().sprintf("/Group %d",group + 1));
+    // Anything left from a previous connection would play first, drop it.
+    ildaRing->discard(ildaRing->capacity());
+    if (!s->attach(group,this)) {
+        return false;
+    }
+    stream = s;
+    sr.store(s->sr);
+    emit ILDAHwPPSChanged(s->sr);
+    slog()->infoStream() << "Head attached to channel group " << group + 1;
+    return true;
+}
+
+bool PA_MULTI::connected()
+{
+    return stream ? true : false;
+}
+
+bool PA_MULTI::disconnect()
+{
+    if (!stream) {
+        return false;
+    }
+    sr.store(0);
+    stream->detach(group);
+    // Last head off the card closes the stream
+    stream.reset();
+    return true;
+}
+
+Driver::FLAGS PA_MULTI::flags()
+{
+    return Driver::OUTPUTS_ILDA;
+}
+
+bool PA_MULTI::ILDAInterlock(bool state)
+{
+    return state;
+}
+
+bool PA_MULTI::ILDAShutter(bool state)
+{
+    shutter = state;
+    return state;
+}
+
+unsigned int PA_MULTI::ILDAHwPointsPerSecond()
+{
+    return sr.load();
+}
+
+size_t PA_MULTI::ILDAHwPeriod()
+{
+    return MULTI_PERIOD;
+}
+
+/// This boilerplate registers the driver with the system so that it can appear in menus and the like
+
+static DriverPtr makeSoundCardMulti()
+{
+    return boost::make_shared<PA_MULTI>();
+}
+
+class GenPA_MULTI
+{
+public:
+    GenPA_MULTI () {
+        Driver::registerDriverFactory ("SoundCard multichannel (ILDA)",makeSoundCardMulti);
+    }
+};
+
+static GenPA_MULTI pa_multi;
@@ -0,0 +1,71 @@
+/* driver_portaudio_multi.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef DRIVER_PORTAUDIO_MULTI
+#define DRIVER_PORTAUDIO_MULTI
+#include "driver.h"
+#include "channelmap.h"
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+
+/// Several heads sharing one multichannel soundcard.
+
+/// A 16 or 24 channel interface is split into groups of channels (6 by default, set with
+/// Drivers/SoundCard multichannel (ILDA)/Channels per head) and each head connects to one
+/// group. All heads on a card share a single portaudio stream, so there is one callback
+/// that fills every group from its own heads ring, and the outputs are sample aligned
+/// by construction.
+
+/// Most channel groups on one card.
+#define MAX_MULTI_GROUPS (16)
+
+class PAMultiStream;
+typedef boost::shared_ptr<PAMultiStream> PAMultiStreamPtr;
+
+class PA_MULTI : public Driver
+{
+public:
+    PA_MULTI();
+    ~PA_MULTI();
+    Driver::FLAGS flags();
+    std::vector<std::string> enumerateHardware();
+    bool connect (unsigned int index);
+    bool connected();
+    bool disconnect();
+
+    bool ILDAShutter (bool);
+    bool ILDAInterlock (bool);
+    unsigned int ILDAHwPointsPerSecond();
+    size_t ILDAHwPeriod();
+private:
+    /// (portaudio device, group) for each entry returned by enumerateHardware.
+    std::vector<std::pair<int, unsigned int> > valid_groups;
+    PAMultiStreamPtr stream;
+    /// The stream's rate, copied at connect as the heads read it while another thread may be
+    /// replacing stream. 0 while disconnected.
+    boost::atomic<unsigned int> sr;
+    unsigned int group;
+    bool shutter;
+    /// Built in connect, only read by the stream callback while this group is attached.
+    ChannelMap map;
+    /// Where the beam was last sent, blanking parks it there. Only the callback uses it.
+    PointF last;
+    friend class PAMultiStream;
+};
+
+#endif
@@ -0,0 +1,371 @@
+/* driver_simdac.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "driver_simdac.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <QSettings>
+#include <boost/make_shared.hpp>
+#include "log.h"
+
+/// Ring size in points.
+#define SIM_RING_SZ (16384)
+/// Seconds of history kept.
+#define SIM_HISTORY (3600)
+/// Seconds the kill test holds the output dark for.
+#define SIM_KILL_HOLD (0.1)
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sleepUntil(const double t)
+{
+    timespec ts;
+    ts.tv_sec = (time_t) t;
+    ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL) == EINTR) {
+    }
+}
+
+SimDACStats::SimDACStats()
+{
+    callbacks = 0;
+    underruns = 0;
+    underrunPoints = 0;
+    hwUnderruns = 0;
+    overruns = 0;
+    stalls = 0;
+    minOccupancy = 0;
+    maxOccupancy = 0;
+    meanOccupancy = 0.0;
+    worstCallbackGapUs = 0.0;
+    kills = 0;
+    lastKillLatencyUs = 0.0;
+    worstKillLatencyUs = 0.0;
+}
+
+SimDACThread::SimDACThread(SimDAC_ILDA* d) : QThread()
+{
+    driver = d;
+    stopping.store(false);
+    seed = d->seed;
+    level = 0.0;
+    lastTime = startTime = now();
+    occupancySum = 0.0;
+    occupancyCount = 0;
+    totalSum = 0.0;
+    current.second = 0;
+    blanked = false;
+    nextKill = 0.0;
+    killRelease = 0.0;
+}
+
+SimDACThread::~SimDACThread()
+{
+    stop();
+    wait();
+}
+
+void SimDACThread::stop()
+{
+    stopping.store(true);
+}
+
+SimDACStats SimDACThread::stats() const
+{
+    QMutexLocker l(&statsLock);
+    return stats_;
+}
+
+std::vector<SimDACSample> SimDACThread::history() const
+{
+    QMutexLocker l(&statsLock);
+    return history_;
+}
+
+void SimDACThread::run()
+{
+    const double periodTime = (double) driver->period / driver->pps;
+    // Like a soundcard we start with a couple of periods of silence in the FIFO
+    level = (double)((driver->bufferSize < 2 * driver->period) ? driver->bufferSize : 2 * driver->period);
+    startTime = lastTime = now();
+    double next = startTime;
+    current.minOccupancy = (size_t) -1;
+    current.maxOccupancy = 0;
+    if (driver->killTestS > 0.0) {
+        nextKill = startTime + (rand_r(&seed) / (double) RAND_MAX) * 2.0 * driver->killTestS;
+    }
+    while (!stopping.load()) {
+        next += periodTime;
+        double wake = next;
+        if (driver->jitterUs) {
+            wake += (rand_r(&seed) / (double) RAND_MAX) * driver->jitterUs * 1e-6;
+        }
+        if ((driver->stallProbability > 0.0) && (rand_r(&seed) / (double) RAND_MAX < driver->stallProbability)) {
+            wake += driver->stallMs * 1e-3;
+            QMutexLocker l(&statsLock);
+            stats_.stalls++;
+        }
+        if ((driver->killTestS > 0.0) && (nextKill < wake)) {
+            // Kill somewhere between callbacks, as a user would
+            sleepUntil(nextKill);
+            if (!driver->ILDABlanked()) {
+                driver->ILDABlank(Driver::BLANK_TEST,true);
+                killRelease = nextKill + SIM_KILL_HOLD;
+            }
+            nextKill += SIM_KILL_HOLD + (rand_r(&seed) / (double) RAND_MAX) * 2.0 * driver->killTestS;
+        }
+        sleepUntil(wake);
+        callback(now());
+        if ((killRelease > 0.0) && (now() > killRelease)) {
+            driver->ILDABlank(Driver::BLANK_TEST,false);
+            killRelease = 0.0;
+        }
+    }
+}
+
+void SimDACThread::callback(const double t)
+{
+    PointRingPtr ring = driver->ildaRing;
+    const size_t occupancy = ring->occupancy();
+    QMutexLocker l(&statsLock);
+    stats_.callbacks++;
+    const double gap = (t - lastTime) * 1e6;
+    if (gap > stats_.worstCallbackGapUs) {
+        stats_.worstCallbackGapUs = gap;
+    }
+    // The hardware has been playing since the last callback
+    level -= (t - lastTime) * driver->pps;
+    lastTime = t;
+    if (level < 0.0) {
+        stats_.hwUnderruns++;
+        level = 0.0;
+    }
+    // Close off the last second before this callback counts towards the next
+    const unsigned int second = (unsigned int)(t - startTime);
+    if (second > current.second) {
+        if (occupancyCount) {
+            current.meanOccupancy = occupancySum / occupancyCount;
+            current.underruns = stats_.underruns;
+            current.hwUnderruns = stats_.hwUnderruns;
+            current.overruns = stats_.overruns;
+            current.stalls = stats_.stalls;
+            history_.push_back(current);
+            if (history_.size() > SIM_HISTORY) {
+                history_.erase(history_.begin());
+            }
+            slog()->debugStream() << "Simulated DAC " << current.second << "s occupancy " << current.minOccupancy << "/"
+                                  << current.meanOccupancy << "/" << current.maxOccupancy << " underruns " << current.underruns
+                                  << " hw underruns " << current.hwUnderruns << " overruns " << current.overruns;
+        } else {
+            // Blanked throughout, no occupancy to speak of so no sample either
+            slog()->debugStream() << "Simulated DAC " << current.second << "s blanked";
+        }
+        current.second = second;
+        current.minOccupancy = (size_t) -1;
+        current.maxOccupancy = 0;
+        occupancySum = 0.0;
+        occupancyCount = 0;
+    }
+    if (driver->ILDABlankFlush()) {
+        if (!blanked) {
+            // Whatever is already in the hardware FIFO still gets drawn
+            blanked = true;
+            const double latency = (t - driver->ILDABlankTime() + level / driver->pps) * 1e6;
+            stats_.kills++;
+            stats_.lastKillLatencyUs = latency;
+            if (latency > stats_.worstKillLatencyUs) {
+                stats_.worstKillLatencyUs = latency;
+            }
+            slog()->infoStream() << "Simulated DAC dark " << latency << "us after kill";
+        }
+        level += driver->period;
+        if (level > driver->bufferSize) {
+            level = driver->bufferSize;
+        }
+        return;
+    }
+    blanked = false;
+    // Pull one period, whatever we did not get goes out as silence
+    const size_t got = ring->discard(driver->period);
+    if (got < driver->period) {
+        ring->noteUnderrun(driver->period - got);
+        stats_.underruns++;
+        stats_.underrunPoints += driver->period - got;
+    }
+    level += driver->period;
+    if (level > driver->bufferSize) {
+        stats_.overruns++;
+        level = driver->bufferSize;
+    }
+    // Occupancy statistics
+    if (stats_.callbacks == 1) {
+        stats_.minOccupancy = stats_.maxOccupancy = occupancy;
+    }
+    stats_.minOccupancy = (occupancy < stats_.minOccupancy) ? occupancy : stats_.minOccupancy;
+    stats_.maxOccupancy = (occupancy > stats_.maxOccupancy) ? occupancy : stats_.maxOccupancy;
+    totalSum += occupancy;
+    stats_.meanOccupancy = totalSum / stats_.callbacks;
+    current.minOccupancy = (occupancy < current.minOccupancy) ? occupancy : current.minOccupancy;
+    current.maxOccupancy = (occupancy > current.maxOccupancy) ? occupancy : current.maxOccupancy;
+    occupancySum += occupancy;
+    occupancyCount++;
+}
+
+SimDAC_ILDA::SimDAC_ILDA() : Driver()
+{
+    thread = NULL;
+    pps = 30000;
+    bufferSize = 4096;
+    period = 256;
+    jitterUs = 0;
+    stallProbability = 0.0;
+    stallMs = 0;
+    seed = 1;
+    killTestS = 0.0;
+    ildaRing = boost::make_shared<PointRing>(SIM_RING_SZ);
+}
+
+SimDAC_ILDA::~SimDAC_ILDA()
+{
+    disconnect();
+}
+
+std::vector<std::string> SimDAC_ILDA::enumerateHardware()
+{
+    std::vector<std::string> res;
+    res.push_back(std::string("Simulated DAC"));
+    return res;
+}
+
+bool SimDAC_ILDA::connect(unsigned int index)
+{
+    if (index != 0) {
+        return false;
+    }
+    disconnect();
+    QSettings settings;
+    settings.beginGroup("Drivers/Simulated DAC (ILDA)");
+    pps = settings.value("Point rate",30000).toUInt();
+    bufferSize = settings.value("Buffer size",4096).toUInt();
+    period = settings.value("Period",256).toUInt();
+    jitterUs = settings.value("Jitter us",500).toUInt();
+    stallProbability = settings.value("Stall probability",0.001).toDouble();
+    stallMs = settings.value("Stall ms",20).toUInt();
+    seed = settings.value("Seed",1).toUInt();
+    killTestS = settings.value("Kill test s",0.0).toDouble();
+    settings.endGroup();
+    if (!pps) {
+        pps = 30000;
+    }
+    if (!period) {
+        period = 256;
+    }
+    if (bufferSize < period) {
+        bufferSize = period;
+    }
+    ildaRing->discard(ildaRing->capacity());
+    thread = new SimDACThread(this);
+    thread->start(QThread::TimeCriticalPriority);
+    emit ILDAHwPPSChanged(pps);
+    slog()->infoStream() << "Simulated DAC at " << pps << " pps, " << period << " point period, " << bufferSize
+                         << " point FIFO, " << jitterUs << "us jitter, stalls of " << stallMs << "ms with probability " << stallProbability;
+    return true;
+}
+
+bool SimDAC_ILDA::connected()
+{
+    return thread ? true : false;
+}
+
+bool SimDAC_ILDA::disconnect()
+{
+    if (!thread) {
+        return false;
+    }
+    thread->stop();
+    thread->wait();
+    lastStats = thread->stats();
+    delete thread;
+    thread = NULL;
+    slog()->infoStream() << "Simulated DAC: " << lastStats.callbacks << " callbacks, " << lastStats.underruns << " underruns ("
+                         << lastStats.underrunPoints << " points), " << lastStats.hwUnderruns << " hardware underruns, "
+                         << lastStats.overruns << " overruns, " << lastStats.stalls << " stalls, occupancy "
+                         << lastStats.minOccupancy << "/" << lastStats.meanOccupancy << "/" << lastStats.maxOccupancy
+                         << ", worst callback gap " << lastStats.worstCallbackGapUs << "us, "
+                         << lastStats.kills << " kills, worst kill latency " << lastStats.worstKillLatencyUs << "us";
+    return true;
+}
+
+SimDACStats SimDAC_ILDA::stats() const
+{
+    return thread ? thread->stats() : lastStats;
+}
+
+std::vector<SimDACSample> SimDAC_ILDA::history() const
+{
+    return thread ? thread->history() : std::vector<SimDACSample>();
+}
+
+Driver::FLAGS SimDAC_ILDA::flags()
+{
+    return Driver::OUTPUTS_ILDA;
+}
+
+bool SimDAC_ILDA::ILDAInterlock(bool state)
+{
+    return state;
+}
+
+bool SimDAC_ILDA::ILDAShutter(bool state)
+{
+    return state;
+}
+
+unsigned int SimDAC_ILDA::ILDAHwPointsPerSecond()
+{
+    return pps;
+}
+
+size_t SimDAC_ILDA::ILDAHwPeriod()
+{
+    return period;
+}
+
+/// This boilerplate registers the driver with the system so that it can appear in menus and the like
+
+static DriverPtr makeSimDACILDA()
+{
+    return boost::make_shared<SimDAC_ILDA>();
+}
+
+class GenSimDAC_ILDA
+{
+public:
+    GenSimDAC_ILDA () {
+        Driver::registerDriverFactory ("Simulated DAC (ILDA)",makeSimDACILDA);
+    }
+};
+
+static GenSimDAC_ILDA simdac_ilda;
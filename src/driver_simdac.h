@@ -0,0 +1,151 @@
+/* driver_simdac.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef DRIVER_SIMDAC_INCL
+#define DRIVER_SIMDAC_INCL
+
+#include <vector>
+#include <QtCore>
+#include <boost/atomic.hpp>
+#include "driver.h"
+
+/// A simulated DAC with realistic timing for soak testing the head.
+
+/// Modelled on a period based soundcard: a hardware FIFO plays out continuously at the point
+/// rate and a callback tops it up by one period from the ring. Callbacks are scheduled on
+/// the nominal period but wake late by a random amount up to the jitter setting, and now and
+/// then stall altogether. All of it is set under Drivers/Simulated DAC (ILDA):
+/// Point rate, Buffer size (hardware FIFO points), Period, Jitter us, Stall probability (per
+/// callback), Stall ms and Seed.
+/// Kill test s, if non zero, makes the simulator kill its own output at random every that many
+/// seconds on average and hold it off for a tenth of a second, so the worst case kill latency
+/// (the time from the request until the last lit point leaves the hardware) can be soaked.
+/// It blanks with its own reason, BLANK_TEST, and only while nothing else has the output
+/// blanked. That measures the driver stage, from ILDABlank to dark; the trip from the kill
+/// button through Engine::kill to the drivers is not part of it.
+
+/// \brief One second of simulated DAC history.
+class SimDACSample
+{
+public:
+    /// Seconds since connect.
+    unsigned int second;
+    /// Ring occupancy seen by the callbacks during the second.
+    size_t minOccupancy;
+    size_t maxOccupancy;
+    double meanOccupancy;
+    /// Totals so far.
+    unsigned long underruns;
+    unsigned long hwUnderruns;
+    unsigned long overruns;
+    unsigned long stalls;
+};
+
+/// \brief Running totals for the whole connection.
+class SimDACStats
+{
+public:
+    SimDACStats();
+    unsigned long callbacks;
+    /// Callbacks that found the ring short, the head was late.
+    unsigned long underruns;
+    unsigned long underrunPoints;
+    /// Times the hardware FIFO ran dry, the callback itself was late.
+    unsigned long hwUnderruns;
+    /// Times a callback had more points then the FIFO had room for, after a stall.
+    unsigned long overruns;
+    unsigned long stalls;
+    size_t minOccupancy;
+    size_t maxOccupancy;
+    double meanOccupancy;
+    /// Largest gap between callbacks in microseconds.
+    double worstCallbackGapUs;
+    /// Number of kills seen, and the time from the request to the hardware going dark.
+    unsigned long kills;
+    double lastKillLatencyUs;
+    double worstKillLatencyUs;
+};
+
+class SimDAC_ILDA;
+
+/// \brief Stands in for the hardware callback.
+class SimDACThread : public QThread
+{
+    Q_OBJECT
+public:
+    SimDACThread (SimDAC_ILDA *driver);
+    ~SimDACThread();
+    void run();
+    void stop();
+    SimDACStats stats () const;
+    std::vector<SimDACSample> history () const;
+private:
+    void callback (const double t);
+    SimDAC_ILDA *driver;
+    boost::atomic<bool> stopping;
+    mutable QMutex statsLock;
+    SimDACStats stats_;
+    std::vector<SimDACSample> history_;
+    // Only touched by the thread
+    double level;
+    double lastTime;
+    double startTime;
+    unsigned int seed;
+    SimDACSample current;
+    bool blanked;
+    double nextKill;
+    double killRelease;
+    double occupancySum;
+    unsigned long occupancyCount;
+    double totalSum;
+};
+
+class SimDAC_ILDA : public Driver
+{
+public:
+    SimDAC_ILDA();
+    ~SimDAC_ILDA();
+    Driver::FLAGS flags();
+    std::vector<std::string> enumerateHardware();
+    bool connect (unsigned int index);
+    bool connected();
+    bool disconnect();
+
+    bool ILDAShutter (bool);
+    bool ILDAInterlock (bool);
+    unsigned int ILDAHwPointsPerSecond();
+    size_t ILDAHwPeriod();
+    /// \brief Statistics for the current (or last) connection.
+    SimDACStats stats () const;
+    /// \brief Per second history for the current connection.
+    std::vector<SimDACSample> history () const;
+private:
+    SimDACThread *thread;
+    unsigned int pps;
+    size_t bufferSize;
+    size_t period;
+    unsigned int jitterUs;
+    double stallProbability;
+    unsigned int stallMs;
+    unsigned int seed;
+    double killTestS;
+    SimDACStats lastStats;
+    friend class SimDACThread;
+};
+
+#endif
@@ -33,7 +33,15 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #endif
 #include "motormix.h"
 #include "mime.h"
+#include "watchdog.h"
+#include "rtconfig.h"
+#include "headscheduler.h"
 #include <QtCore>
+#include <QtConcurrentRun>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "showcodec.h"
 
 EngineStarter::EngineStarter(QObject *parent): QThread(parent)
 {
@@ -52,19 +60,8 @@ void EngineStarter::run()
 {
     slog()->debugStream() << "Starting laser engine thread " << std::hex << currentThreadId();
     /// TODO - Come up with a way to put things into windows soft RT scheduling class
-#if __unix
-    pthread_t tid = pthread_self();
     slog()->infoStream() << "Started show engine";
-    struct sched_param sp;
-    sp.sched_priority = 30;
-    int err;
-    err = pthread_setschedparam(tid,SCHED_FIFO,&sp);
-    if (err) {
-        slog()->errorStream() <<"Failed to set RT scheduling for laser engine control thread :" << strerror(err);
-    } else {
-        slog()->infoStream() <<"Set posix RT scheduling for engine thread";
-    }
-#endif
+    RTConfig::setupThread("Engine");
     e = boost::make_shared<Engine>();
     exec();
 }
@@ -88,26 +85,33 @@ Engine::Engine(QObject* parent) : QObject(parent)
 {
     saver = NULL;
     loader = NULL;
+    loadDevice = NULL;
     importer = NULL;
+    watchdog = NULL;
+    prefetcher = NULL;
+    compactor = NULL;
+    mergeLoad = false;
+    sources = boost::make_shared<SourceTable>();
     selected_head = 0;
     slog()->infoStream() << "New laser show engine created : " << this;
     emit message (tr("Starting show engine"),5000);
     QSettings settings;
     settings.beginGroup("Engine");
-    for (unsigned int i=0; i < MAX_HEADS; i++) {
-        emit message(tr("Starting projector head"),5000);
-        heads[i]=new HeadThread (this);
-        startHead(i);// Bring up the laser head thread
-    }
-    for (unsigned int i=0; i < MAX_HEADS; i++) {
-        while (!heads[i]->head) { // Wait for the heads to come up
-            usleep (10000);
-        }
-        connect (&(*heads[i]->head),SIGNAL(selectionChanged (uint, bool)),this,SLOT(selectionChangedData(uint,bool)));
-        getHead(i)->setDriver("Dummy (ILDA)");
-        getHead(i)->getDriver()->enumerateHardware();
-        getHead(i)->getDriver()->connect(0);
-    }
+    scheduler = new HeadScheduler();
+    scheduler->start();
+    setHeadCount(settings.value("Heads",DEFAULT_HEADS).toUInt());
+    // Only once the heads are up, else it would find them all late
+    watchdog = new Watchdog(this);
+    watchdog->start(QThread::TimeCriticalPriority);
+    prefetcher = new SlotPrefetcher(this);
+    prefetcher->start(QThread::LowPriority);
+    // The journal lives with the settings, it is not started until recoverJournal
+    const QString dir = QFileInfo(settings.fileName()).absolutePath();
+    settings.beginGroup("Journal");
+    journal = new ShowJournal(settings.value("File",dir + "/lucifer.journal").toString());
+    autosaveName = settings.value("Autosave",dir + "/lucifer-autosave.lsb").toString();
+    compactSize = settings.value("Compact size",JOURNAL_COMPACT_SIZE).toULongLong();
+    settings.endGroup();
     // configure the midi interface
     settings.beginGroup("Midi");
     setMIDICard(settings.value("Device",QString("")).toString());
@@ -193,17 +197,17 @@ void Engine::setMIDIChannelDriver(unsigned int channel, QString driver)
 Engine::~Engine()
 {
     slog()->infoStream() << "Stopping show engine";
+    delete prefetcher;
+    prefetcher = NULL;
     kill();
-    for (unsigned int i=0; i < MAX_HEADS; i++) {
-        if (heads[i]) {
-            heads[i]->quit();
-        }
-    }
-    for (unsigned int i=0; i < MAX_HEADS; i++) {
-        ///UGLY Hack to get the threads stopped before we exit
-        while (heads[i] && (!heads[i]->isFinished())) {
-            usleep (20000);
-        }
+    // Stopping heads miss their deadlines, so the watchdog goes first
+    delete watchdog;
+    watchdog = NULL;
+    delete scheduler;
+    scheduler = NULL;
+    {
+        QWriteLocker l(&head_lock);
+        heads.clear();
     }
     // make sure any file save threads have finished.
     while (!save_mutex.tryLock()) {
@@ -213,8 +217,16 @@ Engine::~Engine()
     while (!load_mutex.tryLock()) {
         usleep (20000);
     }
+    while (!compact_mutex.tryLock()) {
+        usleep (20000);
+    }
     load_mutex.unlock();
     save_mutex.unlock();
+    compact_mutex.unlock();
+    delete compactor;
+    // A clean exit, there is nothing to recover next time
+    journal->discard();
+    delete journal;
     slog()->infoStream() << "Laser show engine deleted : " << this;
 }
 
@@ -222,58 +234,165 @@ bool Engine::addFrameSource(SourceImplPtr fs,long int pos)
 {
     slog()->debugStream() << "Adding framesource " << fs << " to engine " << this <<" at index " << pos;
     bool resized= false;
-    QWriteLocker locker(&source_lock);
+    // Serialised first, only appending it waits for the lock
+    const QByteArray record = ShowJournal::payload(fs);
+    QMutexLocker locker(&source_write_lock);
+    boost::shared_ptr<SourceTable> t = boost::make_shared<SourceTable>(*boost::atomic_load(&sources));
     if (pos < 0) {
-        for (unsigned int i = 0; i < sources.size(); i++) {
-            if (!sources[i]) { // Find the first empty slot
+        for (unsigned int i = 0; i < t->size(); i++) {
+            if (!(*t)[i]) { // Find the first empty slot
                 pos = i;
                 break;
             }
         }
         if (pos < 0) {// Or create a new one
-            pos = sources.size();
+            pos = t->size();
         }
     }
-    if (sources.size() <= (unsigned long) pos) {
+    if (t->size() <= (unsigned long) pos) {
         //extend the sources array to accomodate pos+1 objects
-        sources.resize(pos+1);
+        t->resize(pos+1);
         resized = true;
     }
-    sources[pos] = fs;
+    (*t)[pos] = fs;
+    boost::atomic_store(&sources,SourceTablePtr(t));
+    journal->record(pos,record);
+    const size_t size = t->size();
     locker.unlock();
     if (resized) {
-        emit sourcesSizeChanged (sources.size());
+        emit sourcesSizeChanged (size);
     }
     emit frameSourceChanged (pos);
+    checkJournal();
+    return true;
+}
+
+void Engine::checkJournal()
+{
+    if (journal->size() > compactSize) {
+        // This may be a loader or importer thread, the snapshot is taken on ours
+        QMetaObject::invokeMethod(this,"compactJournal",Qt::QueuedConnection);
+    }
+}
+
+bool Engine::addFrameSources(const std::vector<std::pair<size_t,SourceImplPtr> > &fs)
+{
+    if (fs.empty()) {
+        return true;
+    }
+    slog()->debugStream() << "Adding " << fs.size() << " framesources to engine " << this;
+    QMutexLocker locker(&source_write_lock);
+    boost::shared_ptr<SourceTable> t = boost::make_shared<SourceTable>(*boost::atomic_load(&sources));
+    const size_t old = t->size();
+    for (unsigned int i = 0; i < fs.size(); i++) {
+        if (t->size() <= fs[i].first) {
+            t->resize(fs[i].first + 1);
+        }
+        (*t)[fs[i].first] = fs[i].second;
+    }
+    boost::atomic_store(&sources,SourceTablePtr(t));
+    const size_t size = t->size();
+    locker.unlock();
+    if (size != old) {
+        emit sourcesSizeChanged (size);
+    }
+    for (unsigned int i = 0; i < fs.size(); i++) {
+        emit frameSourceChanged (fs[i].first);
+    }
     return true;
 }
 
 SourceImplPtr Engine::getFrameSource(const size_t pos)
 {
     SourceImplPtr ret;
-    QReadLocker locker(&source_lock);
-    if (pos < sources.size()) {
-        ret = sources[pos];
+    SourceTablePtr t = boost::atomic_load(&sources);
+    if (pos < t->size()) {
+        ret = (*t)[pos];
+    }
+    BinaryShowStubPtr stub = boost::dynamic_pointer_cast<BinaryShowStub>(ret);
+    if (stub) {
+        // Whoever asked is about to draw it, fault the points in now rather than in a head
+        stub->warm();
+        ret = resolveFrameSource(pos);
+        if (prefetcher) {
+            prefetcher->request(pos);
+        }
     }
     return ret;
 }
 
-PlaybackPtr Engine::getPlayback(const size_t pos)
+SourceImplPtr Engine::resolveFrameSource(const size_t pos)
+{
+    SourceTablePtr t = boost::atomic_load(&sources);
+    if (pos >= t->size()) {
+        return SourceImplPtr();
+    }
+    BinaryShowStubPtr stub = boost::dynamic_pointer_cast<BinaryShowStub>((*t)[pos]);
+    if (!stub) {
+        return (*t)[pos];
+    }
+    // Decode without the lock, if two threads race for a slot the loser's tree is just dropped
+    SourceImplPtr fs = stub->resolve();
+    QMutexLocker locker(&source_write_lock);
+    t = boost::atomic_load(&sources);
+    if ((pos >= t->size()) || ((*t)[pos] != stub)) {
+        // Resolved or replaced while we were decoding
+        return (pos < t->size()) ? (*t)[pos] : SourceImplPtr();
+    }
+    boost::shared_ptr<SourceTable> n = boost::make_shared<SourceTable>(*t);
+    (*n)[pos] = fs;
+    boost::atomic_store(&sources,SourceTablePtr(n));
+    slog()->debugStream() << "Decoded lazily loaded slot " << pos;
+    return fs;
+}
+
+PlaybackPtr Engine::getPlayback(const size_t pos, const bool resolve)
 {
-    PlaybackPtr pb = boost::make_shared<Playback>(getFrameSource(pos));
+    if (resolve) {
+        PlaybackPtr pb = boost::make_shared<Playback>(getFrameSource(pos));
+        return pb;
+    }
+    // A head, so no decoding and no write lock, just the table as it stands
+    SourceImplPtr fs;
+    SourceTablePtr t = boost::atomic_load(&sources);
+    if (pos < t->size()) {
+        fs = (*t)[pos];
+    }
+    if (prefetcher && boost::dynamic_pointer_cast<BinaryShowStub>(fs)) {
+        prefetcher->request(pos);
+    }
+    PlaybackPtr pb = boost::make_shared<Playback>(fs);
     return pb;
 }
 
+bool Engine::slotReady(const size_t pos)
+{
+    SourceTablePtr t = boost::atomic_load(&sources);
+    if ((pos >= t->size()) || !boost::dynamic_pointer_cast<BinaryShowStub>((*t)[pos])) {
+        return true;
+    }
+    if (prefetcher) {
+        prefetcher->request(pos);
+    }
+    return false;
+}
+
 size_t Engine::getSourcesSize() const
 {
-    return sources.size();
+    return boost::atomic_load(&sources)->size();
+}
+
+SourceTablePtr Engine::getSources() const
+{
+    return boost::atomic_load(&sources);
 }
 
 LaserHeadPtr Engine::getHead(const size_t pos)
 {
     LaserHeadPtr ret;
-    if (pos < MAX_HEADS) {
-        ret = heads[pos]->head;
+    QReadLocker l(&head_lock);
+    if (pos < heads.size()) {
+        ret = heads[pos];
     } else {
         slog()->errorStream() << "Attempted to get invalid head " << pos;
     }
@@ -330,28 +449,113 @@ QMimeData* Engine::mimeData(int pos)
     return mime;
 }
 
-bool Engine::startHead(const size_t pos)
+size_t Engine::headCount() const
 {
-    assert (heads[pos]);
-    if (pos < MAX_HEADS) {
-        if (!heads[pos]->isRunning()) {
-            heads[pos]->start(QThread::HighestPriority);
-        } else {
-            slog()->errorStream() << "Attempted to start head that was already running";
-            return false;
+    QReadLocker l(&head_lock);
+    return heads.size();
+}
+
+bool Engine::setHeadCount(size_t n)
+{
+    if (n < 1) {
+        n = 1;
+    }
+    size_t count = headCount();
+    if (n == count) {
+        return true;
+    }
+    while (count < n) {
+        emit message(tr("Starting projector head"),5000);
+        addHead(count++);
+    }
+    while (count > n) {
+        removeHead();
+        count--;
+    }
+    if ((size_t) selected_head >= count) {
+        selectHead(0);
+    }
+    QSettings settings;
+    settings.setValue("Engine/Heads",(unsigned int) count);
+    slog()->infoStream() << count << " heads on " << scheduler->workers() << " scheduler workers";
+    emit headCountChanged(count);
+    return true;
+}
+
+void Engine::addHead(const size_t pos)
+{
+    LaserHeadPtr h = boost::make_shared<LaserHead>(this);
+    // Head slots run in the engine thread whoever asked for the head
+    h->moveToThread(thread());
+    connect (&(*h),SIGNAL(selectionChanged (uint, bool)),this,SLOT(selectionChangedData(uint,bool)));
+    h->setDriver("Dummy (ILDA)");
+    h->getDriver()->enumerateHardware();
+    h->getDriver()->connect(0);
+    h->setWarp(WarpParams::load(QString().sprintf("Engine/Head %d/Warp",(int)pos+1)));
+    h->setMask(MaskParams::load(QString().sprintf("Engine/Head %d/Mask",(int)pos+1)));
+    {
+        QWriteLocker l(&head_lock);
+        heads.push_back(h);
+    }
+    scheduler->add(h);
+    slog()->infoStream()<< "Head " << pos << " Started";
+}
+
+void Engine::removeHead()
+{
+    LaserHeadPtr h;
+    {
+        QWriteLocker l(&head_lock);
+        if (heads.empty()) {
+            return;
         }
-    } else {
-        slog()->errorStream() << "Attempted to start head "<< pos << ", but there are only " << int(MAX_HEADS);
+        h = heads.back();
+        heads.pop_back();
+    }
+    scheduler->remove(h);
+    DriverPtr d = h->getDriver();
+    if (d) {
+        d->ILDABlank(Driver::BLANK_KILL,true);
+        d->disconnect();
+    }
+    slog()->infoStream()<< "Head " << headCount() << " Stopped";
+}
+
+bool Engine::setHeadWarp(const size_t pos, const WarpParams& p)
+{
+    LaserHeadPtr h = getHead(pos);
+    if (!h) {
         return false;
     }
-    slog()->infoStream()<< "Head " << pos << " Started";
-    emit message (tr("Head started"),5000);
+    h->setWarp(p);
+    p.save(QString().sprintf("Engine/Head %d/Warp",(int)pos+1));
+    return true;
+}
+
+bool Engine::setHeadMask(const size_t pos, const MaskParams& p)
+{
+    LaserHeadPtr h = getHead(pos);
+    if (!h) {
+        return false;
+    }
+    h->setMask(p);
+    p.save(QString().sprintf("Engine/Head %d/Mask",(int)pos+1));
     return true;
 }
 
 void Engine::kill()
 {
-    for (unsigned int i=0; i < MAX_HEADS; i++) {
+    // Blank the drivers first, that takes effect in the very next output callback
+    for (unsigned int i=0; i < headCount(); i++) {
+        LaserHeadPtr h = getHead(i);
+        if (h) {
+            DriverPtr d = h->getDriver();
+            if (d) {
+                d->ILDABlank(Driver::BLANK_KILL,true);
+            }
+        }
+    }
+    for (unsigned int i=0; i < headCount(); i++) {
         LaserHeadPtr h = getHead(i);
         if (h) {
             h->kill();
@@ -367,12 +571,13 @@ void Engine::kill()
 void Engine::restart()
 {
     slog()->critStream() << "Laser output restarted!";
-    for (unsigned int i=0; i < MAX_HEADS; i++) {
+    for (unsigned int i=0; i < headCount(); i++) {
         LaserHeadPtr h = getHead(i);
         if (h) {
             h->restart();
             DriverPtr d = h->getDriver();
             if (d) {
+                d->ILDABlank(Driver::BLANK_KILL,false);
                 d->ILDAShutter(true);
             }
         }
@@ -381,24 +586,100 @@ void Engine::restart()
 
 void Engine::Saved()
 {
-    saveCompressor->close();
-    delete saveCompressor;
+    const bool ok = saver->ok();
     save_mutex.unlock();
-    slog()->debugStream() << "Show saved, thread terminated";
-    emit showSaved();
-    emit message(tr("Show Saved"),5000);
+    slog()->debugStream() << "Show saver thread terminated";
+    if (ok) {
+        journal->rebase(saveName,saveMark);
+        emit showSaved();
+        emit message(tr("Show Saved"),5000);
+    } else {
+        emit message(tr("Failed to save show"),10000);
+    }
 }
 
 void Engine::Loaded()
 {
-    loadCompressor->close();
-    delete loadCompressor;
+    if (loadDevice) {
+        loadDevice->close();
+        delete loadDevice;
+        loadDevice = NULL;
+    }
     load_mutex.unlock();
     slog()->debugStream() << "Show loaded, thread terminated";
+    if (!replay.empty()) {
+        applyReplay();
+    }
+    if (mergeLoad) {
+        // The journal only knows the show that was there before, so write out the result
+        mergeLoad = false;
+        compactJournal();
+    }
     emit showLoaded();
     emit message(tr("Show Loaded"),5000);
 }
 
+void Engine::compactJournal()
+{
+    if (!compact_mutex.tryLock()) {
+        return;
+    }
+    delete compactor;
+    // The mark first, so every change the snapshot misses is still after it
+    compactMark = journal->mark();
+    SourceTablePtr snapshot = getSources();
+    slog()->debugStream() << "Compacting " << journal->size() << " byte journal into " << autosaveName.toStdString();
+    compactor = new ShowSaver(snapshot,autosaveName);
+    connect (compactor,SIGNAL(finished()),this,SLOT(Compacted()));
+    compactor->start(QThread::LowestPriority);
+}
+
+void Engine::Compacted()
+{
+    if (compactor->ok()) {
+        journal->rebase(QFileInfo(autosaveName).absoluteFilePath(),compactMark);
+    } else {
+        slog()->errorStream() << "Journal compaction failed, it will keep growing";
+    }
+    compact_mutex.unlock();
+}
+
+bool Engine::recoverJournal()
+{
+    QString base;
+    quint64 end;
+    if (!ShowJournal::read(journal->fileName(),base,replay,end)) {
+        replay.clear();
+        journal->start(QString());
+        return false;
+    }
+    slog()->infoStream() << "Recovering " << replay.size() << " changes to " << (base.isEmpty() ? std::string("a new show") : base.toStdString())
+                         << " from " << journal->fileName().toStdString();
+    emit message (tr("Recovering unsaved changes"),5000);
+    journal->resume(end);
+    if (!base.isEmpty()) {
+        if (openShow(base,true)) {
+            // Loaded() applies the changes
+            return true;
+        }
+        slog()->errorStream() << "Couldn't load " << base.toStdString() << ", recovering the changes alone";
+        emit message (tr("Failed to load file : ") + base,10000);
+    }
+    applyReplay();
+    return true;
+}
+
+void Engine::applyReplay()
+{
+    std::vector<std::pair<size_t,SourceImplPtr> > fs;
+    for (unsigned int i=0; i < replay.size(); i++) {
+        fs.push_back(std::pair<size_t,SourceImplPtr>(replay[i].position,ShowJournal::parse(replay[i].data)));
+    }
+    replay.clear();
+    addFrameSources(fs);
+    emit message (tr("Unsaved changes recovered"),5000);
+}
+
 
 bool Engine::saveShow(QString filename)
 {
@@ -408,18 +689,9 @@ bool Engine::saveShow(QString filename)
         if (saver) {
             delete saver;
         }
-        savef.setFileName (filename);
-        saveCompressor = new QtIOCompressor (&savef,6,10 * 1024 * 1024);
-        saveCompressor->setStreamFormat(QtIOCompressor::GzipFormat);
-        if (!saveCompressor->open(QIODevice::WriteOnly)) {
-            delete saveCompressor;
-            save_mutex.unlock();
-            slog()->errorStream() << "Couldn't open file for writing : " << saveCompressor->errorString().toStdString();
-            emit message (tr("Failed to save file : ") + filename,10000);
-            return false;
-        }
-        QXmlStreamWriter *w = new QXmlStreamWriter(saveCompressor);
-        saver = new ShowSaver(this,w);
+        saveName = QFileInfo(filename).absoluteFilePath();
+        saveMark = journal->mark();
+        saver = new ShowSaver(getSources(),filename);
         connect (saver,SIGNAL(finished()),this,SLOT(Saved()));
         slog()->debugStream() << "Starting file saver thread";
         saver->start(QThread::LowPriority);
@@ -432,40 +704,62 @@ bool Engine::saveShow(QString filename)
 }
 
 bool Engine::loadShow(QString filename, const bool clear)
+{
+    if (!openShow(filename,clear)) {
+        return false;
+    }
+    if (clear) {
+        journal->start(QFileInfo(filename).absoluteFilePath());
+    }
+    return true;
+}
+
+bool Engine::openShow(QString filename, const bool clear)
 {
     slog()->infoStream() << "Loading file : " << filename.toStdString();
     if (load_mutex.tryLock()) {
         if (loader) {
             delete loader;
         }
+        mergeLoad = !clear;
         loadf.setFileName(filename);
-        loadCompressor = new QtIOCompressor (&loadf,6,10 *1024 * 1024);
-        loadCompressor->setStreamFormat(QtIOCompressor::GzipFormat);
-        if (!loadCompressor->open(QFile::ReadOnly)) {
-            delete loadCompressor;
-            load_mutex.unlock();
-            slog()->errorStream() << "Couldn't open file for reading : " << loadf.errorString().toStdString();
-            return false;
+        BinaryShowFilePtr binary;
+        loadDevice = NULL;
+        if (BinaryShowFile::isBinaryShow(filename)) {
+            binary = BinaryShowFile::open(filename);
+            if (!binary) {
+                load_mutex.unlock();
+                emit message (tr("Failed to load file : ") + filename,10000);
+                return false;
+            }
+        } else {
+            // Gzip or zstd, whichever the file turns out to be
+            loadDevice = ShowCodec::reader(ShowCodec::detect(filename),&loadf);
+            if (!loadDevice) {
+                load_mutex.unlock();
+                slog()->errorStream() << "Couldn't open file for reading : " << loadf.errorString().toStdString();
+                return false;
+            }
         }
         if (clear) {
-            for (unsigned int i=0; i < sources.size(); i++) {
-                SourceImplPtr p;
-                SourceImplPtr op;
-                op = getFrameSource(i);
-                source_lock.lockForWrite();
-                sources[i] = p;
-                source_lock.unlock();
-                if (op != p) {
+            // Swap in an empty table, the loader will add capacity as needed.
+            SourceTablePtr old;
+            {
+                QMutexLocker locker(&source_write_lock);
+                old = boost::atomic_load(&sources);
+                boost::atomic_store(&sources,SourceTablePtr(boost::make_shared<SourceTable>()));
+            }
+            for (unsigned int i=0; i < old->size(); i++) {
+                if ((*old)[i]) {
                     emit frameSourceChanged (i);
                 }
             }
-            // Clear the vector, the loader will add capacity as needed.
-            source_lock.lockForWrite();
-            sources.clear();
-            source_lock.unlock();
         }
-        QXmlStreamReader *r = new QXmlStreamReader(loadCompressor);
-        loader = new ShowLoader(this,r);
+        if (binary) {
+            loader = new ShowLoader(this,binary);
+        } else {
+            loader = new ShowLoader(this,loadDevice);
+        }
         connect (loader,SIGNAL(finished()),this,SLOT(Loaded()));
         slog()->debugStream() << "Starting file loader thread";
         loader->start();
@@ -476,92 +770,401 @@ bool Engine::loadShow(QString filename, const bool clear)
     }
 }
 
-ShowSaver::ShowSaver(Engine * engine_, QXmlStreamWriter *w_): QThread()
+ShowSaver::ShowSaver(SourceTablePtr snapshot_, const QString filename_): QThread()
 {
-    e = engine_;
-    w = w_;
+    snapshot = snapshot_;
+    filename = filename_;
+    ok_ = false;
 }
+
 ShowSaver::~ShowSaver()
 {
 }
 
-void ShowSaver::run()
+bool ShowSaver::ok() const
 {
-    w->setAutoFormatting(true);
-    w->writeStartDocument();
-    w->writeStartElement("Lucifer");
-    w->writeAttribute("Version","1.1.0");
-    w->writeAttribute("Date",QDateTime::currentDateTime().toString());
-    for (unsigned int i=0; i < e->getSourcesSize(); i++) {
-        SourceImplPtr p = e->getFrameSource(i);
-        if (p) {
-            w->writeStartElement("Sequence");
-            w->writeAttribute("Position",QString().number(i));
-            p->saveFrames(w);
-            w->writeEndElement();//Sequence
+    return ok_;
+}
+
+SourceImplPtr ShowSaver::resolved(SourceImplPtr p)
+{
+    // Decoded just for the save, slots nobody has used stay as stubs in the engine
+    BinaryShowStubPtr stub = boost::dynamic_pointer_cast<BinaryShowStub>(p);
+    return stub ? stub->resolve() : p;
+}
+
+QByteArray ShowSaver::serialise(const size_t pos, SourceImplPtr p)
+{
+    QByteArray b;
+    p = resolved(p);
+    if (!p) {
+        return b;
+    }
+    QXmlStreamWriter w(&b);
+    w.setAutoFormatting(true);
+    w.writeStartElement("Sequence");
+    w.writeAttribute("Position",QString().number(pos));
+    p->saveFrames(&w);
+    w.writeEndElement();//Sequence
+    b.append('\n');
+    return b;
+}
+
+bool ShowSaver::runBinary(QFile &f)
+{
+    BinaryShowWriter b(&f);
+    for (unsigned int i=0; i < snapshot->size(); i++) {
+        if (!b.writeSlot(i,resolved((*snapshot)[i]))) {
+            break;
         }
     }
-    w->writeEndElement();// Lucifer show
-    w->writeEndDocument();
-    delete w;
+    if (!b.finish()) {
+        slog()->errorStream() << "Binary show save failed : " << b.errorString().toStdString();
+        return false;
+    }
+    return true;
+}
+
+/// Sequences being serialised or waiting to be compressed, bounds memory on big shows.
+#define SAVER_INFLIGHT (64)
+
+bool ShowSaver::runXml(QFile &f)
+{
+    QSettings settings;
+    const ShowCodec::Codec codec = ShowCodec::fromName(settings.value("Engine/Saving/Codec","gzip").toString());
+    ShowStreamWriterPtr z = ShowCodec::writer(codec,&f,ShowCodec::level(codec));
+    // The document is built by hand around independently written Sequence elements
+    QByteArray head;
+    {
+        QXmlStreamWriter w(&head);
+        w.setAutoFormatting(true);
+        w.writeStartDocument();
+        w.writeStartElement("Lucifer");
+        w.writeAttribute("Version","1.1.0");
+        w.writeAttribute("Date",QDateTime::currentDateTime().toString());
+        // Closes the start tag
+        w.writeCharacters("\n");
+    }
+    z->write(head);
+    QList<QFuture<QByteArray> > pending;
+    for (unsigned int i=0; i < snapshot->size(); i++) {
+        if ((*snapshot)[i]) {
+            pending.append(QtConcurrent::run(&ShowSaver::serialise,(size_t) i,(*snapshot)[i]));
+        }
+        // In order, so the file comes out in position order whatever the pool does
+        while (!pending.isEmpty() && ((pending.size() > SAVER_INFLIGHT) || pending.first().isFinished())) {
+            z->write(pending.takeFirst().result());
+        }
+    }
+    while (!pending.isEmpty()) {
+        z->write(pending.takeFirst().result());
+    }
+    z->write(QByteArray("</Lucifer>\n"));
+    if (!z->finish()) {
+        slog()->errorStream() << "Show save failed : " << z->errorString().toStdString();
+        return false;
+    }
+    return true;
+}
+
+void ShowSaver::run()
+{
+    QTime timer;
+    timer.start();
+    // Written beside the real file and renamed over it, so a failed save (or a binary show
+    // still mapped from the old file) never sees a half written one
+    const QString tmp = filename + ".saving";
+    QFile f(tmp);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        slog()->errorStream() << "Couldn't open file for writing : " << f.errorString().toStdString();
+        return;
+    }
+    const bool binary = filename.endsWith(".lsb",Qt::CaseInsensitive);
+    bool res = binary ? runBinary(f) : runXml(f);
+    if (res && !f.flush()) {
+        res = false;
+    }
+    if (res && fsync(f.handle())) {
+        slog()->errorStream() << "Couldn't sync " << tmp.toStdString() << " : " << strerror(errno);
+        res = false;
+    }
+    f.close();
+    if (res && rename(QFile::encodeName(tmp).constData(),QFile::encodeName(filename).constData())) {
+        slog()->errorStream() << "Couldn't rename " << tmp.toStdString() << " : " << strerror(errno);
+        res = false;
+    }
+    if (!res) {
+        QFile::remove(tmp);
+        return;
+    }
+    ok_ = true;
+    slog()->infoStream() << "Saved " << filename.toStdString() << " in " << timer.elapsed() << "ms";
 }
 
+LoadedSequence::LoadedSequence()
+{
+    index = 0;
+}
+
+ShowLoader::ShowLoader(Engine* engine_, QIODevice* in_): QThread()
+{
+    e = engine_;
+    in = in_;
+}
 
-ShowLoader::ShowLoader(Engine* engine_, QXmlStreamReader* r_): QThread()
+ShowLoader::ShowLoader(Engine* engine_, BinaryShowFilePtr binary_): QThread()
 {
     e = engine_;
-    r = r_;
+    in = NULL;
+    binary = binary_;
 }
 
 ShowLoader::~ShowLoader()
 {
 }
 
-void ShowLoader::run()
+/// Bytes read from the decompressor at a time.
+#define LOADER_BLOCK (1024 * 1024)
+/// Most sequences parsed or waiting to be, bounds memory on big shows.
+#define LOADER_INFLIGHT (64)
+/// Sequences handed to the engine at once, each hand over copies the sources table.
+#define LOADER_BATCH (256)
+
+/// Find the next <Sequence start tag, not just something that starts with the same letters.
+static int findSequence(const QByteArray &buf, int from)
+{
+    while ((from = buf.indexOf("<Sequence",from)) >= 0) {
+        if (from + 9 >= buf.size()) {
+            return -1;
+        }
+        const char c = buf.at(from + 9);
+        if ((c == ' ') || (c == '>') || (c == '\t') || (c == '\n') || (c == '\r')) {
+            return from;
+        }
+        from += 9;
+    }
+    return -1;
+}
+
+bool ShowLoader::checkHeader(const QByteArray head)
 {
-    while (!r->atEnd()) {
+    QXmlStreamReader r(head);
+    while (!r.atEnd()) {
         // Find the document head and check that this is the correct file format
-        if (r->name().toString() == "Lucifer") {
+        if (r.isStartElement() && (r.name().toString() == "Lucifer")) {
             slog()->debugStream() << "Found a Lucifer header";
-            break;
+            if (r.attributes().value("Version") == "1.1.0") {
+                slog()->debugStream() << "File is version 1.1.0";
+                return true;
+            }
+            slog()->errorStream() << "Unsupported show file version : " << r.attributes().value("Version").toString().toStdString();
+            return false;
         }
-        r->readNext();
+        r.readNext();
+    }
+    slog()->errorStream() << "File read error : not a Lucifer show";
+    return false;
+}
+
+LoadedSequence ShowLoader::parseSequence(const QByteArray chunk)
+{
+    LoadedSequence res;
+    QXmlStreamReader r(chunk);
+    r.readNextStartElement();
+    res.index = r.attributes().value("Position").toString().toULong();
+    slog()->infoStream()<<"Loading sequence at : " << res.index;
+    r.readNextStartElement();
+    if (r.tokenType() != QXmlStreamReader::StartElement) {
+        slog()->errorStream() <<"Xml error in sequence " << res.index << " : " << r.errorString().toStdString();
+        return res;
+    }
+    res.fs = FrameSource_impl::loadFrames (&r);
+    if (r.hasError()) {
+        slog()->errorStream() << "File read error in sequence " << res.index << " : " << r.errorString().toStdString();
     }
-    if ((!r->hasError ()) && (r->attributes().value("Version") == "1.1.0")) {
-        // Ok, a V1.1.0 Lucifer file has been found
-        // Next up sit in a loop reading sequence elements
-        slog()->debugStream() << "File is version 1.1.0";
-        while ((!r->atEnd()) && (!r->isEndDocument())) {
-            if (r->isEndElement() && (r->name().toString() == "Lucifer")) {
+    return res;
+}
+
+void ShowLoader::collect(const bool all)
+{
+    while (!pending.isEmpty() && (all || (pending.size() > LOADER_INFLIGHT) || pending.first().isFinished())) {
+        // result() waits, so this keeps document order whatever order the pool finishes in
+        const LoadedSequence s = pending.takeFirst().result();
+        if (s.fs) {
+            batch.push_back(std::make_pair(s.index,s.fs));
+        }
+        if (batch.size() >= LOADER_BATCH) {
+            e->addFrameSources(batch);
+            batch.clear();
+        }
+    }
+    if (all && !batch.empty()) {
+        e->addFrameSources(batch);
+        batch.clear();
+    }
+}
+
+void ShowLoader::runBinary()
+{
+    QTime timer;
+    timer.start();
+    QSettings settings;
+    if (settings.value("Engine/Loading/Lazy",true).toBool()) {
+        // Only the index is read, the engine decodes each slot when it is first used
+        for (unsigned int i = 0; i < binary->slotCount(); i++) {
+            batch.push_back(std::make_pair(binary->slot(i).position,SourceImplPtr(boost::make_shared<BinaryShowStub>(binary,i))));
+        }
+        e->addFrameSources(batch);
+        batch.clear();
+        slog()->infoStream() << "Indexed " << binary->slotCount() << " binary sequences in " << timer.elapsed() << "ms";
+        binary.reset();
+        return;
+    }
+    for (unsigned int i = 0; i < binary->slotCount(); i++) {
+        SourceImplPtr fs = binary->loadSlot(i);
+        if (fs) {
+            batch.push_back(std::make_pair(binary->slot(i).position,fs));
+        }
+        if (batch.size() >= LOADER_BATCH) {
+            e->addFrameSources(batch);
+            batch.clear();
+        }
+    }
+    e->addFrameSources(batch);
+    batch.clear();
+    slog()->infoStream() << "Loaded " << binary->slotCount() << " binary sequences in " << timer.elapsed() << "ms";
+    binary.reset();
+}
+
+void ShowLoader::run()
+{
+    if (binary) {
+        runBinary();
+        return;
+    }
+    QByteArray buf;
+    bool header = false;
+    // Everything in buf before this has been handed out
+    int offset = 0;
+    // Where to resume looking for the end of the next Sequence
+    int endSearch = 0;
+    unsigned int chunks = 0;
+    QTime timer;
+    timer.start();
+    while (true) {
+        const QByteArray more = in->read(LOADER_BLOCK);
+        const bool eof = more.isEmpty();
+        // Drop what has been parsed once per block rather than once per Sequence
+        if (offset) {
+            buf.remove(0,offset);
+            endSearch = (endSearch > offset) ? endSearch - offset : 0;
+            offset = 0;
+        }
+        buf.append(more);
+        if (!header) {
+            const int first = findSequence(buf,0);
+            if ((first < 0) && !eof) {
+                continue;
+            }
+            if (!checkHeader(buf.left((first < 0) ? buf.size() : first))) {
                 break;
             }
-            while ((!r->atEnd()) && (!r->isStartElement()) && (r->name().toString() != "Sequence")) {
-                slog()->infoStream() << "Loader looking for a sequence StartElement tag, got : "<<
-                r->tokenType() << " : " << r->name().toString().toStdString();
-                r->readNext();
+            header = true;
+        }
+        int start;
+        while ((start = findSequence(buf,offset)) >= 0) {
+            const int end = buf.indexOf("</Sequence>",(endSearch > start) ? endSearch : start);
+            if (end < 0) {
+                // Incomplete, the tag may straddle the block so back off a little for next time
+                endSearch = (buf.size() > 11) ? buf.size() - 11 : 0;
+                break;
             }
-            if (r->isStartElement() && (r->name() == "Sequence")) {
-                // something to load
-                size_t index;
-                index = r->attributes().value("Position").toString().toULong();
-                slog()->infoStream()<<"Loading sequence at : " << index;
-                r->readNextStartElement();
-                if (r->tokenType()==QXmlStreamReader::Invalid){
-                    slog()->errorStream() <<"Xml error : " << r->errorString().toStdString();
-                    break;
-                }
-                assert (r->tokenType() == QXmlStreamReader::StartElement);
-                SourceImplPtr fs = FrameSource_impl::loadFrames (r);
-                e->addFrameSource(fs,index);
-            } else {
-                r->readNextStartElement();
+            const int stop = end + 11;
+            pending.append(QtConcurrent::run(&ShowLoader::parseSequence,buf.mid(start,stop - start)));
+            chunks++;
+            offset = stop;
+            endSearch = 0;
+            collect(false);
+        }
+        if (eof) {
+            break;
+        }
+    }
+    collect(true);
+    slog()->infoStream() << "Loaded " << chunks << " sequences in " << timer.elapsed() << "ms";
+}
+
+/// Slots either side of the one used to decode ahead of time.
+#define PREFETCH_DISTANCE (32)
+
+SlotPrefetcher::SlotPrefetcher(Engine* engine_): QThread()
+{
+    e = engine_;
+    centre = 0;
+    pending = false;
+    stopping = false;
+    QSettings settings;
+    distance = settings.value("Engine/Loading/Prefetch slots",PREFETCH_DISTANCE).toUInt();
+}
+
+SlotPrefetcher::~SlotPrefetcher()
+{
+    stop();
+    wait();
+}
+
+void SlotPrefetcher::stop()
+{
+    QMutexLocker l(&lock);
+    stopping = true;
+    wake.wakeAll();
+}
+
+void SlotPrefetcher::request(const size_t pos)
+{
+    QMutexLocker l(&lock);
+    centre = pos;
+    pending = true;
+    wake.wakeAll();
+}
+
+void SlotPrefetcher::run()
+{
+    QMutexLocker l(&lock);
+    while (!stopping) {
+        if (!pending) {
+            wake.wait(&lock);
+            continue;
+        }
+        const size_t c = centre;
+        pending = false;
+        l.unlock();
+        // The slot itself first, a head may be waiting on it
+        prefetch(c);
+        l.relock();
+        // Then nearest first, checking between slots for a newer request
+        for (unsigned int d = 1; (d <= distance) && !pending && !stopping; d++) {
+            l.unlock();
+            prefetch(c + d);
+            if (d <= c) {
+                prefetch(c - d);
             }
+            l.relock();
         }
     }
-    if (r->hasError()) {
-        slog()->errorStream() << "File read error :" << r->errorString().toStdString();
+}
+
+void SlotPrefetcher::prefetch(const size_t pos)
+{
+    SourceTablePtr t = e->getSources();
+    if (pos >= t->size()) {
+        return;
+    }
+    BinaryShowStubPtr stub = boost::dynamic_pointer_cast<BinaryShowStub>((*t)[pos]);
+    if (stub) {
+        stub->warm();
+        e->resolveFrameSource(pos);
     }
-    delete r;
 }
 
 bool Engine::importShow(QStringList filenames, int index)
@@ -575,6 +1178,7 @@ bool Engine::importShow(QStringList filenames, int index)
         importer = new ShowImporter(this,filenames,index);
         emit message (tr("Importing frames"),5000);
         connect (importer,SIGNAL(finished()),this,SLOT(Imported()));
+        connect (importer,SIGNAL(fileImported(int,int,QString,bool)),this,SLOT(fileImported(int,int,QString,bool)));
         slog()->debugStream() << "Starting file importer thread";
         importer->start();
         return true;
@@ -585,6 +1189,16 @@ bool Engine::importShow(QStringList filenames, int index)
     }
 }
 
+void Engine::fileImported(int done, int total, QString filename, bool ok)
+{
+    if (ok) {
+        emit message (tr("Imported %1 of %2 : %3").arg(done).arg(total).arg(filename),5000);
+    } else {
+        emit message (tr("Unable to import %1 of %2 : %3").arg(done).arg(total).arg(filename),10000);
+    }
+    emit importProgress (done,total);
+}
+
 void Engine::Imported()
 {
     import_mutex.unlock();
@@ -598,24 +1212,60 @@ ShowImporter::ShowImporter (Engine* engine_, QStringList fileName, int index)
     e=engine_;
     name = fileName;
     idx = index;
+    done = 0;
 }
 ShowImporter::~ShowImporter()
 {
 }
 
+SourceImplPtr ShowImporter::importFile(const QString filename)
+{
+    Ildaloader loader;
+    unsigned int err=0;
+    SourceImplPtr fs = loader.load(filename,err,false);
+    QSettings settings;
+    settings.beginGroup("Engine/Import");
+    if (fs && settings.value("Decimate",true).toBool()) {
+        size_t before = 0;
+        size_t after = 0;
+        StaticFrame::decimateTree(fs,settings.value("Decimate tolerance",DECIMATE_TOLERANCE).toDouble(),
+                                  settings.value("Decimate max step",DECIMATE_MAX_STEP).toDouble(),before,after);
+        slog()->infoStream() << "Decimated " << filename.toStdString() << " from " << before << " to " << after << " points";
+    }
+    return fs;
+}
+
+void ShowImporter::add(SourceImplPtr fs)
+{
+    if (fs) {
+        e->addFrameSource(fs,idx);
+        idx = -1;
+    } else {
+        slog()->errorStream() << "Unable to import " << name[done].toStdString();
+    }
+    done++;
+    emit fileImported(done,name.size(),name[done - 1],fs ? true : false);
+}
+
 void ShowImporter::run()
 {
+    QTime timer;
+    timer.start();
+    done = 0;
+    // Enough files to keep the pool busy between the small ones, not so many that they all sit in memory
+    const int inflight = 2 * QThread::idealThreadCount();
+    QList<QFuture<SourceImplPtr> > pending;
     for (int i=0; i < name.size(); i++) {
-        Ildaloader loader;
-        unsigned int err=0;
-        SourceImplPtr fs = loader.load(name[i],err, false);
-        if (fs) {
-            e->addFrameSource(fs,idx);
-            idx = -1;
-        } else {
-            // ILDA Load error
+        pending.append(QtConcurrent::run(&ShowImporter::importFile,name[i]));
+        // result() waits, so the files reach the engine in the order given
+        while (!pending.isEmpty() && ((pending.size() > inflight) || pending.first().isFinished())) {
+            add(pending.takeFirst().result());
         }
     }
+    while (!pending.isEmpty()) {
+        add(pending.takeFirst().result());
+    }
+    slog()->infoStream() << "Imported " << name.size() << " files in " << timer.elapsed() << "ms";
 }
 
 void Engine::clicked(const int pos)
@@ -628,7 +1278,7 @@ void Engine::clicked(const int pos)
 
 void Engine::deselect(const int pos)
 {
-    for (int i=0; i < MAX_HEADS; i++) {
+    for (unsigned int i=0; i < headCount(); i++) {
         LaserHeadPtr h = getHead(i);
         if (h) {
             h->select (pos,false);
@@ -657,11 +1307,14 @@ void Engine::manualNext()
 
 void Engine::selectHead(int head)
 {
-    if (head < MAX_HEADS) {
+    if ((head >= 0) && ((size_t) head < headCount())) {
         selected_head = head;
         emit headSelectionChanged (head);
     }
     LaserHeadPtr h = getHead(selected_head);
+    if (!h) {
+        return;
+    }
     for (unsigned int i=0; i <getSourcesSize(); i++) {
         selectionChangedData(i,h->isSelected(i));
     }
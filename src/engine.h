@@ -24,7 +24,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <boost/shared_ptr.hpp>
 #include "frame.h"
 #include "framesource.h"
-#include "qtiocompressor.h"
+#include "journal.h"
 
 class Engine;
 typedef boost::shared_ptr<Engine> EnginePtr;
@@ -38,7 +38,13 @@ typedef boost::shared_ptr<Engine> EnginePtr;
 class ShowSaver;
 class ShowLoader;
 class ShowImporter;
-class HeadThread;
+class Watchdog;
+class HeadScheduler;
+class SlotPrefetcher;
+
+/// The table of frame sources held by the engine, see Engine::sources.
+typedef std::vector<SourceImplPtr> SourceTable;
+typedef boost::shared_ptr<const SourceTable> SourceTablePtr;
 
 /// \brief  A little shim that starts the show engine in its own thread
 ///so the GUI event loop cannot block the engine from serving up new frame sources to the heads.
@@ -74,41 +80,92 @@ public:
     /// @param[in] fs is a reference counted pointer to an object derived from  class FrameSource.
     /// @param[in] pos is the index to store the reference in. (-1 causes the engine to use the next available slot).
     /// @return true on sucess, false on failure.
-    /// Causes frameSourceChanged to be emitted.
+    /// Causes frameSourceChanged to be emitted, and the new tree to be appended to the journal.
+    /// The record is appended under the same lock as the table is swapped, so the journal
+    /// holds changes in the order they were made.
     bool addFrameSource (SourceImplPtr fs, long int pos);
+    /// \brief Add many frame sources at known positions with a single copy of the sources table.
+    /// This is for the loaders, so nothing is journaled, the show file they read from already is.
+    /// @param[in] fs is the list of positions and sources, later entries win.
+    /// @return true on sucess, false on failure.
+    /// Causes frameSourceChanged to be emitted for each entry.
+    bool addFrameSources (const std::vector<std::pair<size_t,SourceImplPtr> > &fs);
     /// \brief Returns a reference counted pointer to the FrameSource indexed at pos.
+    /// A slot of a lazily loaded show is decoded here the first time it is asked for, and the
+    /// slots around it are queued for the prefetcher.
     /// @param[in] pos is the index of the FrameSource to return.
     /// @return a reference counted pointer to the FrameSource at position pos;
     SourceImplPtr getFrameSource (const size_t pos);
+    /// \brief Decode a lazily loaded slot if it has not been already, without prefetching around it.
+    /// @param[in] pos is the index of the slot.
+    /// @return the FrameSource now at pos.
+    SourceImplPtr resolveFrameSource (const size_t pos);
     /// \brief Create and return a reference counted  pointer to a new Playback appropriate to the FrameSource at pos.
     /// @param[in] pos is the index of the FrameSource that we need a playback for.
+    /// @param[in] resolve decodes a lazily loaded slot first, as getFrameSource does. The heads
+    /// pass false as they must not wait for a decode, a slot still not decoded then plays blank
+    /// this time round and is queued for the prefetcher.
     /// @return a PlaybackPtr reference counted pointer.
-    PlaybackPtr getPlayback(const size_t pos);
+    PlaybackPtr getPlayback(const size_t pos, const bool resolve = true);
+    /// \brief Check a slot without decoding it, wait free so the heads may call it.
+    /// @param[in] pos is the index of the slot.
+    /// @return false if the slot is lazily loaded and not decoded yet, it is then queued
+    /// for the prefetcher.
+    bool slotReady(const size_t pos);
     /// \brief Looks up a specified laser projection head and returns a ref. counted pointer to it.
     /// @param[in] pos is the number of the head to return.
     /// @return a reference counted pointer to a projection head.
     LaserHeadPtr getHead(const size_t pos);
-    /// \brief Starts a laser projection head in its own thread.
-    /// @param[in] pos is the head number to start.
+    /// @return the number of laser projection heads.
+    size_t headCount() const;
+    /// \brief Add or remove heads, removing from the end, and store the count.
+    /// @param[in] n is the number of heads wanted, at least one.
+    /// @return true on success, false on error.
+    bool setHeadCount(size_t n);
+    /// \brief Set and store the geometric output correction for a head.
+    /// @param[in] pos is the head number.
+    /// @param[in] p is the keystone, pincushion and mounting angle correction to use.
+    /// @return true on success, false on error.
+    bool setHeadWarp (const size_t pos, const WarpParams &p);
+    /// \brief Set and store the beam masking zones for a head.
+    /// @param[in] pos is the head number.
+    /// @param[in] p is the set of no scan zones to use.
     /// @return true on success, false on error.
-    bool startHead(const size_t pos);
+    bool setHeadMask (const size_t pos, const MaskParams &p);
     /// \brief Get the number of sources known to the engine.
     /// @return the number of framesources registered with the engine.
     size_t getSourcesSize() const;
+    /// \brief Get the whole sources table as it is now, it will not change under the caller.
+    /// Slots of a lazily loaded show that nobody has used yet are BinaryShowStub objects.
+    SourceTablePtr getSources() const;
     /// \brief Load a show (a set of frame sources), this starts the process but it really runs async in its own thread.
-    /// @param[in] filename is the name of the .lsf file to load.
+    /// @param[in] filename is the name of the .lsf or .lsb file to load, binary shows are recognised by their magic number.
     /// @param[in] clear is true if the old show is to be dumped, false if this should be added to the set of loaded frames.
+    /// Binary shows are loaded lazily unless Engine/Loading/Lazy is false, only the slot index is read
+    /// up front and each slot is decoded when it is first used.
+    /// The journal is restarted on top of the file, or when adding to the show, compacted once it is in.
     /// @return false on error, true on success.
     bool loadShow (QString filename, const bool clear = true);
     /// \brief Start saving a show.
-    /// @param[in] filename is the name of the file to save, it should probably end in .lsf.
+    /// The show is copied on the spot and written out in the background, the file is only
+    /// replaced once the new one is complete. showSaved is emitted if it all worked, and the
+    /// journal is rebased onto the file.
+    /// @param[in] filename is the name of the file to save, it should probably end in .lsf,
+    /// ending it in .lsb saves in the binary format (see binaryshow.h) instead.
     /// @return true on success, false on error.
     bool saveShow (QString filename);
     /// \brief Import one or more foregin files (ILDA or such).
+    /// The files are decoded in parallel but fill slots in the order given, importProgress
+    /// is emitted as each one is done.
     /// @param[in] filenames is a list of filenames to import.
     /// @param[in] index is the first location into which to store the resulting FrameSource (-1 means first enpty).
     /// @return true on sucess, false on failure.
     bool importShow (QStringList filenames, int index = -1);
+    /// \brief Replay the journal left by a session that did not exit cleanly, or start a new one.
+    /// The show the journal is based on is loaded, then the slot changes recorded since are
+    /// applied once it is in. Call this once the GUI is listening, before loading anything else.
+    /// @return true if there was a session to recover.
+    bool recoverJournal ();
 
     /// \brief Copies the frame souce in source to dest.
     /// source and dest are indicies into the sources table.
@@ -132,12 +189,16 @@ signals:
     void showSaved();
     /// show imported
     void showImported();
+    /// An import has dealt with done of its total files
+    void importProgress (int done, int total);
     /// Status message
     void message (QString text, int time);
     void setIndicator (unsigned int pos, QColor col);
     void manualTrigger();
     /// head Selection changed
     void headSelectionChanged (int);
+    /// Heads were added or removed
+    void headCountChanged (size_t);
     /// Head is projecting
     void headActive (int, bool);
     /// Output effect selected for editing
@@ -168,25 +229,62 @@ public slots:
 
 private slots:
     void Saved();
+    void Compacted();
+    /// \brief Write the whole show out in the background and rebase the journal on it.
+    void compactJournal();
     void Loaded();
     void Imported();
+    void fileImported(int done, int total, QString filename, bool ok);
     void selectionChangedData(unsigned int, bool);
 private:
-    /// Lock held while reading or writing the sources vector as this is prone to reallocation
-    /// and I am not sure if that is atomic.
-    QReadWriteLock source_lock;
-    std::vector <SourceImplPtr> sources;
-    /// The laser projection heads
-    HeadThread *heads[MAX_HEADS];
+    /// The frame sources. The table is never modified once published, writers take
+    /// source_write_lock, build a new one and swap it in, so readers (heads included) never
+    /// wait and always see a consistent table. The trees in it are not edited in place either,
+    /// the editor works on a clone and hands it back through addFrameSource, so a published
+    /// table is also what the savers use as their snapshot.
+    /// Only ever accessed through boost::atomic_load/atomic_store.
+    SourceTablePtr sources;
+    QMutex source_write_lock;
+    /// \brief Start loading a show, loadShow without the journal.
+    bool openShow (QString filename, const bool clear);
+    /// \brief Compact the journal if it has grown too big, from any thread.
+    void checkJournal ();
+    /// \brief Apply the recovered journal records in replay.
+    void applyReplay ();
+    /// Create a head with the settings for head number pos and start refilling it.
+    void addHead(const size_t pos);
+    /// Stop and remove the last head.
+    void removeHead();
+    /// The laser projection heads, head_lock is held while the vector changes.
+    mutable QReadWriteLock head_lock;
+    std::vector<LaserHeadPtr> heads;
+    /// Refills the heads on a pool of real time threads.
+    HeadScheduler *scheduler;
+    /// Blanks any head that stalls.
+    Watchdog *watchdog;
+    /// Decodes the slots around the ones in use when a show is lazily loaded.
+    SlotPrefetcher *prefetcher;
     /// File IO threads and associated locks
     ShowSaver *saver;
-    QtIOCompressor * saveCompressor;
     QMutex save_mutex;
-    QFile savef;
+    QString saveName;
+    JournalMark saveMark;
+    /// The autosave journal and the thread compacting it into autosaveName
+    ShowJournal *journal;
+    ShowSaver *compactor;
+    QMutex compact_mutex;
+    JournalMark compactMark;
+    QString autosaveName;
+    quint64 compactSize;
+    /// Slot changes to apply once the show a recovered journal is based on has loaded
+    std::vector<JournalRecord> replay;
+    /// Set while a show is being added to the current one rather than replacing it
+    bool mergeLoad;
     QMutex load_mutex;
     QFile loadf;
     ShowLoader *loader;
-    QtIOCompressor * loadCompressor;
+    /// Decompresses loadf for an xml show
+    QIODevice * loadDevice;
     QMutex import_mutex;
     ShowImporter *importer;
     int selected_head;
@@ -23,42 +23,112 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define ENGINE_IMPL
 
 #include <qthread.h>
+#include <QFuture>
+#include <vector>
 #include "engine.h"
 #include "head.h"
+#include "binaryshow.h"
 
 
 
 /// A Thread that saves the state of a show
+/// It works from the sources table as published when the save started, which is never modified
+/// and holds trees that are never edited in place, so nothing it touches can change under it.
+/// XML shows are serialised a Sequence at a time on the QtConcurrent pool and compressed with
+/// the codec named by Engine/Saving/Codec (see showcodec.h), binary shows (a .lsb suffix) are
+/// written straight out.
 class ShowSaver : public QThread
 {
     Q_OBJECT
 public:
-    ShowSaver (Engine* engine_, QXmlStreamWriter* w_);
+    ShowSaver (SourceTablePtr snapshot_, const QString filename_);
     ~ShowSaver();
     void run ();
+    /// @return true once the file is safely in place.
+    bool ok () const;
 signals:
     void saved();
 private:
-    QXmlStreamWriter * w;
-    Engine *e;
+    bool runBinary (QFile &f);
+    bool runXml (QFile &f);
+    /// \brief The real tree for a table entry, lazily loaded slots are decoded.
+    static SourceImplPtr resolved (SourceImplPtr p);
+    /// \brief One Sequence element, runs in the thread pool.
+    static QByteArray serialise (const size_t pos, SourceImplPtr p);
+    SourceTablePtr snapshot;
+    QString filename;
+    bool ok_;
+};
+
+/// \brief One Sequence element parsed by the show loader.
+class LoadedSequence
+{
+public:
+    LoadedSequence();
+    size_t index;
+    SourceImplPtr fs;
 };
 
 /// A thread that loads a show
+/// This only splits the decompressed document into its Sequence elements, they are
+/// independent so each is parsed (base64 and all) by QtConcurrent, and the results are
+/// handed to the engine in document order, which is position order.
 class ShowLoader : public QThread
 {
     Q_OBJECT
 public:
-    ShowLoader (Engine* engine_, QXmlStreamReader* r_);
+    ShowLoader (Engine* engine_, QIODevice* in_);
+    /// \brief Load a mapped binary show instead, this only builds the trees.
+    ShowLoader (Engine* engine_, BinaryShowFilePtr binary_);
     ~ShowLoader();
     void run ();
 signals:
     void saved();
 private:
-    QXmlStreamReader * r;
+    void runBinary ();
+    /// \brief Parse one complete Sequence element, runs in the thread pool.
+    static LoadedSequence parseSequence (const QByteArray chunk);
+    /// \brief Check the document header in front of the first Sequence.
+    static bool checkHeader (const QByteArray head);
+    /// \brief Hand finished sequences to the engine in order.
+    /// @param[in] all waits for everything outstanding, else only as much as needed to
+    /// keep the number of chunks in memory bounded.
+    void collect (const bool all);
+    QIODevice * in;
+    BinaryShowFilePtr binary;
+    Engine *e;
+    QList<QFuture<LoadedSequence> > pending;
+    std::vector<std::pair<size_t,SourceImplPtr> > batch;
+};
+
+/// A thread that decodes and faults in the slots of a lazily loaded show around the one last used.
+/// Only the most recent request matters, the user has moved on from anything older.
+class SlotPrefetcher : public QThread
+{
+    Q_OBJECT
+public:
+    SlotPrefetcher (Engine* engine_);
+    ~SlotPrefetcher();
+    void run ();
+    /// \brief Decode the slot at pos and warm those around it, replacing any request not yet done.
+    void request (const size_t pos);
+    void stop ();
+private:
+    /// \brief Decode and fault in one slot if it is still a stub.
+    void prefetch (const size_t pos);
     Engine *e;
+    QMutex lock;
+    QWaitCondition wake;
+    size_t centre;
+    bool pending;
+    bool stopping;
+    unsigned int distance;
 };
 
-/// A Thread that imports a foregin show file
+/// A Thread that imports foregin show files
+/// The files are decoded on the QtConcurrent pool, several at once, and big ones spread their
+/// frames over it too (see Ildaloader). They are still handed to the engine in the order given,
+/// so which slot each lands in does not depend on which finished first.
 class ShowImporter : public QThread
 {
     Q_OBJECT
@@ -68,8 +138,15 @@ public:
     void run ();
 signals:
     void imported();
+    /// Emitted as each file is handed to the engine, done counts from 1.
+    void fileImported (int done, int total, QString filename, bool ok);
 private:
+    /// \brief Load one file, runs in the thread pool.
+    static SourceImplPtr importFile (const QString filename);
+    /// \brief Give the engine the next file in order.
+    void add (SourceImplPtr fs);
     QStringList name;
+    int done;
     Engine *e;
     int idx;
 };
@@ -0,0 +1,282 @@
+/* etherdream_emulator.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "etherdream_emulator.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "log.h"
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+EtherDreamEmulator::EtherDreamEmulator(const unsigned int capacity, const unsigned int maxRate) : QThread()
+{
+    capacity_ = capacity;
+    maxRate_ = maxRate;
+    listenFd = -1;
+    port_.store(-1);
+    stopping.store(false);
+    fullness = 0.0;
+    lastTime = now();
+    received.store(0);
+    played.store(0);
+    underflowCount.store(0);
+}
+
+EtherDreamEmulator::~EtherDreamEmulator()
+{
+    stop();
+    wait();
+}
+
+void EtherDreamEmulator::stop()
+{
+    stopping.store(true);
+}
+
+unsigned short EtherDreamEmulator::port()
+{
+    while (port_.load() < 0) {
+        usleep(1000);
+    }
+    return (unsigned short) port_.load();
+}
+
+unsigned int EtherDreamEmulator::capacity() const
+{
+    return capacity_;
+}
+
+unsigned int EtherDreamEmulator::maxRate() const
+{
+    return maxRate_;
+}
+
+unsigned long EtherDreamEmulator::pointsReceived() const
+{
+    return received.load();
+}
+
+unsigned long EtherDreamEmulator::pointsPlayed() const
+{
+    return played.load();
+}
+
+unsigned long EtherDreamEmulator::underflows() const
+{
+    return underflowCount.load();
+}
+
+void EtherDreamEmulator::run()
+{
+    listenFd = socket(AF_INET,SOCK_STREAM,0);
+    sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0; // Let the kernel pick so several emulators can run at once
+    socklen_t len = sizeof(addr);
+    if ((listenFd < 0) || bind(listenFd,(sockaddr *)&addr,sizeof(addr)) ||
+            listen(listenFd,1) || getsockname(listenFd,(sockaddr *)&addr,&len)) {
+        slog()->errorStream() << "Ether Dream emulator could not listen : " << strerror(errno);
+        if (listenFd >= 0) {
+            close(listenFd);
+        }
+        port_.store(0);
+        return;
+    }
+    port_.store(ntohs(addr.sin_port));
+    slog()->infoStream() << "Ether Dream emulator listening on 127.0.0.1:" << ntohs(addr.sin_port);
+    while (!stopping.load()) {
+        pollfd pfd;
+        pfd.fd = listenFd;
+        pfd.events = POLLIN;
+        if (poll(&pfd,1,100) <= 0) {
+            continue;
+        }
+        int fd = accept(listenFd,NULL,NULL);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+        // A new connection sees an idle DAC, just as after a power cycle
+        status = EtherDreamStatus();
+        fullness = 0.0;
+        lastTime = now();
+        serve(fd);
+        close(fd);
+    }
+    close(listenFd);
+    listenFd = -1;
+}
+
+void EtherDreamEmulator::advance()
+{
+    const double t = now();
+    const double elapsed = t - lastTime;
+    lastTime = t;
+    if (status.playbackState != ED_PLAYBACK_PLAYING) {
+        return;
+    }
+    double n = elapsed * status.pointRate;
+    if (n >= fullness) {
+        // Ran dry, the hardware drops back to idle and flags it
+        n = fullness;
+        status.playbackState = ED_PLAYBACK_IDLE;
+        status.playbackFlags |= ED_PLAYBACK_FLAG_UNDERFLOW;
+        underflowCount.fetch_add(1);
+    }
+    const unsigned long before = (unsigned long) (fullness);
+    fullness -= n;
+    const unsigned long done = before - (unsigned long) (fullness);
+    played.fetch_add(done);
+    status.pointCount += done;
+    status.bufferFullness = (unsigned short) (fullness + 0.999);
+}
+
+bool EtherDreamEmulator::respond(int fd, const char response, const char cmd)
+{
+    unsigned char buf[ED_RESPONSE_SZ];
+    buf[0] = response;
+    buf[1] = cmd;
+    status.pack(buf + 2);
+    return edSendAll(fd,buf,ED_RESPONSE_SZ);
+}
+
+void EtherDreamEmulator::serve(int fd)
+{
+    // The DAC sends a status response as soon as the connection is made
+    if (!respond(fd,ED_ACK,ED_CMD_PING)) {
+        return;
+    }
+    std::vector<unsigned char> points;
+    while (!stopping.load()) {
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        const int r = poll(&pfd,1,10);
+        advance();
+        if (r < 0) {
+            return;
+        }
+        if (r == 0) {
+            continue;
+        }
+        unsigned char cmd;
+        if (!edRecvAll(fd,&cmd,1,1000)) {
+            return;
+        }
+        char resp = ED_ACK;
+        unsigned char arg[6];
+        switch ((char) cmd) {
+        case ED_CMD_PING:
+            break;
+        case ED_CMD_PREPARE:
+            if ((status.playbackState != ED_PLAYBACK_IDLE) || (status.lightEngineState == ED_LIGHT_ESTOP)) {
+                resp = ED_NAK_INVALID;
+            } else {
+                status.playbackState = ED_PLAYBACK_PREPARED;
+                status.playbackFlags = 0;
+                fullness = 0.0;
+                status.bufferFullness = 0;
+            }
+            break;
+        case ED_CMD_BEGIN:
+            if (!edRecvAll(fd,arg,6,1000)) {
+                return;
+            }
+            if (status.playbackState != ED_PLAYBACK_PREPARED) {
+                resp = ED_NAK_INVALID;
+            } else {
+                const unsigned int rate = edGet32(arg + 2);
+                status.pointRate = (rate > maxRate_) ? maxRate_ : rate;
+                status.playbackState = ED_PLAYBACK_PLAYING;
+                lastTime = now();
+            }
+            break;
+        case ED_CMD_RATE:
+            if (!edRecvAll(fd,arg,4,1000)) {
+                return;
+            }
+            // Rate changes take effect straight away here, rather then on a flagged point.
+            status.pointRate = edGet32(arg);
+            if (status.pointRate > maxRate_) {
+                status.pointRate = maxRate_;
+            }
+            break;
+        case ED_CMD_DATA: {
+            if (!edRecvAll(fd,arg,2,1000)) {
+                return;
+            }
+            const unsigned int n = edGet16(arg);
+            points.resize(n * ED_POINT_SZ + 1);
+            if (n && !edRecvAll(fd,&points[0],n * ED_POINT_SZ,1000)) {
+                return;
+            }
+            if ((status.playbackState == ED_PLAYBACK_IDLE) || (status.lightEngineState == ED_LIGHT_ESTOP)) {
+                resp = ED_NAK_INVALID;
+            } else if (fullness + n > capacity_) {
+                resp = ED_NAK_FULL;
+            } else {
+                fullness += n;
+                status.bufferFullness = (unsigned short) (fullness + 0.999);
+                received.fetch_add(n);
+            }
+            break;
+        }
+        case ED_CMD_STOP:
+            if (status.playbackState == ED_PLAYBACK_IDLE) {
+                resp = ED_NAK_INVALID;
+            }
+            status.playbackState = ED_PLAYBACK_IDLE;
+            fullness = 0.0;
+            status.bufferFullness = 0;
+            break;
+        case ED_CMD_ESTOP:
+            status.lightEngineState = ED_LIGHT_ESTOP;
+            status.playbackState = ED_PLAYBACK_IDLE;
+            fullness = 0.0;
+            status.bufferFullness = 0;
+            break;
+        case ED_CMD_CLEAR_ESTOP:
+            status.lightEngineState = ED_LIGHT_READY;
+            break;
+        default:
+            // Unknown command, we cannot know how long it is so drop the connection
+            slog()->errorStream() << "Ether Dream emulator got unknown command " << (int) cmd;
+            respond(fd,ED_NAK_INVALID,cmd);
+            return;
+        }
+        if (!respond(fd,resp,cmd)) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,66 @@
+/* etherdream_emulator.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ETHERDREAM_EMULATOR_INCL
+#define ETHERDREAM_EMULATOR_INCL
+
+#include <QtCore>
+#include <boost/atomic.hpp>
+#include "driver_etherdream.h"
+
+/// \brief A software Ether Dream listening on the loopback interface.
+/// It speaks the TCP command protocol and plays its buffer out against the clock just
+/// as the hardware does, underflowing back to idle if it runs dry, so the network
+/// driver can be run and measured without a DAC on the bench.
+class EtherDreamEmulator : public QThread
+{
+    Q_OBJECT
+public:
+    EtherDreamEmulator (const unsigned int capacity = ED_DEFAULT_CAPACITY, const unsigned int maxRate = 100000);
+    ~EtherDreamEmulator();
+    void run();
+    void stop();
+    /// \brief Wait for the listening socket.
+    /// @return the TCP port on 127.0.0.1, or 0 if the emulator failed to start.
+    unsigned short port ();
+    unsigned int capacity () const;
+    unsigned int maxRate () const;
+    /// Statistics, safe from any thread.
+    unsigned long pointsReceived () const;
+    unsigned long pointsPlayed () const;
+    unsigned long underflows () const;
+private:
+    void serve (int fd);
+    /// \brief Play out the buffer up to now.
+    void advance ();
+    bool respond (int fd, const char response, const char cmd);
+    unsigned int capacity_;
+    unsigned int maxRate_;
+    int listenFd;
+    boost::atomic<int> port_;
+    boost::atomic<bool> stopping;
+    EtherDreamStatus status;
+    /// Buffer level in points including the fractional point in progress.
+    double fullness;
+    double lastTime;
+    boost::atomic<unsigned long> received;
+    boost::atomic<unsigned long> played;
+    boost::atomic<unsigned long> underflowCount;
+};
+
+#endif
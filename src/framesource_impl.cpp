@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "framesource_impl.h"
 #include "log.h"
+#include "binaryshow.h"
 
 // The generator mapping
 static std::map <std::string, SourceImplPtr (*)()> *framegen = NULL;
@@ -175,6 +176,63 @@ SourceImplPtr FrameSource_impl::loadFrames(QXmlStreamReader* e)
     return fs;
 }
 
+void FrameSource_impl::saveFrames(BinaryShowWriter* w)
+{
+    assert (w);
+    w->writeNode(name,description,numChildren());
+    saveBinary(w);
+    for (unsigned int i=0; i < numChildren(); i++) {
+        child(i)->saveFrames(w);
+    }
+}
+
+SourceImplPtr FrameSource_impl::loadFrames(BinaryShowReader* r)
+{
+    assert (r);
+    SourceImplPtr fs;
+    if (!r->readNode()) {
+        return fs;
+    }
+    // Read before the children move the cursor on
+    const std::string oname = r->name();
+    const unsigned int nc = r->children();
+    fs = FrameSource_impl::newSource(oname);
+    if (fs) {
+        fs->setDescription(r->description());
+        fs->loadBinary(r);
+    } else {
+        slog()->error(std::string("Attempt to load unknown object type : ")+oname);
+    }
+    // Children of an unknown node still have to be stepped over
+    for (unsigned int i=0; i < nc; i++) {
+        SourceImplPtr c = loadFrames(r);
+        if (r->hasError()) {
+            return SourceImplPtr();
+        }
+        if (fs && c) {
+            fs->addChild(c);
+        }
+    }
+    return fs;
+}
+
+void FrameSource_impl::saveBinary(BinaryShowWriter* w)
+{
+    QByteArray b;
+    QXmlStreamWriter x(&b);
+    x.writeStartElement(QString().fromStdString(name));
+    save(&x);
+    x.writeEndElement();
+    w->writeParams(b);
+}
+
+void FrameSource_impl::loadBinary(BinaryShowReader* r)
+{
+    QXmlStreamReader x(r->params());
+    x.readNextStartElement();
+    load(&x);
+}
+
 void FrameSource_impl::registerFrameGen (const std::string name, SourceImplPtr (*generator)())
 {
     assert (generator);
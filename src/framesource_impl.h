@@ -30,6 +30,8 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 class FrameSource_impl;
 class Playback_impl;
 class FrameGui;
+class BinaryShowWriter;
+class BinaryShowReader;
 
 typedef boost::shared_ptr<FrameSource_impl> SourceImplPtr;
 typedef boost::shared_ptr<Playback_impl> PlaybackImplPtr;
@@ -101,6 +103,9 @@ public:
     /// File IO
     static SourceImplPtr loadFrames (QXmlStreamReader* e);
     void saveFrames(QXmlStreamWriter* w);
+    /// Binary show file IO, see binaryshow.h.
+    static SourceImplPtr loadFrames (BinaryShowReader* r);
+    void saveFrames(BinaryShowWriter* w);
     /// IO to and from strings
     std::string toString();
     static SourceImplPtr fromString(const std::string s);
@@ -130,6 +135,11 @@ public:
 protected:
     virtual void save (QXmlStreamWriter *w) = 0;
     virtual void load (QXmlStreamReader *r) = 0;
+    /// Binary show file support, by default the parameter block is the start tag and
+    /// attributes written by save() and read back with load().
+    /// Reimplement these if the node has bulk data that should be mapped rather than parsed.
+    virtual void saveBinary (BinaryShowWriter *w);
+    virtual void loadBinary (BinaryShowReader *r);
 
 private:
     FrameSource_impl();
@@ -0,0 +1,159 @@
+/* gzipwriter.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "gzipwriter.h"
+
+#include <string.h>
+#include <zlib.h>
+#include <QtConcurrentRun>
+#include "log.h"
+
+/// Deflate's window, the most of the previous chunk that can help the next.
+#define GZIP_DICT (32768)
+
+GzipChunk::GzipChunk()
+{
+    crc = 0;
+    length = 0;
+    ok = false;
+}
+
+ParallelGzipWriter::ParallelGzipWriter(QIODevice* out_, const int level_, const int chunkSize_)
+{
+    out = out_;
+    level = level_;
+    chunkSize = (chunkSize_ > GZIP_DICT) ? chunkSize_ : GZIP_DICT;
+    crc = crc32(0,NULL,0);
+    length = 0;
+    error = false;
+    // Gzip header, deflate, no flags, no time stamp, unix
+    static const char header[10] = {0x1f,(char)0x8b,8,0,0,0,0,0,0,3};
+    put(QByteArray(header,10));
+}
+
+ParallelGzipWriter::~ParallelGzipWriter()
+{
+    // Nothing may still be running against our buffers
+    for (int i = 0; i < pending.size(); i++) {
+        pending[i].waitForFinished();
+    }
+}
+
+QString ParallelGzipWriter::errorString() const
+{
+    return errorString_;
+}
+
+GzipChunk ParallelGzipWriter::compress(const QByteArray in, const QByteArray dict, const int level, const bool last)
+{
+    GzipChunk c;
+    z_stream s;
+    memset(&s,0,sizeof(s));
+    if (deflateInit2(&s,level,Z_DEFLATED,-MAX_WBITS,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+        return c;
+    }
+    if (!dict.isEmpty()) {
+        deflateSetDictionary(&s,(const Bytef *)dict.constData(),dict.size());
+    }
+    // The bound is for Z_FINISH, leave room for the sync flush marker too
+    c.data.resize(deflateBound(&s,in.size()) + 64);
+    s.next_in = (Bytef *) in.constData();
+    s.avail_in = in.size();
+    size_t used = 0;
+    const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+    while (true) {
+        s.next_out = (Bytef *) c.data.data() + used;
+        s.avail_out = c.data.size() - used;
+        const int ret = deflate(&s,flush);
+        used = c.data.size() - s.avail_out;
+        if (ret == Z_STREAM_ERROR) {
+            deflateEnd(&s);
+            return c;
+        }
+        if (last ? (ret == Z_STREAM_END) : (s.avail_out != 0)) {
+            break;
+        }
+        c.data.resize(c.data.size() * 2);
+    }
+    deflateEnd(&s);
+    c.data.resize(used);
+    c.crc = crc32(crc32(0,NULL,0),(const Bytef *) in.constData(),in.size());
+    c.length = in.size();
+    c.ok = true;
+    return c;
+}
+
+void ParallelGzipWriter::put(const QByteArray data)
+{
+    if (error) {
+        return;
+    }
+    if (out->write(data) != data.size()) {
+        error = true;
+        errorString_ = out->errorString();
+        slog()->errorStream() << "Compressed write failed : " << errorString_.toStdString();
+    }
+}
+
+void ParallelGzipWriter::dispatch(const QByteArray chunk, const bool last)
+{
+    pending.append(QtConcurrent::run(&ParallelGzipWriter::compress,chunk,dict,level,last));
+    dict = chunk.right(GZIP_DICT);
+}
+
+void ParallelGzipWriter::drain(const bool all)
+{
+    const int inflight = 2 * QThread::idealThreadCount();
+    while (!pending.isEmpty() && (all || (pending.size() > inflight) || pending.first().isFinished())) {
+        const GzipChunk c = pending.takeFirst().result();
+        if (!c.ok) {
+            error = true;
+            errorString_ = "deflate failed";
+            slog()->errorStream() << "Compression failed";
+        }
+        put(c.data);
+        crc = crc32_combine(crc,c.crc,c.length);
+        length += c.length;
+    }
+}
+
+bool ParallelGzipWriter::write(const QByteArray data)
+{
+    buffer.append(data);
+    while (buffer.size() >= chunkSize) {
+        dispatch(buffer.left(chunkSize),false);
+        buffer.remove(0,chunkSize);
+        drain(false);
+    }
+    return !error;
+}
+
+bool ParallelGzipWriter::finish()
+{
+    dispatch(buffer,true);
+    buffer.clear();
+    drain(true);
+    // Trailer, CRC and length modulo 2^32, little endian
+    char trailer[8];
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (crc >> (8 * i)) & 0xff;
+        trailer[i + 4] = (length >> (8 * i)) & 0xff;
+    }
+    put(QByteArray(trailer,8));
+    return !error;
+}
@@ -0,0 +1,77 @@
+/* gzipwriter.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef GZIPWRITER_INCL
+#define GZIPWRITER_INCL
+
+#include <QtCore>
+#include <QFuture>
+
+/// \brief One compressed piece of the stream.
+class GzipChunk
+{
+public:
+    GzipChunk();
+    QByteArray data;
+    quint32 crc;
+    quint32 length;
+    bool ok;
+};
+
+/// \brief Gzip compression spread over the QtConcurrent thread pool, the way pigz does it.
+
+/// The input is cut into fixed size chunks that are deflated independently, each primed
+/// with the last 32K of the chunk before so the ratio hardly suffers. Every chunk but the
+/// last ends on a sync flush, which leaves it byte aligned with no final block, so the raw
+/// outputs simply concatenate into one deflate stream. The CRCs are joined with
+/// crc32_combine, and the result is a single ordinary gzip member that any reader
+/// (QtIOCompressor included) can inflate.
+class ParallelGzipWriter
+{
+public:
+    /// @param[in] out is where the compressed stream goes, it must already be open.
+    /// @param[in] level is the zlib compression level.
+    /// @param[in] chunkSize is the number of input bytes per pool task.
+    ParallelGzipWriter (QIODevice *out, const int level = 6, const int chunkSize = 256 * 1024);
+    ~ParallelGzipWriter ();
+    /// \brief Queue data, each chunk is handed to the pool as it fills.
+    /// @return false once a write has failed.
+    bool write (const QByteArray data);
+    /// \brief Compress whatever is left and write the trailer.
+    /// @return false if anything failed.
+    bool finish ();
+    QString errorString () const;
+private:
+    static GzipChunk compress (const QByteArray in, const QByteArray dict, const int level, const bool last);
+    void dispatch (const QByteArray chunk, const bool last);
+    /// \brief Write out finished chunks in order, all waits for every one.
+    void drain (const bool all);
+    void put (const QByteArray data);
+    QIODevice *out;
+    int level;
+    int chunkSize;
+    QByteArray buffer;
+    QByteArray dict;
+    QList<QFuture<GzipChunk> > pending;
+    quint32 crc;
+    quint32 length;
+    bool error;
+    QString errorString_;
+};
+
+#endif
@@ -19,52 +19,27 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "head.h"
 #include "engine.h"
 #include "log.h"
-// Unix specific threads stuff (hard RT, things of that nature)
-#if __unix
-#include <unistd.h>
-#include <pthread.h>
-#include <sys/types.h>
-#endif
+#include <string.h>
+#include <time.h>
 
-HeadThread::HeadThread(Engine * e)
-{
-    engine = e;
-}
-
-HeadThread::~HeadThread()
-{
-}
-
-void HeadThread::run()
-{
-    slog()->debugStream() << "Starting laserhead thread " << std::hex << currentThreadId();
-    /// TODO - Come up with a way to put things into windows soft RT scheduling class
-#if __unix
-    pthread_t tid = pthread_self();
-    slog()->infoStream() << "Started laserhead thread ";
-    struct sched_param sp;
-    sp.sched_priority = 20;
-    int err;
-    err = pthread_setschedparam(tid,SCHED_FIFO,&sp);
-    if (err) {
-        slog()->errorStream() <<"Failed to set RT scheduling for laserhead control thread :" << strerror(err);
-    } else {
-        slog()->infoStream() <<"Set posix RT scheduling for projection thread";
-    }
-#endif
-    head = boost::make_shared<LaserHead>(engine);
-    exec();
-}
-
-
-LaserHead::LaserHead(Engine* e)
+LaserHead::LaserHead(Engine* e) : headLock(QMutex::Recursive)
 {
     engine = e;
     targetPPS = 12000;
     frame_index = 0;
     resampler.setInputPPS(targetPPS);
     resampler.setOutputPPS(30000);
-    killed = false;
+    killed.store(false);
+    latency.load("Engine/Latency");
+    lastRefill = 0.0;
+    lastSleepUs = 0;
+    lastOccupancy = 0;
+    lastUnderruns = 0;
+    progress_.store(0);
+    deadline_.store(0);
+    idle = true;
+    waitSlot = -1;
+    memset(&lastPoint,0,sizeof(lastPoint));
     connect (&sources,SIGNAL(selectionChanged(uint,bool)),this,SLOT(selectionChangedData(uint,bool)));
     connect (&sources,SIGNAL(dumpCurrentSelection()),this,SLOT(dump()));
     connect (&(*engine),SIGNAL(manualTrigger()),this,SLOT(manual()));
@@ -76,12 +51,14 @@ LaserHead::~LaserHead()
 
 void LaserHead::HWPpsChanged(unsigned int newPPS)
 {
+    QMutexLocker l(&headLock);
     resampler.setOutputPPS(newPPS);
 }
 
 
 bool LaserHead::setPPS(unsigned int pps)
 {
+    QMutexLocker l(&headLock);
     targetPPS = pps;
     resampler.setInputPPS(pps);
     return true;
@@ -90,9 +67,14 @@ bool LaserHead::setPPS(unsigned int pps)
 bool LaserHead::setDriver(DriverPtr d)
 {
     if (d && (d->flags() & Driver::OUTPUTS_ILDA)) {
-        driver = d;
+        QMutexLocker l(&headLock);
+        // Not watched until the first refill with the new driver
+        deadline_.store(0);
+        {
+            QMutexLocker dl(&driverLock);
+            driver = d;
+        }
         resampler.setOutputPPS(driver->ILDAHwPointsPerSecond());
-        connect (&(*driver),SIGNAL(ILDARequestMoreData()),this,SLOT(dataRequested()));
         connect (&(*driver),SIGNAL(ILDAHwPPSChanged(uint)),this, SLOT(HWPpsChanged(uint)));
         return true;
     } else {
@@ -106,59 +88,220 @@ bool LaserHead::setDriver(std::string name)
     return setDriver(d);
 }
 
-void LaserHead::dataRequested()
+bool LaserHead::realTime() const
 {
-    if (driver) {
-        while (driver->ILDABufferFillStatus() > 300) {
-            size_t t = driver->ILDANewPoints(pointBuf, frame_index);
-            frame_index +=t;
-            if (frame_index >= pointBuf.size()) {
-                pointBuf.clear();
-                frame_index = 0;
-                FramePtr fp;
-                if (pb) {
-                    fp = pb->nextFrame();
-                }
-                if (!fp) {
-                    PlaybackPtr p;
-                    int s;
-                    s = sources.getNextFramesource();
-                    if (s > -1) {
-                        assert (engine);
-                        p = engine->getPlayback(s);
-                        p->reset();
-                    }
-                    loadFrameSource(p,false);
-                    emit endOfSource();
-                    if (pb) {
-                        fp = pb->nextFrame();
-                    }
-                }
-                emit newFrame(fp);
-                if (fp) {
-                    std::vector<Point> p;
-                    p.reserve(fp->getPointCount());
-                    for (unsigned int i=0; i < fp->getPointCount(); i++) {
-                        p.push_back(fp->getPoint(i));
-                    }
-                    pointBuf = resampler.run(p);
-                }
-                if (!pb) {
-                    break;
+    DriverPtr d = getDriver();
+    return !d || d->ILDARealTime();
+}
+
+double LaserHead::latencyMs() const
+{
+    return latency.latencyMs();
+}
+
+unsigned long LaserHead::progress() const
+{
+    return progress_.load();
+}
+
+double LaserHead::deadline() const
+{
+    return deadline_.load() * 1e-9;
+}
+
+unsigned long LaserHead::refill()
+{
+    QMutexLocker l(&headLock);
+    progress_.fetch_add(1);
+    if (killed.load() && pb) {
+        loadFrameSource(PlaybackPtr(),true);
+    }
+    if (!driver) {
+        lastRefill = 0.0;
+        deadline_.store(0);
+        return HEAD_MAX_SLEEP_US;
+    }
+    const unsigned int pps = driver->ILDAHwPointsPerSecond();
+    if (!pps) {
+        lastRefill = 0.0;
+        deadline_.store(0);
+        return HEAD_MAX_SLEEP_US;
+    }
+    const bool rt = driver->ILDARealTime();
+    size_t occupancy = driver->ILDABufferOccupancy();
+    const size_t capacity = occupancy + driver->ILDABufferFillStatus();
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    const double now = ts.tv_sec + ts.tv_nsec * 1e-9;
+    if (rt) {
+        if (lastRefill > 0.0) {
+            // How long after we asked to run we actually did, plus anything the driver took
+            // over the nominal rate in the meantime (it drains a period at a time).
+            const double elapsed = now - lastRefill;
+            double late = elapsed * 1e6 - lastSleepUs;
+            const double expected = (double) lastOccupancy - elapsed * pps;
+            if (expected > occupancy) {
+                late += (expected - occupancy) * 1e6 / pps;
+            }
+            latency.sample(late);
+        }
+        const unsigned long u = driver->ILDAUnderruns();
+        if ((u != lastUnderruns) && (lastRefill > 0.0)) {
+            latency.underrun();
+        }
+        lastUnderruns = u;
+        latency.update(now);
+    }
+    size_t target = (size_t)(pps * latency.latencyMs() / 1000.0);
+    // However low the latency is set we must cover at least one hardware period and a bit
+    const size_t period = driver->ILDAHwPeriod();
+    if (target < period * 3 / 2) {
+        target = period * 3 / 2;
+    }
+    if ((target > capacity * 3 / 4) || !rt) {
+        target = capacity * 3 / 4;
+    }
+    const size_t start = occupancy;
+    while (occupancy < target) {
+        if ((frame_index >= pointBuf.size()) && !mask.pending()) {
+            if (!nextFrame()) {
+                if (!rt) {
+                    // Rendering offline, idle time is not worth writing out
+                    lastRefill = 0.0;
+                    deadline_.store(0);
+                    return HEAD_MAX_SLEEP_US;
                 }
+                // Nothing to play, keep the ring fed with blanked points where the beam is parked
+                PointF b = lastPoint;
+                b.r = b.g = b.b = 0.0f;
+                pointBuf.assign(target - occupancy,b);
+                frame_index = 0;
             }
         }
+        // The mask is the last stage, it writes straight into the drivers own buffer
+        PointF *region;
+        const size_t space = driver->ILDAReserve(&region,target - occupancy);
+        if (!space) {
+            break;
+        }
+        const size_t t = mask.run(pointBuf.empty() ? NULL : &pointBuf[0],frame_index,pointBuf.size(),region,space);
+        driver->ILDACommit(t);
+        if (!t) {
+            break;
+        }
+        occupancy += t;
+    }
+    if (!rt) {
+        // Go straight round again unless the consumer has fallen behind
+        lastRefill = 0.0;
+        deadline_.store(0);
+        return (occupancy > start) ? 0 : HEAD_MIN_SLEEP_US;
     }
+    // Sleep until the driver will have eaten half the target
+    occupancy = driver->ILDABufferOccupancy();
+    const size_t lowWater = target / 2;
+    unsigned long us = 0;
+    if (occupancy > lowWater) {
+        us = (unsigned long)((unsigned long long)(occupancy - lowWater) * 1000000ULL / pps);
+    }
+    // Remember what the head thread will actually do so the next pass can tell how late it was
+    lastRefill = now;
+    lastOccupancy = occupancy;
+    // The ring runs dry at this point unless we are back in time, the watchdog holds us to it
+    deadline_.store((unsigned long long)((now + (double) occupancy / pps) * 1e9));
+    lastSleepUs = (us < HEAD_MIN_SLEEP_US) ? HEAD_MIN_SLEEP_US : ((us > HEAD_MAX_SLEEP_US) ? HEAD_MAX_SLEEP_US : us);
+    return us;
+}
+
+bool LaserHead::nextFrame()
+{
+    pointBuf.clear();
+    frame_index = 0;
+    FramePtr fp;
+    if (pb) {
+        fp = pb->nextFrame();
+    }
+    if (!fp) {
+        PlaybackPtr p;
+        int s;
+        if ((waitSlot > -1) && sources.isSelected(waitSlot)) {
+            // Stepping on now would skip the cue, in ONCE mode it would even be deselected
+            s = waitSlot;
+        } else {
+            s = sources.getNextFramesource();
+        }
+        waitSlot = -1;
+        if (s > -1) {
+            assert (engine);
+            if (engine->slotReady(s)) {
+                p = engine->getPlayback(s,false);
+                p->reset();
+            } else {
+                waitSlot = s;
+            }
+        }
+        if (p || !idle) {
+            loadFrameSource(p,false);
+            emit endOfSource();
+        }
+        if (pb) {
+            fp = pb->nextFrame();
+        }
+    }
+    if (fp || !idle) {
+        emit newFrame(fp);
+    }
+    idle = !fp;
+    if (fp) {
+        std::vector<Point> p;
+        p.reserve(fp->getPointCount());
+        for (unsigned int i=0; i < fp->getPointCount(); i++) {
+            p.push_back(fp->getPoint(i));
+        }
+        resampler.run(p,pointBuf);
+        warp.run(pointBuf);
+        if (!pointBuf.empty()) {
+            lastPoint = pointBuf.back();
+        }
+    }
+    return !pointBuf.empty();
+}
+
+void LaserHead::setWarp(const WarpParams& p)
+{
+    warp.setParams(p);
+}
+
+WarpParams LaserHead::getWarp() const
+{
+    return warp.getParams();
+}
+
+void LaserHead::setMask(const MaskParams& p)
+{
+    mask.setParams(p);
+}
+
+MaskParams LaserHead::getMask() const
+{
+    return mask.getParams();
+}
+
+unsigned long LaserHead::maskZoneHits(const unsigned int zone) const
+{
+    return mask.zoneHits(zone);
 }
 
 void LaserHead::dump()
 {
+    QMutexLocker l(&headLock);
     loadFrameSource(PlaybackPtr(),true);
 }
 
 bool LaserHead::loadFrameSource(PlaybackPtr f, bool immediate)
 {
-    if (!killed) {
+    QMutexLocker l(&headLock);
+    if (!killed.load()) {
         pb = f;
     } else {
         pb = PlaybackPtr();
@@ -166,6 +309,7 @@ bool LaserHead::loadFrameSource(PlaybackPtr f, bool immediate)
     if (immediate) {
         frame_index = 0;
         pointBuf.clear();
+        waitSlot = -1;
     }
     if (pb || (pointBuf.size() > 0)) {
         emit headActive();
@@ -178,6 +322,7 @@ bool LaserHead::loadFrameSource(PlaybackPtr f, bool immediate)
 
 DriverPtr LaserHead::getDriver() const
 {
+    QMutexLocker l(&driverLock);
     return driver;
 }
 
@@ -193,23 +338,27 @@ QStringList LaserHead::enumerateStepModes() const
 
 void LaserHead::select(unsigned int pos, bool active)
 {
+    QMutexLocker l(&headLock);
     sources.select(pos,active);
 }
 
 void LaserHead::setSelectionMode(const PlaybackList::SelectionModes mode)
 {
+    QMutexLocker l(&headLock);
     sources.setSelectionMode(mode);
     emit selectionModeChanged (mode);
 }
 
 void LaserHead::setStepMode(const PlaybackList::StepModes mode)
 {
+    QMutexLocker l(&headLock);
     sources.setStepMode(mode);
     emit stepModeChanged(mode);
 }
 
 bool LaserHead::isSelected(const int pos)
 {
+    QMutexLocker l(&headLock);
     return sources.isSelected (pos);
 }
 
@@ -220,21 +369,23 @@ void LaserHead::selectionChangedData (unsigned int sel, bool active)
 
 void LaserHead::manual()
 {
+    QMutexLocker l(&headLock);
     sources.manualStepClicked();
 }
 
 void LaserHead::beat()
 {
+    QMutexLocker l(&headLock);
     sources.beatDetected();
 }
 
 void LaserHead::kill()
 {
-    killed = true;
-    loadFrameSource(PlaybackPtr(),true);
+    // The next refill drops the playback, the drivers are blanked meanwhile
+    killed.store(true);
 }
 
 void LaserHead::restart()
 {
-    killed = false;
+    killed.store(false);
 }
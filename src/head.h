@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <QtCore>
 #include <vector>
 #include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
 #include "driver.h"
 #include "colour.h"
 #include "framesource.h"
@@ -31,6 +32,9 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "colour.h"
 #include "point.h"
 #include "playbacklist.h"
+#include "outputwarp.h"
+#include "outputmask.h"
+#include "latencycontroller.h"
 
 // This needs to be forward declared to make LaserheadPtr available when engine.h
 // includes this file
@@ -38,29 +42,16 @@ class LaserHead;
 typedef boost::shared_ptr<LaserHead> LaserHeadPtr;
 #include "engine.h"
 
-/// \brief A tiny little shim to put each laser head into its own thread.
-/// With essentially all modern CPUs being multicore this does much to
-/// optimise performance.
-/// HeadThread->start must be called to actually start any head running
-class HeadThread : public QThread
-{
-    Q_OBJECT
-public:
-    HeadThread(Engine * e);
-    virtual ~HeadThread();
-    /// \pre this method MUST be called before attempting to use the head for anything.
-    /// Further thre may be a delay afet calling run before the head actually becomes available.
-    /// head becoming non NULL should be taken as indicating that this head is ready.
-    void run();
-    LaserHeadPtr head;
-private:
-    Engine * engine;
-};
-
+/// Longest a head will go between refills.
+#define HEAD_MAX_SLEEP_US (2000)
+/// Shortest sleep, stops the refill loop spinning if a driver stops draining.
+#define HEAD_MIN_SLEEP_US (100)
 
 /// A Laser projection head. 
 /// This object is responsible for actually projecting framesoure trees, 
 /// requesting new ones from the engine as needed.
+/// The head lives in the engine thread, which runs its slots, while refill is called from
+/// whichever HeadScheduler worker is free, so everything refill touches is under headLock.
 class LaserHead : public QObject
 {
     Q_OBJECT
@@ -73,6 +64,29 @@ public:
     /// returns a list of the step modes this head supports
     QStringList enumerateStepModes() const;
     bool isSelected (const int pos);
+    /// \brief Top up the driver point ring to the target latency.
+    /// Called by the head scheduler, never from more then one thread at once.
+    /// @return the number of microseconds until the ring will have drained to its low water mark,
+    /// 0 for a non realtime driver that should be refilled again straight away.
+    unsigned long refill();
+    /// \brief False if the driver is not paced by real time output (a file sink).
+    bool realTime () const;
+    /// @return the current adaptive buffer target in milliseconds, safe from any thread.
+    double latencyMs () const;
+    /// @return the number of refills so far, safe from any thread.
+    unsigned long progress () const;
+    /// @return the monotonic time in seconds by which the next refill must happen before the
+    /// driver runs dry, 0 if there is no real time deadline. Safe from any thread.
+    double deadline () const;
+    /// \brief Set the geometric output correction for this head.
+    /// Safe to call from any thread, the grid is built by the caller and swapped in atomically.
+    void setWarp (const WarpParams &p);
+    WarpParams getWarp () const;
+    /// \brief Set the beam masking zones for this head, safe to call from any thread.
+    void setMask (const MaskParams &p);
+    MaskParams getMask () const;
+    /// @return the number of lit points blanked by a masking zone.
+    unsigned long maskZoneHits (const unsigned int zone) const;
 signals:
     /// Emitted when the frame source runs out of frames.
     void endOfSource();
@@ -97,7 +111,7 @@ public slots:
     void setSelectionMode (const PlaybackList::SelectionModes mode);
     /// Set the step modes
     void setStepMode (const PlaybackList::StepModes mode);
-    /// Kill the output
+    /// Kill the output, this never blocks so is safe whatever state the head is in.
     void kill();
     void restart();
 private:
@@ -111,11 +125,38 @@ private:
     size_t frame_index;
     Resample resampler;
     ColourTrimmer colourTrim[3];
+    OutputWarp warp;
+    OutputMask mask;
     PlaybackList sources;
-    bool killed;
+    /// Held by refill and by anything else that touches the playback state, it is recursive
+    /// as signals emitted under it may come straight back in.
+    mutable QMutex headLock;
+    /// Guards just the driver pointer so getDriver never waits on a refill.
+    mutable QMutex driverLock;
+    boost::atomic<bool> killed;
+    /// Picks the driver buffer depth from the measured refill jitter.
+    LatencyController latency;
+    /// When the last refill ran, 0 if the measurement needs restarting.
+    double lastRefill;
+    /// How long the last refill asked to sleep for.
+    unsigned long lastSleepUs;
+    /// Ring occupancy after the last refill.
+    size_t lastOccupancy;
+    unsigned long lastUnderruns;
+    /// Published for the watchdog.
+    boost::atomic<unsigned long> progress_;
+    boost::atomic<unsigned long long> deadline_;
+    /// Last point sent, idle padding parks the beam here rather then jumping to the centre.
+    PointF lastPoint;
+    bool idle;
+    /// A lazily loaded slot the playlist is on, held dark until the prefetcher has decoded
+    /// it rather than skipped, -1 if there is none.
+    int waitSlot;
+    /// Fetch, resample and process the next frame into pointBuf.
+    /// @return false if there is nothing to play.
+    bool nextFrame();
 
 private slots:
-    void dataRequested();
     void HWPpsChanged(unsigned int newPPS);
     void selectionChangedData (unsigned int sel, bool active);
     void dump();
@@ -0,0 +1,200 @@
+/* headscheduler.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "headscheduler.h"
+#include "rtconfig.h"
+#include "log.h"
+#include <time.h>
+#include <errno.h>
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+HeadWorker::HeadWorker(HeadScheduler* s, const int i) : QThread()
+{
+    scheduler = s;
+    index = i;
+}
+
+void HeadWorker::run()
+{
+    slog()->debugStream() << "Starting head worker " << index << " " << std::hex << currentThreadId();
+    RTConfig::setupThread("Head",index);
+    scheduler->work();
+    slog()->debugStream() << "Head worker " << index << " exiting";
+}
+
+HeadScheduler::HeadScheduler()
+{
+    pthread_mutex_init(&lock,NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&changed,&attr);
+    pthread_condattr_destroy(&attr);
+    stopping = false;
+    QSettings settings;
+    settings.beginGroup("Engine/Scheduler");
+    int cores = QThread::idealThreadCount();
+    cores = (cores > 2) ? cores - 1 : 1;
+    nWorkers = settings.value("Workers",cores).toUInt();
+    settings.endGroup();
+    if (!nWorkers) {
+        nWorkers = 1;
+    }
+}
+
+HeadScheduler::~HeadScheduler()
+{
+    stop();
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&lock);
+}
+
+unsigned int HeadScheduler::workers() const
+{
+    return nWorkers;
+}
+
+void HeadScheduler::start()
+{
+    pthread_mutex_lock(&lock);
+    stopping = false;
+    pthread_mutex_unlock(&lock);
+    for (unsigned int i=0; i < nWorkers; i++) {
+        HeadWorker *w = new HeadWorker(this,i);
+        threads.push_back(w);
+        w->start(QThread::HighestPriority);
+    }
+    slog()->infoStream() << "Head scheduler started with " << nWorkers << " workers";
+}
+
+void HeadScheduler::stop()
+{
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    for (unsigned int i=0; i < threads.size(); i++) {
+        threads[i]->wait();
+        delete threads[i];
+    }
+    threads.clear();
+}
+
+int HeadScheduler::find(LaserHead* h) const
+{
+    for (unsigned int i=0; i < entries.size(); i++) {
+        if (entries[i].head.get() == h) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void HeadScheduler::add(LaserHeadPtr h)
+{
+    Entry e;
+    e.head = h;
+    e.due = now();
+    e.busy = false;
+    pthread_mutex_lock(&lock);
+    entries.push_back(e);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+void HeadScheduler::remove(LaserHeadPtr h)
+{
+    pthread_mutex_lock(&lock);
+    int i;
+    while (((i = find(h.get())) >= 0) && entries[i].busy) {
+        pthread_cond_wait(&changed,&lock);
+    }
+    if (i >= 0) {
+        entries.erase(entries.begin() + i);
+    }
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+void HeadScheduler::work()
+{
+    pthread_mutex_lock(&lock);
+    while (!stopping) {
+        // Earliest deadline first among the heads that are due, else wait for the next one
+        const double t = now();
+        int best = -1;
+        double bestKey = 0.0;
+        double nextDue = -1.0;
+        for (unsigned int i=0; i < entries.size(); i++) {
+            if (entries[i].busy) {
+                continue;
+            }
+            if (entries[i].due > t) {
+                if ((nextDue < 0.0) || (entries[i].due < nextDue)) {
+                    nextDue = entries[i].due;
+                }
+                continue;
+            }
+            // Heads with no real time deadline (idle, or rendering to a file) go last
+            const double d = entries[i].head->deadline();
+            const double key = (d > 0.0) ? d : entries[i].due + 1e6;
+            if ((best < 0) || (key < bestKey)) {
+                best = i;
+                bestKey = key;
+            }
+        }
+        if (best < 0) {
+            if (nextDue < 0.0) {
+                pthread_cond_wait(&changed,&lock);
+            } else {
+                timespec ts;
+                ts.tv_sec = (time_t) nextDue;
+                ts.tv_nsec = (long)((nextDue - ts.tv_sec) * 1e9);
+                pthread_cond_timedwait(&changed,&lock,&ts);
+            }
+            continue;
+        }
+        entries[best].busy = true;
+        LaserHeadPtr h = entries[best].head;
+        pthread_mutex_unlock(&lock);
+
+        unsigned long us = h->refill();
+        if (us > HEAD_MAX_SLEEP_US) {
+            us = HEAD_MAX_SLEEP_US;
+        }
+        if ((us < HEAD_MIN_SLEEP_US) && (us || h->realTime())) {
+            us = HEAD_MIN_SLEEP_US;
+        }
+        // Rendering to a file comes back with 0, it goes round again as fast as we can
+
+        pthread_mutex_lock(&lock);
+        const int i = find(h.get());
+        if (i >= 0) {
+            entries[i].busy = false;
+            entries[i].due = now() + us * 1e-6;
+        }
+        pthread_cond_broadcast(&changed);
+    }
+    pthread_mutex_unlock(&lock);
+}
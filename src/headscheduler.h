@@ -0,0 +1,88 @@
+/* headscheduler.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef HEADSCHEDULER_INCL
+#define HEADSCHEDULER_INCL
+
+#include <vector>
+#include <pthread.h>
+#include <QtCore>
+#include "head.h"
+
+class HeadScheduler;
+
+/// \brief One real time worker of the head scheduler.
+class HeadWorker : public QThread
+{
+    Q_OBJECT
+public:
+    HeadWorker (HeadScheduler *s, const int index);
+    void run();
+private:
+    HeadScheduler *scheduler;
+    int index;
+};
+
+/// \brief Runs the refill loops of any number of heads on a small pool of worker threads.
+///
+/// Each head is due again when the time its last refill asked to sleep for is up. A free
+/// worker takes whichever due head has the earliest deadline (the time its driver ring runs
+/// dry), so with more heads then workers the one closest to an underrun always goes first.
+/// A head is only ever refilled by one worker at a time. The pool size comes from
+/// Engine/Scheduler/Workers and defaults to one less then the number of cores, leaving one
+/// for the GUI and interrupts.
+class HeadScheduler
+{
+public:
+    HeadScheduler ();
+    ~HeadScheduler();
+    /// \brief Start the workers.
+    void start ();
+    /// \brief Stop the workers and wait for them to exit.
+    void stop ();
+    /// \brief Add a head, it is refilled straight away.
+    void add (LaserHeadPtr h);
+    /// \brief Remove a head, waits for any refill of it in progress to finish.
+    void remove (LaserHeadPtr h);
+    /// @return the number of worker threads.
+    unsigned int workers () const;
+private:
+    class Entry
+    {
+    public:
+        LaserHeadPtr head;
+        /// Monotonic time in seconds at which the head wants refilling.
+        double due;
+        /// A worker is refilling it.
+        bool busy;
+    };
+    /// \brief The worker loop.
+    void work ();
+    /// \brief Index of the entry for a head, -1 if it is not scheduled.
+    int find (LaserHead *h) const;
+    std::vector<Entry> entries;
+    std::vector<HeadWorker *> threads;
+    pthread_mutex_t lock;
+    /// Signalled whenever the schedule changes or a refill finishes.
+    pthread_cond_t changed;
+    bool stopping;
+    unsigned int nWorkers;
+    friend class HeadWorker;
+};
+
+#endif
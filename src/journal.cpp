@@ -0,0 +1,301 @@
+/* journal.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "journal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "log.h"
+#include "binaryshow.h"
+
+static void putU32(QByteArray &b, const quint32 v)
+{
+    const quint32 le = qToLittleEndian(v);
+    b.append((const char *) &le,sizeof(le));
+}
+
+static void putU64(QByteArray &b, const quint64 v)
+{
+    const quint64 le = qToLittleEndian(v);
+    b.append((const char *) &le,sizeof(le));
+}
+
+static quint32 getU32(const char *p)
+{
+    return qFromLittleEndian<quint32>((const uchar *) p);
+}
+
+static quint64 getU64(const char *p)
+{
+    return qFromLittleEndian<quint64>((const uchar *) p);
+}
+
+JournalRecord::JournalRecord()
+{
+    type = 0;
+    position = 0;
+}
+
+JournalMark::JournalMark()
+{
+    generation = 0;
+    offset = 0;
+}
+
+ShowJournal::ShowJournal(const QString filename)
+{
+    name = filename;
+    generation = 0;
+}
+
+ShowJournal::~ShowJournal()
+{
+    QMutexLocker l(&lock);
+    file.close();
+}
+
+QString ShowJournal::fileName() const
+{
+    return name;
+}
+
+QByteArray ShowJournal::header()
+{
+    QByteArray b(JOURNAL_MAGIC);
+    putU32(b,JOURNAL_VERSION);
+    return b;
+}
+
+QByteArray ShowJournal::encode(const quint32 type, const quint64 pos, const QByteArray data)
+{
+    QByteArray b;
+    b.reserve(JOURNAL_RECORD_HEADER + data.size());
+    putU32(b,type);
+    putU32(b,crc32(crc32(0,NULL,0),(const Bytef *) data.constData(),data.size()));
+    putU64(b,pos);
+    putU32(b,data.size());
+    b.append(data);
+    return b;
+}
+
+bool ShowJournal::read(const QString filename, QString &base, std::vector<JournalRecord> &records, quint64 &end)
+{
+    records.clear();
+    base = QString();
+    end = 0;
+    QFile f(filename);
+    if (!f.exists() || !f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const QByteArray b = f.readAll();
+    f.close();
+    if ((b.size() < JOURNAL_HEADER) || !b.startsWith(JOURNAL_MAGIC) ||
+            (getU32(b.constData() + 8) != JOURNAL_VERSION)) {
+        slog()->errorStream() << "Ignoring unrecognised journal " << filename.toStdString();
+        return false;
+    }
+    quint64 p = JOURNAL_HEADER;
+    bool haveBase = false;
+    while (p + JOURNAL_RECORD_HEADER <= (quint64) b.size()) {
+        const char *r = b.constData() + p;
+        const quint32 size = getU32(r + 16);
+        if (p + JOURNAL_RECORD_HEADER + size > (quint64) b.size()) {
+            slog()->infoStream() << "Journal ends in a partial record at " << p;
+            break;
+        }
+        const QByteArray data(r + JOURNAL_RECORD_HEADER,size);
+        if (getU32(r + 4) != crc32(crc32(0,NULL,0),(const Bytef *) data.constData(),data.size())) {
+            slog()->errorStream() << "Journal record at " << p << " is corrupt, ignoring the rest";
+            break;
+        }
+        const quint32 type = getU32(r);
+        if (type == JournalRecord::JOURNAL_BASE) {
+            base = QString::fromUtf8(data.constData(),data.size());
+            haveBase = true;
+        } else if ((type == JournalRecord::JOURNAL_SLOT) && haveBase) {
+            JournalRecord rec;
+            rec.type = type;
+            rec.position = getU64(r + 8);
+            rec.data = data;
+            records.push_back(rec);
+        } else {
+            slog()->errorStream() << "Unexpected journal record type " << type << " at " << p;
+            break;
+        }
+        p += JOURNAL_RECORD_HEADER + size;
+    }
+    end = p;
+    return !records.empty();
+}
+
+bool ShowJournal::append(const QByteArray rec)
+{
+    if (!file.isOpen()) {
+        return false;
+    }
+    // No fsync here, the page cache outlives a crash of ours and that is what this is for
+    if ((file.write(rec) != rec.size()) || !file.flush()) {
+        slog()->errorStream() << "Journal write failed : " << file.errorString().toStdString();
+        return false;
+    }
+    return true;
+}
+
+bool ShowJournal::start(const QString base)
+{
+    QMutexLocker l(&lock);
+    file.close();
+    file.setFileName(name);
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+        slog()->errorStream() << "Couldn't open journal " << name.toStdString() << " : " << file.errorString().toStdString();
+        return false;
+    }
+    generation++;
+    slog()->debugStream() << "Journal started on " << base.toStdString();
+    return append(header() + encode(JournalRecord::JOURNAL_BASE,0,base.toUtf8()));
+}
+
+bool ShowJournal::resume(const quint64 end)
+{
+    QMutexLocker l(&lock);
+    file.close();
+    file.setFileName(name);
+    if (!file.open(QIODevice::ReadWrite) || !file.resize(end) || !file.seek(end)) {
+        slog()->errorStream() << "Couldn't reopen journal " << name.toStdString() << " : " << file.errorString().toStdString();
+        file.close();
+        return false;
+    }
+    generation++;
+    return true;
+}
+
+QByteArray ShowJournal::payload(SourceImplPtr fs)
+{
+    QByteArray data;
+    BinaryShowStubPtr stub = boost::dynamic_pointer_cast<BinaryShowStub>(fs);
+    if (stub) {
+        fs = stub->resolve();
+    }
+    if (fs) {
+        QXmlStreamWriter w(&data);
+        fs->saveFrames(&w);
+    }
+    return data;
+}
+
+bool ShowJournal::record(const size_t pos, const QByteArray data)
+{
+    const QByteArray rec = encode(JournalRecord::JOURNAL_SLOT,pos,data);
+    QMutexLocker l(&lock);
+    return append(rec);
+}
+
+JournalMark ShowJournal::mark()
+{
+    QMutexLocker l(&lock);
+    JournalMark m;
+    m.generation = generation;
+    m.offset = file.isOpen() ? file.pos() : 0;
+    return m;
+}
+
+quint64 ShowJournal::size()
+{
+    QMutexLocker l(&lock);
+    return file.isOpen() ? file.pos() : 0;
+}
+
+bool ShowJournal::rebase(const QString base, const JournalMark m)
+{
+    QMutexLocker l(&lock);
+    if (!file.isOpen() || (m.generation != generation)) {
+        slog()->debugStream() << "Journal rebased since the mark, keeping it as it is";
+        return false;
+    }
+    const quint64 end = file.pos();
+    if (!file.seek(m.offset)) {
+        return false;
+    }
+    const QByteArray tail = file.read(end - m.offset);
+    file.seek(end);
+    if ((quint64) tail.size() != end - m.offset) {
+        slog()->errorStream() << "Couldn't read journal " << name.toStdString() << " : " << file.errorString().toStdString();
+        return false;
+    }
+    // Built beside the old one and renamed over it, a crash part way leaves one or the other
+    const QString tmp = name + ".new";
+    QFile f(tmp);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        slog()->errorStream() << "Couldn't open journal " << tmp.toStdString() << " : " << f.errorString().toStdString();
+        return false;
+    }
+    const QByteArray head = header() + encode(JournalRecord::JOURNAL_BASE,0,base.toUtf8());
+    bool res = (f.write(head) == head.size()) && (f.write(tail) == tail.size()) && f.flush();
+    if (res && fsync(f.handle())) {
+        res = false;
+    }
+    f.close();
+    if (res && rename(QFile::encodeName(tmp).constData(),QFile::encodeName(name).constData())) {
+        slog()->errorStream() << "Couldn't rename " << tmp.toStdString() << " : " << strerror(errno);
+        res = false;
+    }
+    if (!res) {
+        QFile::remove(tmp);
+        return false;
+    }
+    file.close();
+    if (!file.open(QIODevice::ReadWrite) || !file.seek(file.size())) {
+        slog()->errorStream() << "Couldn't reopen journal " << name.toStdString() << " : " << file.errorString().toStdString();
+        file.close();
+        return false;
+    }
+    generation++;
+    slog()->debugStream() << "Journal rebased on " << base.toStdString() << ", " << tail.size() << " bytes of records kept";
+    return true;
+}
+
+void ShowJournal::discard()
+{
+    QMutexLocker l(&lock);
+    if (file.isOpen()) {
+        file.close();
+        QFile::remove(name);
+    }
+}
+
+SourceImplPtr ShowJournal::parse(const QByteArray data)
+{
+    SourceImplPtr fs;
+    if (data.isEmpty()) {
+        return fs;
+    }
+    QXmlStreamReader r(data);
+    r.readNextStartElement();
+    if (r.tokenType() != QXmlStreamReader::StartElement) {
+        slog()->errorStream() << "Xml error in journal record : " << r.errorString().toStdString();
+        return fs;
+    }
+    fs = FrameSource_impl::loadFrames(&r);
+    if (r.hasError()) {
+        slog()->errorStream() << "Journal record read error : " << r.errorString().toStdString();
+    }
+    return fs;
+}
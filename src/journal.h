@@ -0,0 +1,123 @@
+/* journal.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef JOURNAL_INCL
+#define JOURNAL_INCL
+
+#include <vector>
+#include <QtCore>
+#include "framesource_impl.h"
+
+/// The autosave journal, an append only log of slot changes on top of a base show file.
+
+/// A change to a slot costs one record holding just that slot's tree, so keeping the
+/// journal up to date costs in proportion to the edit rather than the show. Every so often
+/// the engine writes the whole show out in the background and rebases the journal onto it,
+/// and a journal still there at startup means the last session never exited cleanly.
+/// Everything is little endian.
+///
+/// Header, 12 bytes: char magic[8] "LUCIFJNL", u32 version.
+/// Records: u32 type, u32 crc32 of the payload, u64 slot position, u32 payload size, payload.
+///   JOURNAL_BASE, the payload is the name of the show file the records apply to (UTF-8),
+///   empty for a show started from nothing. It is always the first record.
+///   JOURNAL_SLOT, the payload is the slot's tree as xml (see FrameSource_impl::saveFrames),
+///   empty for a slot that was cleared.
+/// A record cut short or failing its crc ends the journal, it is where the crash happened.
+
+#define JOURNAL_MAGIC "LUCIFJNL"
+#define JOURNAL_VERSION (1)
+#define JOURNAL_HEADER (12)
+#define JOURNAL_RECORD_HEADER (20)
+
+/// \brief One record read back from a journal.
+class JournalRecord
+{
+public:
+    JournalRecord();
+    enum Type {JOURNAL_BASE = 1, JOURNAL_SLOT = 2};
+    quint32 type;
+    size_t position;
+    QByteArray data;
+};
+
+/// \brief A point in the journal, everything after it survives a rebase.
+class JournalMark
+{
+public:
+    JournalMark();
+    unsigned int generation;
+    quint64 offset;
+};
+
+/// \brief The journal file, appended to from whichever thread changes a slot.
+class ShowJournal
+{
+public:
+    ShowJournal (const QString filename);
+    ~ShowJournal ();
+    /// \brief Read back a journal left by an earlier session.
+    /// @param[in] filename is the journal to read.
+    /// @param[out] base is the show file the records apply to.
+    /// @param[out] records is the slot records in the order they were written.
+    /// @param[out] end is the size of the intact part of the journal.
+    /// @return false if there is no journal or it holds no changes.
+    static bool read (const QString filename, QString &base, std::vector<JournalRecord> &records, quint64 &end);
+    /// \brief Start a new journal on top of a show file, dropping whatever was there.
+    /// @param[in] base is the show file, empty for a new show.
+    /// @return false on error.
+    bool start (const QString base);
+    /// \brief Carry on appending to a recovered journal, cutting off any torn record.
+    /// @param[in] end is the end of the intact records, as returned by read().
+    /// @return false on error.
+    bool resume (const quint64 end);
+    /// \brief Serialise a tree for record().
+    /// This is the slow part of recording a change, so it is kept apart and needs no lock.
+    /// @param[in] fs is the tree, or a null pointer for a cleared slot.
+    /// @return the JOURNAL_SLOT payload.
+    static QByteArray payload (SourceImplPtr fs);
+    /// \brief Append the tree now at a slot.
+    /// @param[in] pos is the slot position.
+    /// @param[in] data is the tree as returned by payload().
+    /// @return false on error or if the journal is not open.
+    bool record (const size_t pos, const QByteArray data);
+    /// @return the point the next record will be written at.
+    JournalMark mark ();
+    /// \brief Make base the show file and keep only the records written after m.
+    /// If the journal has been rebased since m was taken this does nothing, the records
+    /// are all still there so nothing is lost.
+    /// @return false on error or a stale mark.
+    bool rebase (const QString base, const JournalMark m);
+    /// @return the size of the journal file, what compaction is scheduled on.
+    quint64 size ();
+    /// \brief Close and remove the journal, for a clean exit.
+    void discard ();
+    QString fileName () const;
+    /// \brief Decode a JOURNAL_SLOT payload.
+    /// @return the tree, a null pointer for a cleared slot or on error.
+    static SourceImplPtr parse (const QByteArray data);
+private:
+    static QByteArray header ();
+    static QByteArray encode (const quint32 type, const quint64 pos, const QByteArray data);
+    bool append (const QByteArray rec);
+    QMutex lock;
+    QFile file;
+    QString name;
+    unsigned int generation;
+};
+
+#endif
@@ -0,0 +1,139 @@
+/* latencycontroller.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "latencycontroller.h"
+
+#include <QSettings>
+#include "log.h"
+
+/// Samples between target recalculations.
+#define LATENCY_UPDATE_SAMPLES (64)
+/// Do not shrink until this many samples are in the window.
+#define LATENCY_MIN_SAMPLES (1000)
+/// Seconds after a widen before we will shrink again, and between shrink steps.
+#define LATENCY_HOLD_S (5.0)
+#define LATENCY_SHRINK_S (1.0)
+/// Fraction of the target removed per shrink step at most.
+#define LATENCY_SHRINK_STEP (0.1)
+/// Headroom over the measured quantile.
+#define LATENCY_HEADROOM (1.25)
+
+LatencyController::LatencyController() : bins(LATENCY_BINS,0), window(LATENCY_WINDOW,0)
+{
+    windowPos = 0;
+    samples = 0;
+    probability = 0.001;
+    minMs = 2.0;
+    maxMs = 200.0;
+    lastWiden = 0.0;
+    lastShrink = 0.0;
+    lastUpdate = 0.0;
+    sinceUpdate = 0;
+    published.store(0);
+    setTarget(20.0);
+}
+
+void LatencyController::load(const QString group)
+{
+    QSettings settings;
+    settings.beginGroup(group);
+    probability = settings.value("Underrun probability",0.001).toDouble();
+    minMs = settings.value("Min ms",2.0).toDouble();
+    maxMs = settings.value("Max ms",200.0).toDouble();
+    const double start = settings.value("Start ms",20.0).toDouble();
+    settings.endGroup();
+    if (probability <= 0.0 || probability >= 1.0) {
+        probability = 0.001;
+    }
+    if (maxMs < minMs) {
+        maxMs = minMs;
+    }
+    setTarget(start);
+}
+
+void LatencyController::setTarget(const double ms)
+{
+    target = (ms < minMs) ? minMs : ((ms > maxMs) ? maxMs : ms);
+    published.store((unsigned int)(target * 1000.0));
+}
+
+double LatencyController::latencyMs() const
+{
+    return published.load() / 1000.0;
+}
+
+void LatencyController::sample(const double lateUs)
+{
+    int bin = (lateUs <= 0.0) ? 0 : (int)(lateUs / LATENCY_BIN_US);
+    if (bin >= LATENCY_BINS) {
+        bin = LATENCY_BINS - 1;
+    }
+    if (samples == LATENCY_WINDOW) {
+        bins[window[windowPos]]--;
+    } else {
+        samples++;
+    }
+    window[windowPos] = bin;
+    bins[bin]++;
+    windowPos = (windowPos + 1) % LATENCY_WINDOW;
+    sinceUpdate++;
+}
+
+void LatencyController::underrun()
+{
+    const double old = target;
+    setTarget(target * 1.5);
+    lastWiden = lastUpdate;
+    slog()->infoStream() << "Head underrun, latency target " << old << "ms -> " << target << "ms";
+}
+
+void LatencyController::update(const double t)
+{
+    lastUpdate = t;
+    if (sinceUpdate < LATENCY_UPDATE_SAMPLES) {
+        return;
+    }
+    sinceUpdate = 0;
+    // Walk down from the top until we have passed the allowed fraction of samples
+    const double allowed = samples * probability;
+    double above = 0.0;
+    int bin = LATENCY_BINS - 1;
+    while (bin > 0) {
+        above += bins[bin];
+        if (above > allowed) {
+            break;
+        }
+        bin--;
+    }
+    // Half the target is what is left when we refill, that must cover the lateness
+    const double lateMs = (bin + 1) * LATENCY_BIN_US / 1000.0;
+    double desired = 2.0 * lateMs * LATENCY_HEADROOM;
+    desired = (desired < minMs) ? minMs : ((desired > maxMs) ? maxMs : desired);
+    if (desired > target) {
+        slog()->debugStream() << "Widening latency target " << target << "ms -> " << desired << "ms";
+        setTarget(desired);
+        lastWiden = t;
+    } else if ((desired < target) && (samples >= LATENCY_MIN_SAMPLES) &&
+               (t - lastWiden > LATENCY_HOLD_S) && (t - lastShrink > LATENCY_SHRINK_S)) {
+        double next = target * (1.0 - LATENCY_SHRINK_STEP);
+        next = (next < desired) ? desired : next;
+        slog()->debugStream() << "Shrinking latency target " << target << "ms -> " << next << "ms";
+        setTarget(next);
+        lastShrink = t;
+    }
+}
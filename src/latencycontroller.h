@@ -0,0 +1,78 @@
+/* latencycontroller.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef LATENCY_CONTROLLER_INCL
+#define LATENCY_CONTROLLER_INCL
+
+#include <vector>
+#include <QString>
+#include <boost/atomic.hpp>
+
+/// Width of a histogram bin in microseconds.
+#define LATENCY_BIN_US (100)
+/// Number of bins, the histogram covers 0 to 250ms of lateness.
+#define LATENCY_BINS (2500)
+/// Number of samples in the sliding window.
+#define LATENCY_WINDOW (10000)
+
+/// \brief Picks the head buffer target from measured refill jitter.
+///
+/// Every refill the head reports how late it effectively was, that is how long after the
+/// time it asked to be woken it actually ran plus any extra the driver took in a burst.
+/// The refill happens with half the target still queued, so the ring runs dry exactly when
+/// that lateness exceeds half the target. The controller keeps a sliding histogram of
+/// lateness and sets half the target to the quantile that is exceeded with the configured
+/// underrun probability, plus a little headroom. It widens straight away when that grows
+/// (or when the driver actually underruns) and only shrinks slowly once things have been
+/// quiet for a while.
+///
+/// Everything except latencyMs() must be called from the head thread.
+class LatencyController
+{
+public:
+    LatencyController();
+    /// \brief Read Underrun probability, Min ms, Max ms and Start ms from the QSettings group given.
+    void load (const QString group);
+    /// \brief Record the lateness of one refill in microseconds.
+    void sample (const double lateUs);
+    /// \brief The driver ran dry, widen now.
+    void underrun ();
+    /// \brief Recompute the target, cheap enough to call every refill.
+    /// @param[in] t is the current monotonic time in seconds.
+    void update (const double t);
+    /// @return the current target buffer depth in milliseconds, safe from any thread.
+    double latencyMs () const;
+private:
+    void setTarget (const double ms);
+    std::vector<unsigned int> bins;
+    std::vector<unsigned short> window;
+    size_t windowPos;
+    size_t samples;
+    double probability;
+    double minMs;
+    double maxMs;
+    double target;
+    double lastWiden;
+    double lastShrink;
+    double lastUpdate;
+    unsigned int sinceUpdate;
+    /// The target in microseconds for other threads.
+    boost::atomic<unsigned int> published;
+};
+
+#endif
@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <vector>
 #include <string.h>
 #include <QtCore>
+#include <QtConcurrentMap>
 #include <boost/make_shared.hpp>
 
 #include "point.h"
@@ -42,15 +43,84 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "colourrotator.h"
 
+/// Size of the header of every section but type 3.
+#define ILDA_HEADER (32)
+/// Size of a type 3 (true colour table) section header.
+#define ILDA_TRUECOLOUR_HEADER (16)
+
+/// @return the size of one point record in a frame section, or 0 if format is not one.
+static unsigned int recordSize(const unsigned int format)
+{
+    switch (format) {
+    case 0:
+        return 8;
+    case 1:
+        return 6;
+    case 4:
+        return 10;
+    case 5:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+IldaSection::IldaSection()
+{
+    format = 0;
+    records = NULL;
+    count = 0;
+    trueColour = NULL;
+    trueColourCount = 0;
+}
 
 Ildaloader::Ildaloader ()
 {
-    trueColour = false;
 }
 Ildaloader::~Ildaloader ()
 {
 }
 
+std::string Ildaloader::field(const uchar* p)
+{
+    // Not necessarily nul terminated
+    return std::string((const char *) p,strnlen((const char *) p,8));
+}
+
+void Ildaloader::decode(IldaSection& s)
+{
+    ILDAPoint *out = s.frame->resize(s.count);
+    const unsigned int size = recordSize(s.format);
+    const bool is3D = (s.format == 0) || (s.format == 4);
+    const bool indexed = (s.format == 0) || (s.format == 1);
+    const uchar *pal = (const uchar *) s.palette.constData();
+    const uchar *r = s.records;
+    for (unsigned int i = 0; i < s.count; i++, r += size) {
+        ILDAPoint &p = out[i];
+        p.setX(qFromBigEndian<qint16>(r));
+        p.setY(qFromBigEndian<qint16>(r + 2));
+        const uchar *t = r + 4;
+        if (is3D) {
+            p.setZ(qFromBigEndian<qint16>(t));
+            t += 2;
+        } else {
+            p.setZ(0);
+        }
+        p.setBlanked((t[0] & 64) == 64);
+        if (indexed) {
+            // A true colour table overrides the palette, for as many points as it covers
+            const uchar *c = (i < s.trueColourCount) ? s.trueColour + 3 * i : pal + 3 * t[1];
+            p.setR(c[0]);
+            p.setG(c[1]);
+            p.setB(c[2]);
+        } else {
+            p.setB(t[1]);
+            p.setG(t[2]);
+            p.setR(t[3]);
+        }
+    }
+}
+
 SourceImplPtr Ildaloader::load (QString filename, unsigned int &error, bool pangolin)
 {
     slog()->infoStream() << "Loading ILDA file : " << filename.toStdString();
@@ -62,282 +132,134 @@ SourceImplPtr Ildaloader::load (QString filename, unsigned int &error, bool pang
         slog()->infoStream() <<"Unable to open '" << filename.toStdString() <<"' for reading";
         return SourceImplPtr();
     }
-    palette_.clear ();
-    palette_.reserve (256);
-    colour.clear();
-    trueColour = false;
-    // Load default colour palette
-    unsigned int i = 0;
-    const short * pal = (pangolin) ? pangolin_palette : ilda_palette;
-    while (pal[3*i] != -1) {
-        palette_.push_back (QColor (pal[3*i],pal[3*i+1],pal[3*i+2]));
-        i++;
+    const quint64 size = infile.size();
+    if (size == 0) {
+        return SourceImplPtr();
     }
-    while (i < 256) {
-        palette_.push_back (QColor(Qt::black));
-        i++;
+    const uchar *map = infile.map(0,size);
+    if (!map) {
+        error = 1;
+        slog()->errorStream() << "Unable to map '" << filename.toStdString() << "' : " << infile.errorString().toStdString();
+        return SourceImplPtr();
     }
-    // Parse the file building either a single staticframe or a framesequencer full of static frames as we go
-    StaticFramePtr frame;
-    FrameSequencerPtr sequence;
-
-    QDataStream stream (&infile);
-    stream.setByteOrder (QDataStream::BigEndian);
-
+    // Load default colour palette, as rgb bytes, anything it does not cover is black
+    QByteArray palette(256 * 3,0);
+    const short * pal = (pangolin) ? pangolin_palette : ilda_palette;
+    for (unsigned int i = 0; (i < 256) && (pal[3*i] != -1); i++) {
+        palette[3*i] = pal[3*i];
+        palette[3*i+1] = pal[3*i+1];
+        palette[3*i+2] = pal[3*i+2];
+    }
+    // Find the frames, this only looks at section headers
+    std::vector<IldaSection> sections;
+    const uchar *trueColour = NULL;
+    unsigned int trueColourCount = 0;
+    quint64 p = 0;
     bool eof = false;
-    while ((!stream.atEnd()) && (!eof)) {
-        char buf[4];
-        stream.readRawData (buf,4);
-        if (memcmp ("ILDA",buf,4)) {
+    while ((p + 8 <= size) && (!eof)) {
+        const uchar *h = map + p;
+        if (memcmp ("ILDA",h,4)) {
             // Not an ILDA section?
             error = 2;
             slog()->errorStream() << "Section name not ILDA";
             break;
         }
-        quint32 format;
-        stream >> format;
-        StaticFramePtr fr;
-        switch (format) {
-        case 0:
-            // 3D Frame
-            slog()->infoStream() << "Type 0 (3D points) section";
-            fr = readFrameSection(stream, true);
-            eof = (fr == NULL);
-            break;
-
-        case 1:
-            // 2D Frame
-            slog()->infoStream() << "Type 1 (2D points) section";
-            fr = readFrameSection(stream, false);
-            eof = (fr == NULL);
-            break;
-
-        case 2:
-            // Color Table
-            slog()->infoStream() << "Type 2 (Indexed colour table) section";
-            eof = readColorTable(stream);
-            break;
-
-        case 3:
-            // True Color
+        const quint32 format = qFromBigEndian<quint32>(h + 4);
+        if (format == 3) {
             slog()->infoStream() << "Type 3 (True colour table) section";
             slog()->errorStream() <<"Type 3 is not a ratified ILDA standard and worse Laserboy uses something called type 3 that DOES NOT match the draft ILDA standard that briefly existed";
-            eof = readTrueColorSection(stream);
-            break;
-
-        case 4:
-            slog()->infoStream() << "Type 4 (True colour 3D) section";
-            fr = readFormat5(stream, true);
-            eof = (fr == NULL);
-            break;
-
-        case 5:
-            slog()->infoStream() << "Type 5 (True colour 2D) section";
-            fr = readFormat5(stream, false);
-            eof = (fr == NULL);
-            break;
-
-        default:
+            if (p + ILDA_TRUECOLOUR_HEADER > size) {
+                break;
+            }
+            const quint32 datalen = qFromBigEndian<quint32>(h + 8);
+            const quint32 points = qFromBigEndian<quint32>(h + 12);
+            if (points > 0xFFFF) {
+                // Something odd, an ILDA frame can have no more then 65535 points!
+                // Fall back on indexed colour mode
+                slog()->errorStream() << "ILDA Load - found truecolour section with invalid length!";
+                p += 12 + (quint64) datalen;
+                continue;
+            }
+            if (p + ILDA_TRUECOLOUR_HEADER + 3 * (quint64) points > size) {
+                break;
+            }
+            if (points) {
+                trueColour = h + ILDA_TRUECOLOUR_HEADER;
+                trueColourCount = points;
+            }
+            p += ILDA_TRUECOLOUR_HEADER + 3 * (quint64) points;
+            continue;
+        }
+        if (format > 5) {
             slog()->errorStream() << "Type " << format << " Unknown section skipping";
-            qint32 dataLength;
-            qint32 numberOfPoints;
-
-            stream >> dataLength >> numberOfPoints;
-            stream.skipRawData(dataLength);
+            if (p + 16 > size) {
+                break;
+            }
+            p += 16 + (quint64) qFromBigEndian<quint32>(h + 8);
+            continue;
+        }
+        if (p + ILDA_HEADER > size) {
             break;
         }
-        if (fr) {
-            // New frame
-            if (sequence) {
-                // Already got a frame sequencer
-                sequence->addChild(fr);
-            } else {
-                if (!frame) {
-                    // This is the first or only frame
-                    frame = fr;
-                } else {
-                    // Second frame in file, we need a sequencer
-                    sequence = boost::make_shared<FrameSequencer>();
-                    sequence->setDescription(std::string("ILDA File import from : ") +
-											filename.toStdString());
-                    sequence->addChild (frame);
-                    sequence->addChild (fr);
-                }
+        const unsigned int count = qFromBigEndian<quint16>(h + 24);
+        if (format == 2) {
+            slog()->infoStream() << "Type 2 (Indexed colour table) section";
+            slog()->infoStream() << "Palette name : " << field(h + 8);
+            slog()->infoStream() << "Colours : " << count;
+            if (p + ILDA_HEADER + 3 * (quint64) count > size) {
+                break;
             }
+            palette = QByteArray(256 * 3,0);
+            memcpy(palette.data(),h + ILDA_HEADER,3 * ((count < 256) ? count : 256));
+            p += ILDA_HEADER + 3 * (quint64) count;
+            continue;
         }
-    }
-    infile.close ();
-    palette_.clear();
-    colour.clear();
-
-    if (sequence){
-      ColourRotatorPtr r = boost::make_shared<ColourRotator>();
-      r->addChild(sequence);
-      return r;
-    }
-    
-    if (sequence) {
-        return sequence;
-    } else {
-        return frame;
-    }
-}
-
-// For old format 2 and 3d point data
-void Ildaloader::readHeader(QDataStream & stream, std::string & name,
-                            std::string & company, quint16 & pointcount)
-{
-    char name_[9], companyName_[9];
-
-    name_[8] = '\0';
-    companyName_[8] = '\0';
-
-    stream.readRawData(name_, 8);
-    stream.readRawData(companyName_, 8);
-    stream >> pointcount;
-    stream.skipRawData(6);
-    name = name_;
-    company = companyName_;
-    slog()->infoStream() << "Name : " << name << " by : " << company;
-    slog()->debugStream() << "Count : " << pointcount;
-}
-
-StaticFramePtr Ildaloader::readFrameSection(QDataStream & stream, bool is3DFrame)
-{
-    std::string name, companyName;
-    quint16 points;
-    StaticFramePtr frame;
-
-    readHeader(stream, name, companyName, points);
-    if (points == 0) {
-        //End of data marker
-        return frame;
-    }
-    frame = boost::make_shared<StaticFrame>();
-    frame->setDescription(std::string("ILDA: ") + name + std::string(" By ") + companyName );
-    frame->reserve(points);
-    for (unsigned int i=0; i<points; ++i) {
-        ILDAPoint p;
-        qint16 x;
-        qint16 y;
-        stream >> x >> y;
-        p.setX(x);
-        p.setY(y);
-        if (is3DFrame) {
-            qint16 z;
-            stream >> z;
-            p.setZ(z);
-        } else {
-            p.setZ(0);
+        slog()->debugStream() << "Type " << format << " frame section, " << count << " points";
+        if (count == 0) {
+            //End of data marker
+            eof = true;
+            break;
         }
-        quint8 state = 0;
-        quint8 col;
-        stream >> state >> col;
-        p.setBlanked((state & 64) == 64);
-        if (!trueColour) {
-            p.setR(palette_[col].red());
-            p.setG(palette_[col].green());
-            p.setB(palette_[col].blue());
-        } else {
-            p.setR(colour[i].red());
-            p.setG(colour[i].green());
-            p.setB(colour[i].blue());
+        const quint64 bytes = (quint64) count * recordSize(format);
+        if (p + ILDA_HEADER + bytes > size) {
+            slog()->errorStream() << "Frame section truncated, ignoring it and the rest of the file";
+            break;
         }
-        frame->add_data (p);
-    }
-    colour.clear();
-    trueColour = false;
-    return frame;
-}
-
-bool Ildaloader::readTrueColorSection(QDataStream& stream)
-{
-    quint32 points;
-    quint32 datalen;
-    stream >> datalen;
-    stream >> points;
-    if (points >0xFFFF) {
-        // Something odd, an ILDA frame can have no more then 65535 points!
-        // Fall back on indexed colour mode
-        stream.skipRawData(datalen-4);
-        slog()->errorStream() << "ILDA Load - found truecolour section with invalid length!";
-        return false;
+        IldaSection s;
+        s.format = format;
+        s.records = h + ILDA_HEADER;
+        s.count = count;
+        s.palette = palette;
+        s.trueColour = trueColour;
+        s.trueColourCount = trueColourCount;
+        s.frame = boost::make_shared<StaticFrame>();
+        s.frame->setDescription(std::string("ILDA: ") + field(h + 8) + std::string(" By ") + field(h + 16));
+        sections.push_back(s);
+        // A true colour table only applies to the frame after it
+        trueColour = NULL;
+        trueColourCount = 0;
+        p += ILDA_HEADER + bytes;
     }
-    if (points ==0) {
-        return true;
-    }
-    colour.clear();
-    colour.reserve(points);
-    for (unsigned int  i=0; i<points; ++i) {
-        quint8 r, g, b;
-        stream >> r >> g >> b;
-        colour.push_back(QColor((unsigned char)r,
-                                (unsigned char)g,
-                                (unsigned char)b));
-    }
-    trueColour = true;
-    return false;
-}
-
-StaticFramePtr Ildaloader::readFormat5(QDataStream & stream, bool is3DFrame)
-{
-    std::string name, companyName;
-    quint16 points;
+    QTime timer;
+    timer.start();
+    QtConcurrent::blockingMap(sections,&Ildaloader::decode);
+    infile.unmap((uchar *) map);
+    infile.close ();
+    slog()->infoStream() << "Decoded " << sections.size() << " frames in " << timer.elapsed() << "ms";
 
-    readHeader(stream, name, companyName, points);
-    if (points == 0) {
-        return StaticFramePtr();
+    // Build either a single staticframe or a framesequencer full of static frames
+    if (sections.empty()) {
+        return SourceImplPtr();
     }
-    StaticFramePtr frame = boost::make_shared<StaticFrame>();
-    frame->setDescription(std::string("ILDA: ") + name + std::string(" By ") + companyName );
-    frame->reserve(points);
-    for (unsigned int i = 0; i < points; ++i) {
-        ILDAPoint p;
-        quint8 r, g, b, state;
-        qint16 x,y;
-        stream >> x >> y;
-        p.setX(x);
-        p.setY(y);
-        if (is3DFrame) {
-            qint16 z;
-            stream >> z;
-            p.setZ(z);
-        } else {
-            p.setZ(0);
-        }
-        stream >> state >> b >> g >> r;
-        p.setBlanked((state & 64) == 64);
-        p.setR(r);
-        p.setG(g);
-        p.setB(b);
-        frame->add_data (p);
+    if (sections.size() == 1) {
+        return sections[0].frame;
     }
-    return frame;
-}
-
-bool Ildaloader::readColorTable(QDataStream & stream)
-{
-    char name_[9], companyName_[9];
-    quint16 colours;
-
-    name_[8] = '\0';
-    companyName_[8] = '\0';
-
-    stream.readRawData(name_, 8);
-    stream.readRawData(companyName_, 8);
-    slog()->infoStream() << "Palette name : " << std::string (name_);
-    stream >> colours;
-    stream.skipRawData(2);
-    slog()->infoStream() << "Colours : " << colours;
-    // skip 4 bytes
-    stream.skipRawData(4);
-    palette_.clear ();
-    palette_.reserve(colours);
-    for (unsigned int i = 0; i < colours; ++i) {
-        quint8  r, g, b;
-        stream >> r >> g >> b;
-        palette_.push_back(QColor (r,g,b));
+    FrameSequencerPtr sequence = boost::make_shared<FrameSequencer>();
+    sequence->setDescription(std::string("ILDA File import from : ") + filename.toStdString());
+    for (unsigned int i = 0; i < sections.size(); i++) {
+        sequence->addChild(sections[i].frame);
     }
-    return false;
+    ColourRotatorPtr r = boost::make_shared<ColourRotator>();
+    r->addChild(sequence);
+    return r;
 }
-
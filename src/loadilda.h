@@ -28,6 +28,28 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "framesource.h"
 #include "staticframe.h"
 
+/// \brief One frame section found by the scan, decoded afterwards.
+class IldaSection
+{
+public:
+    IldaSection();
+    unsigned int format;
+    /// The first point record, in the mapped file
+    const uchar *records;
+    unsigned int count;
+    /// 256 rgb triples, the palette in force for this frame
+    QByteArray palette;
+    /// rgb triples from a type 3 section just before this frame, or NULL
+    const uchar *trueColour;
+    unsigned int trueColourCount;
+    StaticFramePtr frame;
+};
+
+/// \brief Reads ILDA files.
+/// The file is mapped and a quick pass over the section headers finds every frame, tracking
+/// the palette and any true colour table each one uses. The frames are then decoded straight
+/// into their StaticFrame storage on the QtConcurrent pool, so big archives load about as
+/// fast as they can be read.
 class Ildaloader
 {
 public:
@@ -36,17 +58,9 @@ public:
     SourceImplPtr load (QString filename, unsigned int& error, bool pangolin = false);
 
 private:
-
-    // For old format 2 and 3d point data
-    void readHeader(QDataStream & stream, std::string& name,
-                    std::string & company, unsigned short& pointcount);
-    StaticFramePtr  readFrameSection(QDataStream & stream, bool is3DFrame);
-    bool readTrueColorSection(QDataStream & stream);
-    StaticFramePtr readFormat5(QDataStream & stream, bool is3DFrame);
-    bool readColorTable(QDataStream & stream);
-
-    std::vector <QColor> palette_;
-    bool trueColour;
-    std::vector <QColor> colour;
+    /// \brief Decode one frame's points, runs in the thread pool.
+    static void decode (IldaSection &s);
+    /// \brief The 8 byte name and company fields of a section header.
+    static std::string field (const uchar *p);
 };
 #endif
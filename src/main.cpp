@@ -44,9 +44,11 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "midi.h"
 #include "alsamidi.h"
 #include "motormix.h"
+#include "rtconfig.h"
+#include "showcodec.h"
 
 static const std::string usage(" \
-lucifer [-option] [-option]... [filename.lsf] [filename.ild(a)]\n\
+lucifer [-option] [-option]... [filename.lsf|lsb] [filename.ild(a)]\n\
 \n\
 Options are: \n\
   -v log level sets the level of logging, valid options are \n\
@@ -56,13 +58,16 @@ Options are: \n\
   -n Do not reload the last used configuration.\n\
   -h Display this help screen then exit.\n\
   -p Display a list of loadable plugins and drivers then exit.\n\
+  -b show Time saving and loading show with each compression codec then exit.\n\
 If a filename is specified it will be loaded and if more then \none is specified they will all be loaded.\n\
-Files are loaded into unused slots in the main grid window on a first \ncome basis.\n");
+Files are loaded into unused slots in the main grid window on a first \ncome basis.\n\
+If the last session did not exit cleanly its unsaved changes are recovered \ninstead.\n");
 
 int main (int argc, char **argv)
 {
     bool listPlugs = false;
     bool noReload = false;
+    std::string benchmark;
     std::string loglevel("INFO");
     qRegisterMetaType<unsigned long int>("unsigned long int");
     qRegisterMetaType<SourceImplPtr>("SourceImplPtr");
@@ -74,7 +79,7 @@ int main (int argc, char **argv)
     char * wd = getcwd (NULL,0);
     std::string logname = std::string(wd) + "lucifer.log";
     free (wd);
-    while ((c = getopt (argc, argv, "l:v:nhp")) != -1) {
+    while ((c = getopt (argc, argv, "l:v:nhpb:")) != -1) {
         switch (c) {
         case 'h':
             std::cout << usage;
@@ -86,6 +91,9 @@ int main (int argc, char **argv)
         case 'n':
             noReload = true;
             break;
+        case 'b':
+            benchmark = std::string(optarg);
+            break;
         case 'v':
             loglevel = std::string(optarg);
             std::cerr <<  loglevel <<std::endl;
@@ -95,6 +103,9 @@ int main (int argc, char **argv)
             if (optopt == 'v') {
                 std::cerr <<  "Option -v requires a log level argument." << std::endl;
                 exit(1);
+            } else if (optopt == 'b') {
+                std::cerr <<  "Option -b requires a show file argument." << std::endl;
+                exit(1);
             }	else if (isprint (optopt)) {
                 std::cerr << "Unknown option " << optopt << std::endl;
                 exit (1);
@@ -144,7 +155,13 @@ int main (int argc, char **argv)
     QCoreApplication::setOrganizationName("Exponential Software");
     QCoreApplication::setOrganizationDomain("exponent.myzen.co.uk");
     QCoreApplication::setApplicationName("Lucifer");
+    if (!benchmark.empty()) {
+        // Needs the settings for the levels, but nothing else
+        exit (ShowCodec::benchmark(QString().fromStdString(benchmark),std::cout) ? 0 : 1);
+    }
     slog()->info("Starting Galvanic Lucifer");
+    // Before any of the real time threads exist so they all inherit locked memory
+    RTConfig::setupProcess();
     
 //    for (unsigned int i=8; i < surface.numberOfControls(); i++)
 //      surface.setControl(i,i%3);
@@ -155,14 +172,24 @@ int main (int argc, char **argv)
     s.start();
     EnginePtr e = s.engine();
     if (!e) exit (-1);
+    // Pinned last, the engine's threads are already running where they were asked to be
+    RTConfig::setupThread("GUI");
+    RTConfig::report();
     
     //e->setMIDICard("USB Uno MIDI Interface MIDI 1");
     //e->setMIDIChannelDriver(0,"MotorMix");
     
     ButtonWindow grid (e);
-    for (unsigned int i=0; i < filenames.size(); i++) {
-        std::string fn = filenames[i];
-        grid.loadFile (QString().fromStdString(fn));
+    // A crashed session takes precedence, loading over it would lose the changes
+    if (e->recoverJournal()) {
+        if (!filenames.empty()) {
+            slog()->infoStream() << "Recovered the last session, not loading the files given";
+        }
+    } else {
+        for (unsigned int i=0; i < filenames.size(); i++) {
+            std::string fn = filenames[i];
+            grid.loadFile (QString().fromStdString(fn));
+        }
     }
     return app.exec();
     return 0;
@@ -198,12 +198,15 @@ void MotorMix::connectEngine(Engine* e)
     connect (activeMap, SIGNAL(mapped(int)),this,SLOT(headActive(int)));
     QSignalMapper *inactiveMap = new QSignalMapper (this);
     connect (inactiveMap,SIGNAL(mapped(int)),this, SLOT(headInactive(int)));
-    for (int i=0; i < MAX_HEADS; i++) {
-        // head activity indicators
-        connect (&(*engine->getHead(i)),SIGNAL(headActive()), activeMap, SLOT(map()));
-        activeMap->setMapping (&(*engine->getHead(i)),i);
-        connect (&(*engine->getHead(i)),SIGNAL(headInactive()), inactiveMap, SLOT(map()));
-        inactiveMap->setMapping (&(*engine->getHead(i)),i);
+    for (int i=0; i < MOTORMIX_HEADS; i++) {
+        // head activity indicators, there are only buttons for the first few heads
+        LaserHeadPtr h = engine->getHead(i);
+        if (h) {
+            connect (&(*h),SIGNAL(headActive()), activeMap, SLOT(map()));
+            activeMap->setMapping (&(*h),i);
+            connect (&(*h),SIGNAL(headInactive()), inactiveMap, SLOT(map()));
+            inactiveMap->setMapping (&(*h),i);
+        }
         head_active[i] = false;
         head_selected[i] = false;
         head_state[i] = -1;
@@ -227,7 +230,7 @@ void MotorMix::controlChangedData(int control)
        
     if (!shift && !escape){
       // No Modifier keys 
-      for (int i=0; i < MAX_HEADS;i++) {
+      for (int i=0; i < MOTORMIX_HEADS;i++) {
 	  if (control == headControls[i]) {
 	      emit headSelectionChanged (i);
 	      break;
@@ -255,7 +258,7 @@ void MotorMix::outputEffectSelected(int effect)
 
 void MotorMix::updateHeadStatus()
 {
-    for (unsigned int i = 0; i < MAX_HEADS; i++)
+    for (unsigned int i = 0; i < MOTORMIX_HEADS; i++)
     {
         int hs = 0;
         if (head_selected[i]) {
@@ -297,7 +300,7 @@ void MotorMix::headInactive(int head)
 
 void MotorMix::headSelected(int head)
 {
-    for (int i = 0 ; i < MAX_HEADS; i++) {
+    for (int i = 0 ; i < MOTORMIX_HEADS; i++) {
         head_selected[i] = (head == i);
     }
     updateHeadStatus();
@@ -6,6 +6,9 @@
 #include "config.h"
 #include <QtCore>
 
+/// The surface has head select buttons for this many heads, any more are not on it.
+#define MOTORMIX_HEADS (8)
+
 class MotorMix : public ControlSurface
 {
     Q_OBJECT
@@ -57,10 +60,10 @@ private:
     int values[2];
     MIDIChannel * channel;
     // Projection head controls
-    int headControls[MAX_HEADS];
-    bool head_selected [MAX_HEADS];
-    bool head_active [MAX_HEADS];
-    int  head_state [MAX_HEADS];
+    int headControls[MOTORMIX_HEADS];
+    bool head_selected [MOTORMIX_HEADS];
+    bool head_active [MOTORMIX_HEADS];
+    int  head_state [MOTORMIX_HEADS];
     // Message display timeout
     QTimer * messageTimer;
     // Shift and escape key numbers
@@ -0,0 +1,317 @@
+/* outputmask.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <QSettings>
+#include <QStringList>
+#include <boost/make_shared.hpp>
+
+#include "outputmask.h"
+#include "log.h"
+
+MaskZone::MaskZone()
+{
+    enabled = true;
+}
+
+MaskParams::MaskParams()
+{
+    dwell = 8;
+}
+
+MaskParams MaskParams::load(const QString group)
+{
+    MaskParams p;
+    QSettings settings;
+    settings.beginGroup(group);
+    p.dwell = settings.value("Dwell",8).toUInt();
+    const int n = settings.value("Zones",0).toInt();
+    for (int i=0; i < n && i < MAX_MASK_ZONES; i++) {
+        MaskZone z;
+        settings.beginGroup(QString().sprintf("Zone %d",i+1));
+        z.name = settings.value("Name",QString().sprintf("Zone %d",i+1)).toString();
+        z.enabled = settings.value("Enabled",true).toBool();
+        // Vertices are stored as a list of "x,y" strings
+        QStringList l = settings.value("Points").toStringList();
+        for (int j=0; j < l.size(); j++) {
+            QStringList xy = l[j].split(",");
+            if (xy.size() == 2) {
+                z.x.push_back(xy[0].toFloat());
+                z.y.push_back(xy[1].toFloat());
+            }
+        }
+        settings.endGroup();
+        p.zones.push_back(z);
+    }
+    settings.endGroup();
+    return p;
+}
+
+void MaskParams::save(const QString group) const
+{
+    QSettings settings;
+    settings.beginGroup(group);
+    settings.remove("");
+    settings.setValue("Dwell",dwell);
+    settings.setValue("Zones",(int)zones.size());
+    for (unsigned int i=0; i < zones.size(); i++) {
+        const MaskZone &z = zones[i];
+        settings.beginGroup(QString().sprintf("Zone %d",i+1));
+        settings.setValue("Name",z.name);
+        settings.setValue("Enabled",z.enabled);
+        QStringList l;
+        for (unsigned int j=0; j < z.x.size() && j < z.y.size(); j++) {
+            l.append(QString().number(z.x[j]) + "," + QString().number(z.y[j]));
+        }
+        settings.setValue("Points",l);
+        settings.endGroup();
+    }
+    settings.endGroup();
+}
+
+MaskGrid::MaskGrid(const MaskParams& p) : params(p)
+{
+    memset(bits,0,sizeof(bits));
+    memset(zone,0,sizeof(zone));
+    empty = true;
+    for (unsigned int i=0; i < params.zones.size() && i < MAX_MASK_ZONES; i++) {
+        if (params.zones[i].enabled && (params.zones[i].x.size() >= 3)) {
+            rasterise(params.zones[i],i+1);
+            empty = false;
+        }
+    }
+}
+
+MaskGrid::~MaskGrid()
+{
+}
+
+/// \brief Mark every cell a segment passes through, corners it clips included (a supercover line).
+static void supercover(float x0, float y0, float x1, float y1, std::vector<bool> &fill)
+{
+    // In cell units from here on
+    x0 = (x0 + 1.0f) * (0.5f * MASK_GRID_SZ);
+    y0 = (y0 + 1.0f) * (0.5f * MASK_GRID_SZ);
+    x1 = (x1 + 1.0f) * (0.5f * MASK_GRID_SZ);
+    y1 = (y1 + 1.0f) * (0.5f * MASK_GRID_SZ);
+    int i = (int) floorf(x0);
+    int j = (int) floorf(y0);
+    const int iEnd = (int) floorf(x1);
+    const int jEnd = (int) floorf(y1);
+    const float dx = x1 - x0;
+    const float dy = y1 - y0;
+    const int si = (dx > 0.0f) ? 1 : -1;
+    const int sj = (dy > 0.0f) ? 1 : -1;
+    // Distance along the segment, as a fraction of it, to the next cell boundary in x and y
+    const float inf = 1e30f;
+    const float deltaX = (dx != 0.0f) ? fabsf(1.0f / dx) : inf;
+    const float deltaY = (dy != 0.0f) ? fabsf(1.0f / dy) : inf;
+    float tx = (dx != 0.0f) ? ((si > 0) ? (i + 1 - x0) : (x0 - i)) * deltaX : inf;
+    float ty = (dy != 0.0f) ? ((sj > 0) ? (j + 1 - y0) : (y0 - j)) * deltaY : inf;
+    int steps = abs(iEnd - i) + abs(jEnd - j);
+    while (true) {
+        if ((i >= 0) && (j >= 0) && (i < MASK_GRID_SZ) && (j < MASK_GRID_SZ)) {
+            fill[j * MASK_GRID_SZ + i] = true;
+        }
+        if ((steps-- <= 0) || ((i == iEnd) && (j == jEnd))) {
+            break;
+        }
+        if (tx < ty) {
+            i += si;
+            tx += deltaX;
+        } else if (ty < tx) {
+            j += sj;
+            ty += deltaY;
+        } else {
+            // Straight through a cell corner, take both cells beside it as well
+            if ((i + si >= 0) && (i + si < MASK_GRID_SZ) && (j >= 0) && (j < MASK_GRID_SZ)) {
+                fill[j * MASK_GRID_SZ + i + si] = true;
+            }
+            if ((i >= 0) && (i < MASK_GRID_SZ) && (j + sj >= 0) && (j + sj < MASK_GRID_SZ)) {
+                fill[(j + sj) * MASK_GRID_SZ + i] = true;
+            }
+            i += si;
+            j += sj;
+            tx += deltaX;
+            ty += deltaY;
+            steps--;
+        }
+    }
+}
+
+void MaskGrid::rasterise(const MaskZone& z, const unsigned int number)
+{
+    // Even/odd scanline fill sampled at the cell centres. That alone misses a zone narrower
+    // than a cell, so every cell an edge passes through is marked as well, then the lot is
+    // grown by one cell in every direction so a zone edge can never leak through between samples.
+    const unsigned int n = std::min(z.x.size(),z.y.size());
+    const float cell = 2.0f / MASK_GRID_SZ;
+    std::vector<bool> fill(MASK_GRID_SZ * MASK_GRID_SZ,false);
+    for (unsigned int k=0; k < n; k++) {
+        supercover(z.x[k],z.y[k],z.x[(k + 1) % n],z.y[(k + 1) % n],fill);
+    }
+    std::vector<float> crossings;
+    for (int j=0; j < MASK_GRID_SZ; j++) {
+        const float y = -1.0f + (j + 0.5f) * cell;
+        crossings.clear();
+        for (unsigned int k=0; k < n; k++) {
+            const float x0 = z.x[k];
+            const float y0 = z.y[k];
+            const float x1 = z.x[(k + 1) % n];
+            const float y1 = z.y[(k + 1) % n];
+            if ((y0 <= y) != (y1 <= y)) {
+                crossings.push_back(x0 + (y - y0) * (x1 - x0) / (y1 - y0));
+            }
+        }
+        std::sort(crossings.begin(),crossings.end());
+        for (unsigned int k=0; k + 1 < crossings.size(); k += 2) {
+            int i0 = (int)((crossings[k] + 1.0f) / cell - 0.5f);
+            int i1 = (int)((crossings[k+1] + 1.0f) / cell - 0.5f);
+            i0 = std::max(i0,0);
+            i1 = std::min(i1,MASK_GRID_SZ - 1);
+            for (int i=i0; i <= i1; i++) {
+                fill[j * MASK_GRID_SZ + i] = true;
+            }
+        }
+    }
+    for (int j=0; j < MASK_GRID_SZ; j++) {
+        for (int i=0; i < MASK_GRID_SZ; i++) {
+            if (!fill[j * MASK_GRID_SZ + i]) {
+                continue;
+            }
+            for (int dj=-1; dj <= 1; dj++) {
+                for (int di=-1; di <= 1; di++) {
+                    const int ii = i + di;
+                    const int jj = j + dj;
+                    if ((ii < 0) || (jj < 0) || (ii >= MASK_GRID_SZ) || (jj >= MASK_GRID_SZ)) {
+                        continue;
+                    }
+                    const unsigned int idx = jj * MASK_GRID_SZ + ii;
+                    // Lowest numbered zone wins where zones overlap
+                    if (!zone[idx]) {
+                        zone[idx] = number;
+                        bits[idx >> 5] |= 1u << (idx & 31);
+                    }
+                }
+            }
+        }
+    }
+}
+
+OutputMask::OutputMask()
+{
+    grid = boost::make_shared<const MaskGrid>(MaskParams());
+    wasMasked = false;
+    pendingDwell = 0;
+    memset(&dwellPoint,0,sizeof(dwellPoint));
+    memset(&last,0,sizeof(last));
+    resetCounters();
+}
+
+OutputMask::~OutputMask()
+{
+}
+
+void OutputMask::setParams(const MaskParams& p)
+{
+    MaskGridPtr g = boost::make_shared<const MaskGrid>(p);
+    boost::atomic_store(&grid,g);
+    resetCounters();
+    slog()->infoStream() << "Output mask updated " << this << " with " << p.zones.size() << " zones";
+}
+
+MaskParams OutputMask::getParams() const
+{
+    MaskGridPtr g = boost::atomic_load(&grid);
+    return g->params;
+}
+
+unsigned long OutputMask::zoneHits(const unsigned int zone) const
+{
+    if (zone < MAX_MASK_ZONES) {
+        return hits[zone].load(boost::memory_order_relaxed);
+    }
+    return 0;
+}
+
+void OutputMask::resetCounters()
+{
+    for (unsigned int i=0; i < MAX_MASK_ZONES; i++) {
+        hits[i].store(0,boost::memory_order_relaxed);
+    }
+}
+
+size_t OutputMask::run(const PointF* in, size_t& consumed, const size_t inCount, PointF* out, const size_t outCount)
+{
+    MaskGridPtr g = boost::atomic_load(&grid);
+    size_t o = 0;
+    if (g->empty && !pendingDwell && !wasMasked) {
+        // Nothing to do but copy
+        size_t n = std::min(inCount - consumed,outCount);
+        if (n) {
+            memcpy(out,in + consumed,n * sizeof(PointF));
+            consumed += n;
+            last = out[n-1];
+        }
+        return n;
+    }
+    // Hits are counted locally and added once per call to keep the atomics off the per point path
+    unsigned long localHits[MAX_MASK_ZONES];
+    memset(localHits,0,sizeof(localHits));
+    const unsigned int dwell = g->params.dwell;
+    while (o < outCount) {
+        if (pendingDwell) {
+            out[o++] = dwellPoint;
+            pendingDwell--;
+            continue;
+        }
+        if (consumed >= inCount) {
+            break;
+        }
+        PointF p = in[consumed];
+        const bool lit = (p.r > 0.0f) || (p.g > 0.0f) || (p.b > 0.0f);
+        const unsigned int z = (lit && !g->empty) ? g->lookup(p.x,p.y) : 0;
+        const bool masked = (z != 0);
+        if (masked != wasMasked) {
+            wasMasked = masked;
+            if (dwell) {
+                // Going dark: hold the last position blanked, coming back: sit on the new one blanked
+                dwellPoint = masked ? last : p;
+                dwellPoint.r = dwellPoint.g = dwellPoint.b = 0.0f;
+                pendingDwell = dwell;
+                continue;
+            }
+        }
+        if (masked) {
+            localHits[z-1]++;
+            p.r = p.g = p.b = 0.0f;
+        }
+        out[o++] = p;
+        last = p;
+        consumed++;
+    }
+    for (unsigned int i=0; i < MAX_MASK_ZONES; i++) {
+        if (localHits[i]) {
+            hits[i].fetch_add(localHits[i],boost::memory_order_relaxed);
+        }
+    }
+    return o;
+}
@@ -0,0 +1,131 @@
+/* outputmask.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef OUTPUT_MASK_INCL
+#define OUTPUT_MASK_INCL
+
+#include <vector>
+#include <QString>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include "driver.h"
+
+/// Number of cells along each side of the mask raster.
+#define MASK_GRID_SZ (256)
+/// Maximum number of masking zones per head.
+#define MAX_MASK_ZONES (32)
+
+/// \brief A single no scan zone, a closed polygon in output coordinates (-1 to +1).
+class MaskZone
+{
+public:
+    MaskZone();
+    QString name;
+    bool enabled;
+    std::vector<float> x;
+    std::vector<float> y;
+};
+
+/// \brief The complete set of masking zones for one head.
+class MaskParams
+{
+public:
+    MaskParams();
+    std::vector<MaskZone> zones;
+    /// Number of blanked points inserted when the mask blanks or unblanks the beam.
+    unsigned int dwell;
+    /// \brief Load the zones from the QSettings group given.
+    static MaskParams load (const QString group);
+    /// \brief Store the zones to the QSettings group given.
+    void save (const QString group) const;
+};
+
+/// \brief The zones rasterised into a bitmask for O(1) lookup.
+/// The bitmask is 8k so it stays in cache, the zone number grid is only touched for
+/// points that actually hit a zone. Like the warp grid this is immutable once built.
+class MaskGrid
+{
+public:
+    MaskGrid (const MaskParams &p);
+    ~MaskGrid();
+    /// \brief Look up a point.
+    /// @return 0 if the point is clear or the zone number + 1 if it falls in a zone.
+    inline unsigned int lookup (const float x, const float y) const
+    {
+        int i = (int)((x + 1.0f) * (0.5f * MASK_GRID_SZ));
+        int j = (int)((y + 1.0f) * (0.5f * MASK_GRID_SZ));
+        i = (i < 0) ? 0 : ((i >= MASK_GRID_SZ) ? MASK_GRID_SZ - 1 : i);
+        j = (j < 0) ? 0 : ((j >= MASK_GRID_SZ) ? MASK_GRID_SZ - 1 : j);
+        const unsigned int idx = j * MASK_GRID_SZ + i;
+        if (bits[idx >> 5] & (1u << (idx & 31))) {
+            return zone[idx];
+        }
+        return 0;
+    }
+    const MaskParams params;
+    /// True if there are no active zones, lets the mask stage skip the lookups.
+    bool empty;
+private:
+    MaskGrid();
+    void rasterise (const MaskZone &z, const unsigned int number);
+    unsigned int bits[MASK_GRID_SZ * MASK_GRID_SZ / 32];
+    unsigned char zone[MASK_GRID_SZ * MASK_GRID_SZ];
+};
+
+typedef boost::shared_ptr<const MaskGrid> MaskGridPtr;
+
+/// \brief Per head beam masking stage.
+/// Blanks any lit point that falls in a zone whatever the content, adding dwell points at
+/// the transitions so the galvos have settled before the beam comes back on.
+/// run() must only be called from the head thread, everything else is safe from anywhere.
+class OutputMask
+{
+public:
+    OutputMask();
+    ~OutputMask();
+    /// \brief Rasterise a new set of zones and swap them in.
+    void setParams (const MaskParams &p);
+    MaskParams getParams () const;
+    /// \brief Mask a run of points.
+    /// @param[in] in is the input points.
+    /// @param[in,out] consumed is the index of the next input point to read and is advanced.
+    /// @param[in] inCount is the number of input points available.
+    /// @param[out] out is where the masked points go.
+    /// @param[in] outCount is the space available in out.
+    /// @return the number of points written to out, which can exceed the points consumed because of dwell.
+    size_t run (const PointF *in, size_t &consumed, const size_t inCount, PointF *out, const size_t outCount);
+    /// @return true if there are dwell points still to be written from a transition.
+    bool pending () const
+    {
+        return pendingDwell != 0;
+    }
+    /// @return the number of lit points blanked by zone since the counters were last reset.
+    unsigned long zoneHits (const unsigned int zone) const;
+    void resetCounters ();
+private:
+    /// Only ever accessed through boost::atomic_load/atomic_store.
+    MaskGridPtr grid;
+    boost::atomic<unsigned long> hits[MAX_MASK_ZONES];
+    // Transition state, carried between calls
+    bool wasMasked;
+    unsigned int pendingDwell;
+    PointF dwellPoint;
+    PointF last;
+};
+
+#endif
@@ -0,0 +1,277 @@
+/* outputwarp.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <QSettings>
+#include <boost/make_shared.hpp>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "outputwarp.h"
+#include "log.h"
+
+// Default corners, bottom left, bottom right, top right, top left
+static const float defaultCornerX[4] = {-1.0f, 1.0f, 1.0f,-1.0f};
+static const float defaultCornerY[4] = {-1.0f,-1.0f, 1.0f, 1.0f};
+
+WarpParams::WarpParams()
+{
+    for (unsigned int i=0; i < 4; i++) {
+        cornerX[i] = defaultCornerX[i];
+        cornerY[i] = defaultCornerY[i];
+    }
+    pincushion = 0.0f;
+    rotation = 0.0f;
+    scaleX = scaleY = 1.0f;
+    offsetX = offsetY = 0.0f;
+}
+
+bool WarpParams::isIdentity() const
+{
+    for (unsigned int i=0; i < 4; i++) {
+        if ((cornerX[i] != defaultCornerX[i]) || (cornerY[i] != defaultCornerY[i])) {
+            return false;
+        }
+    }
+    return (pincushion == 0.0f) && (rotation == 0.0f) &&
+           (scaleX == 1.0f) && (scaleY == 1.0f) &&
+           (offsetX == 0.0f) && (offsetY == 0.0f);
+}
+
+void WarpParams::map(float& x, float& y) const
+{
+    // Mounting angle, scale and offset first
+    const float a = rotation * M_PI / 180.0f;
+    const float ca = cosf(a);
+    const float sa = sinf(a);
+    float tx = scaleX * (x * ca - y * sa) + offsetX;
+    float ty = scaleY * (x * sa + y * ca) + offsetY;
+    // Radial correction
+    const float r2 = tx * tx + ty * ty;
+    tx *= 1.0f + pincushion * r2;
+    ty *= 1.0f + pincushion * r2;
+    // Keystone, this is the projective mapping of the unit square onto the corner
+    // quadrilateral (Heckbert, Fundamentals of Texture Mapping, 1989).
+    const float s = (tx + 1.0f) * 0.5f;
+    const float t = (ty + 1.0f) * 0.5f;
+    const float *qx = cornerX;
+    const float *qy = cornerY;
+    const float sx = qx[0] - qx[1] + qx[2] - qx[3];
+    const float sy = qy[0] - qy[1] + qy[2] - qy[3];
+    float ca_, cb, cc, cd, ce, cf, cg, ch;
+    if ((fabsf(sx) < 1e-6f) && (fabsf(sy) < 1e-6f)) {
+        // Parallelogram, so affine will do
+        ca_ = qx[1] - qx[0];
+        cb = qx[3] - qx[0];
+        cc = qx[0];
+        cd = qy[1] - qy[0];
+        ce = qy[3] - qy[0];
+        cf = qy[0];
+        cg = ch = 0.0f;
+    } else {
+        const float dx1 = qx[1] - qx[2];
+        const float dx2 = qx[3] - qx[2];
+        const float dy1 = qy[1] - qy[2];
+        const float dy2 = qy[3] - qy[2];
+        float det = dx1 * dy2 - dx2 * dy1;
+        if (fabsf(det) < 1e-9f) {
+            // Degenerate quadrilateral, leave the point alone rather then blowing up
+            x = tx;
+            y = ty;
+            return;
+        }
+        cg = (sx * dy2 - dx2 * sy) / det;
+        ch = (dx1 * sy - sx * dy1) / det;
+        ca_ = qx[1] - qx[0] + cg * qx[1];
+        cb = qx[3] - qx[0] + ch * qx[3];
+        cc = qx[0];
+        cd = qy[1] - qy[0] + cg * qy[1];
+        ce = qy[3] - qy[0] + ch * qy[3];
+        cf = qy[0];
+    }
+    const float w = cg * s + ch * t + 1.0f;
+    x = (ca_ * s + cb * t + cc) / w;
+    y = (cd * s + ce * t + cf) / w;
+}
+
+WarpParams WarpParams::load(const QString group)
+{
+    WarpParams p;
+    QSettings settings;
+    settings.beginGroup(group);
+    for (unsigned int i=0; i < 4; i++) {
+        p.cornerX[i] = settings.value(QString().sprintf("Corner%dX",i),defaultCornerX[i]).toFloat();
+        p.cornerY[i] = settings.value(QString().sprintf("Corner%dY",i),defaultCornerY[i]).toFloat();
+    }
+    p.pincushion = settings.value("Pincushion",0.0f).toFloat();
+    p.rotation = settings.value("Rotation",0.0f).toFloat();
+    p.scaleX = settings.value("ScaleX",1.0f).toFloat();
+    p.scaleY = settings.value("ScaleY",1.0f).toFloat();
+    p.offsetX = settings.value("OffsetX",0.0f).toFloat();
+    p.offsetY = settings.value("OffsetY",0.0f).toFloat();
+    settings.endGroup();
+    return p;
+}
+
+void WarpParams::save(const QString group) const
+{
+    QSettings settings;
+    settings.beginGroup(group);
+    for (unsigned int i=0; i < 4; i++) {
+        settings.setValue(QString().sprintf("Corner%dX",i),cornerX[i]);
+        settings.setValue(QString().sprintf("Corner%dY",i),cornerY[i]);
+    }
+    settings.setValue("Pincushion",pincushion);
+    settings.setValue("Rotation",rotation);
+    settings.setValue("ScaleX",scaleX);
+    settings.setValue("ScaleY",scaleY);
+    settings.setValue("OffsetX",offsetX);
+    settings.setValue("OffsetY",offsetY);
+    settings.endGroup();
+}
+
+WarpGrid::WarpGrid(const WarpParams& p) : params(p), identity(p.isIdentity())
+{
+    const unsigned int n = WARP_GRID_SZ + 1;
+    // Map every grid node through the full correction
+    std::vector<float> nx(n * n);
+    std::vector<float> ny(n * n);
+    for (unsigned int j=0; j < n; j++) {
+        for (unsigned int i=0; i < n; i++) {
+            float x = -1.0f + 2.0f * i / WARP_GRID_SZ;
+            float y = -1.0f + 2.0f * j / WARP_GRID_SZ;
+            params.map(x,y);
+            nx[j * n + i] = x;
+            ny[j * n + i] = y;
+        }
+    }
+    // Then turn the nodes into per cell bilinear coefficients, 32 bytes per cell, so with the
+    // grid 64 byte aligned a cell never straddles a cache line.
+    void *mem = NULL;
+    if (posix_memalign(&mem,64,sizeof(float) * 8 * WARP_GRID_SZ * WARP_GRID_SZ)) {
+        mem = NULL;
+    }
+    assert (mem);
+    coeffs = (float *) mem;
+    for (unsigned int j=0; j < WARP_GRID_SZ; j++) {
+        for (unsigned int i=0; i < WARP_GRID_SZ; i++) {
+            const unsigned int p00 = j * n + i;
+            const unsigned int p10 = p00 + 1;
+            const unsigned int p01 = p00 + n;
+            const unsigned int p11 = p01 + 1;
+            float *c = coeffs + 8 * (j * WARP_GRID_SZ + i);
+            c[0] = nx[p00];
+            c[1] = ny[p00];
+            c[2] = nx[p10] - nx[p00];
+            c[3] = ny[p10] - ny[p00];
+            c[4] = nx[p01] - nx[p00];
+            c[5] = ny[p01] - ny[p00];
+            c[6] = nx[p11] - nx[p10] - nx[p01] + nx[p00];
+            c[7] = ny[p11] - ny[p10] - ny[p01] + ny[p00];
+        }
+    }
+}
+
+WarpGrid::~WarpGrid()
+{
+    free (coeffs);
+    coeffs = NULL;
+}
+
+void WarpGrid::run(PointF* pts, size_t count) const
+{
+    if (identity) {
+        return;
+    }
+    const float half = 0.5f * WARP_GRID_SZ;
+    for (size_t k=0; k < count; k++) {
+        PointF &p = pts[k];
+        // Cell coordinates, points outside the unit square extrapolate from the edge cells
+        const float gx = (p.x + 1.0f) * half;
+        const float gy = (p.y + 1.0f) * half;
+        int i = (int) floorf(gx);
+        int j = (int) floorf(gy);
+        if (i < 0) {
+            i = 0;
+        } else if (i >= WARP_GRID_SZ) {
+            i = WARP_GRID_SZ - 1;
+        }
+        if (j < 0) {
+            j = 0;
+        } else if (j >= WARP_GRID_SZ) {
+            j = WARP_GRID_SZ - 1;
+        }
+        const float u = gx - i;
+        const float v = gy - j;
+        const float *c = coeffs + 8 * (j * WARP_GRID_SZ + i);
+#ifdef __SSE__
+        // {ax,ay,bx,by} * {1,1,u,u} + {cx,cy,dx,dy} * {v,v,uv,uv} then fold the halves together
+        const __m128 lo = _mm_load_ps(c);
+        const __m128 hi = _mm_load_ps(c + 4);
+        const __m128 wlo = _mm_set_ps(u, u, 1.0f, 1.0f);
+        const __m128 whi = _mm_set_ps(u * v, u * v, v, v);
+        __m128 r = _mm_add_ps(_mm_mul_ps(lo,wlo),_mm_mul_ps(hi,whi));
+        r = _mm_add_ps(r,_mm_movehl_ps(r,r));
+        float out[4] __attribute__ ((aligned (16)));
+        _mm_store_ps(out,r);
+        p.x = out[0];
+        p.y = out[1];
+#else
+        p.x = c[0] + c[2] * u + c[4] * v + c[6] * u * v;
+        p.y = c[1] + c[3] * u + c[5] * v + c[7] * u * v;
+#endif
+    }
+}
+
+OutputWarp::OutputWarp()
+{
+    grid = boost::make_shared<const WarpGrid>(WarpParams());
+}
+
+OutputWarp::~OutputWarp()
+{
+}
+
+void OutputWarp::setParams(const WarpParams& p)
+{
+    WarpGridPtr g = boost::make_shared<const WarpGrid>(p);
+    boost::atomic_store(&grid,g);
+    slog()->infoStream() << "Output warp updated " << this << (g->identity ? " (identity)" : "");
+}
+
+WarpParams OutputWarp::getParams() const
+{
+    WarpGridPtr g = boost::atomic_load(&grid);
+    return g->params;
+}
+
+void OutputWarp::run(PointF* pts, size_t count) const
+{
+    WarpGridPtr g = boost::atomic_load(&grid);
+    g->run(pts,count);
+}
+
+void OutputWarp::run(std::vector< PointF >& pts) const
+{
+    if (pts.size()) {
+        run(&pts[0],pts.size());
+    }
+}
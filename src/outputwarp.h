@@ -0,0 +1,104 @@
+/* outputwarp.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef OUTPUT_WARP_INCL
+#define OUTPUT_WARP_INCL
+
+#include <vector>
+#include <QString>
+#include <boost/shared_ptr.hpp>
+#include "driver.h"
+
+/// Number of cells along each side of the warp grid.
+#define WARP_GRID_SZ (32)
+
+/// \brief The user facing description of the geometric correction for one projector head.
+/// All coordinates are in the usual -1 to +1 output space.
+class WarpParams
+{
+public:
+    WarpParams();
+    /// Where the corners of the output square should land after keystone correction,
+    /// in the order bottom left, bottom right, top right, top left.
+    float cornerX[4];
+    float cornerY[4];
+    /// Radial correction, positive values correct pincushion, negative values barrel distortion.
+    float pincushion;
+    /// Mounting angle correction in degrees, anticlockwise.
+    float rotation;
+    float scaleX;
+    float scaleY;
+    float offsetX;
+    float offsetY;
+    /// @return true if these parameters leave the output unchanged.
+    bool isIdentity() const;
+    /// \brief Map a single point through the full (slow) correction.
+    /// This is what the grid is precomputed from.
+    void map (float &x, float &y) const;
+    /// \brief Load the parameters from the QSettings group given.
+    static WarpParams load (const QString group);
+    /// \brief Store the parameters to the QSettings group given.
+    void save (const QString group) const;
+};
+
+/// \brief A precomputed bilinear warp grid.
+/// Each cell holds the four bilinear coefficients for x and y packed together so that
+/// a point lookup touches exactly one 32 byte run of memory. The whole grid is 32k so it
+/// lives happily in L1/L2 while a head is running.
+/// Grids are immutable once built, a new grid is built and swapped in to change the warp.
+class WarpGrid
+{
+public:
+    WarpGrid (const WarpParams &p);
+    ~WarpGrid();
+    /// \brief Apply the warp to a run of points in place.
+    void run (PointF *pts, size_t count) const;
+    /// The parameters this grid was built from.
+    const WarpParams params;
+    /// True if the grid would leave every point unchanged.
+    const bool identity;
+private:
+    WarpGrid();
+    /// Coefficients are stored per cell as {ax,ay,bx,by,cx,cy,dx,dy} where
+    /// x' = ax + bx*u + cx*v + dx*u*v (and likewise for y), u and v are the fractional position within the cell.
+    float *coeffs;
+};
+
+typedef boost::shared_ptr<const WarpGrid> WarpGridPtr;
+
+/// \brief Per head output warp stage.
+/// The grid may be replaced at any time from any thread, the output pipeline picks
+/// the new one up at the next call to run.
+class OutputWarp
+{
+public:
+    OutputWarp();
+    ~OutputWarp();
+    /// \brief Build a new grid from p and swap it in.
+    /// This does the expensive bit in the calling thread, not in the head.
+    void setParams (const WarpParams &p);
+    WarpParams getParams () const;
+    /// \brief Warp the points in place, does nothing if no correction is set.
+    void run (std::vector<PointF> &pts) const;
+    void run (PointF *pts, size_t count) const;
+private:
+    /// Only ever accessed through boost::atomic_load/atomic_store.
+    WarpGridPtr grid;
+};
+
+#endif
@@ -0,0 +1,183 @@
+/* pointring.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <string.h>
+#include <assert.h>
+
+#include "pointring.h"
+#include "driver.h"
+
+PointRing::PointRing(const size_t size)
+{
+    size_ = 1;
+    while (size_ < size) {
+        size_ <<= 1;
+    }
+    mask = size_ - 1;
+    buffer = new PointF[size_];
+    memset(buffer,0,sizeof(PointF) * size_);
+    writePos.store(0);
+    readPos.store(0);
+    underrunCount.store(0);
+    underrunPts.store(0);
+}
+
+PointRing::~PointRing()
+{
+    delete[] buffer;
+    buffer = NULL;
+}
+
+size_t PointRing::capacity() const
+{
+    return size_;
+}
+
+size_t PointRing::writeSpace() const
+{
+    const size_t w = writePos.load(boost::memory_order_relaxed);
+    const size_t r = readPos.load(boost::memory_order_acquire);
+    return size_ - (w - r);
+}
+
+size_t PointRing::write(const PointF* pts, const size_t count)
+{
+    const size_t w = writePos.load(boost::memory_order_relaxed);
+    const size_t r = readPos.load(boost::memory_order_acquire);
+    size_t n = size_ - (w - r);
+    if (n > count) {
+        n = count;
+    }
+    // At most two contiguous runs either side of the wrap
+    const size_t start = w & mask;
+    const size_t first = (n < size_ - start) ? n : size_ - start;
+    memcpy(buffer + start,pts,first * sizeof(PointF));
+    if (n > first) {
+        memcpy(buffer,pts + first,(n - first) * sizeof(PointF));
+    }
+    writePos.store(w + n,boost::memory_order_release);
+    return n;
+}
+
+size_t PointRing::writeRegion(PointF** region, const size_t wanted)
+{
+    const size_t w = writePos.load(boost::memory_order_relaxed);
+    const size_t r = readPos.load(boost::memory_order_acquire);
+    size_t n = size_ - (w - r);
+    const size_t start = w & mask;
+    if (n > size_ - start) {
+        n = size_ - start;
+    }
+    if (n > wanted) {
+        n = wanted;
+    }
+    *region = buffer + start;
+    return n;
+}
+
+void PointRing::commitWrite(const size_t count)
+{
+    const size_t w = writePos.load(boost::memory_order_relaxed);
+    assert (count <= size_ - (w - readPos.load(boost::memory_order_acquire)));
+    writePos.store(w + count,boost::memory_order_release);
+}
+
+size_t PointRing::readAvailable() const
+{
+    const size_t w = writePos.load(boost::memory_order_acquire);
+    const size_t r = readPos.load(boost::memory_order_relaxed);
+    return w - r;
+}
+
+size_t PointRing::read(PointF* pts, const size_t count)
+{
+    const size_t w = writePos.load(boost::memory_order_acquire);
+    const size_t r = readPos.load(boost::memory_order_relaxed);
+    size_t n = w - r;
+    if (n > count) {
+        n = count;
+    }
+    const size_t start = r & mask;
+    const size_t first = (n < size_ - start) ? n : size_ - start;
+    memcpy(pts,buffer + start,first * sizeof(PointF));
+    if (n > first) {
+        memcpy(pts + first,buffer,(n - first) * sizeof(PointF));
+    }
+    readPos.store(r + n,boost::memory_order_release);
+    return n;
+}
+
+size_t PointRing::readRegion(const PointF** region, const size_t wanted)
+{
+    const size_t w = writePos.load(boost::memory_order_acquire);
+    const size_t r = readPos.load(boost::memory_order_relaxed);
+    size_t n = w - r;
+    const size_t start = r & mask;
+    if (n > size_ - start) {
+        n = size_ - start;
+    }
+    if (n > wanted) {
+        n = wanted;
+    }
+    *region = buffer + start;
+    return n;
+}
+
+void PointRing::commitRead(const size_t count)
+{
+    const size_t r = readPos.load(boost::memory_order_relaxed);
+    assert (count <= writePos.load(boost::memory_order_acquire) - r);
+    readPos.store(r + count,boost::memory_order_release);
+}
+
+size_t PointRing::discard(const size_t count)
+{
+    const size_t w = writePos.load(boost::memory_order_acquire);
+    const size_t r = readPos.load(boost::memory_order_relaxed);
+    size_t n = w - r;
+    if (n > count) {
+        n = count;
+    }
+    readPos.store(r + n,boost::memory_order_release);
+    return n;
+}
+
+void PointRing::noteUnderrun(const size_t missing)
+{
+    underrunCount.fetch_add(1,boost::memory_order_relaxed);
+    underrunPts.fetch_add(missing,boost::memory_order_relaxed);
+}
+
+size_t PointRing::occupancy() const
+{
+    // Both positions only ever advance, so reading the older one first means the
+    // difference can never go negative whatever the other two threads are doing.
+    const size_t r = readPos.load(boost::memory_order_acquire);
+    const size_t w = writePos.load(boost::memory_order_acquire);
+    return w - r;
+}
+
+unsigned long PointRing::underruns() const
+{
+    return underrunCount.load(boost::memory_order_relaxed);
+}
+
+unsigned long PointRing::underrunPoints() const
+{
+    return underrunPts.load(boost::memory_order_relaxed);
+}
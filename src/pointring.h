@@ -0,0 +1,104 @@
+/* pointring.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef POINT_RING_INCL
+#define POINT_RING_INCL
+
+#include <stddef.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+
+class PointF;
+
+/// \brief A lock free single producer, single consumer ring of output points.
+///
+/// This is the only thing shared between a laser head and the driver realtime callback.
+/// Exactly one thread (the head) may call the producer methods and exactly one thread
+/// (the driver callback) may call the consumer methods, the statistics may be read from anywhere.
+///
+/// The read and write positions are free running counters, the capacity is always a power of
+/// two so wrapping is just a mask. The producer publishes points with a release store of the
+/// write position after copying them in, the consumer does likewise with the read position,
+/// so neither side ever sees a slot the other is still working on and no locks are needed.
+/// Nothing here allocates or blocks, so it is safe to call from a soundcard or JACK callback.
+class PointRing
+{
+public:
+    /// @param[in] size is the minimum capacity in points, it is rounded up to a power of two.
+    PointRing (const size_t size);
+    ~PointRing();
+    size_t capacity () const;
+
+    /// Producer side.
+    /// @return the number of points that can currently be written.
+    size_t writeSpace () const;
+    /// \brief Copy up to count points into the ring.
+    /// @return the number of points actually written.
+    size_t write (const PointF *pts, const size_t count);
+    /// \brief Get a contiguous writable region of the ring without copying anything.
+    /// @param[out] region is set to the first free slot.
+    /// @param[in] wanted is the most points the caller wants to write.
+    /// @return the number of points that may be written at region, this stops at the wrap
+    /// so may be less then the free space, call again after commitWrite for the rest.
+    size_t writeRegion (PointF **region, const size_t wanted);
+    /// \brief Publish count points written into the region returned by writeRegion.
+    void commitWrite (const size_t count);
+
+    /// Consumer side.
+    /// @return the number of points that can currently be read.
+    size_t readAvailable () const;
+    /// \brief Copy up to count points out of the ring.
+    /// @return the number of points actually read.
+    size_t read (PointF *pts, const size_t count);
+    /// \brief Get a contiguous readable region of the ring without copying anything.
+    /// @param[out] region is set to the oldest queued point.
+    /// @param[in] wanted is the most points the caller wants.
+    /// @return the number of points readable at region, this stops at the wrap.
+    size_t readRegion (const PointF **region, const size_t wanted);
+    /// \brief Release count points from the region returned by readRegion back to the producer.
+    void commitRead (const size_t count);
+    /// \brief Drop up to count points without copying them anywhere.
+    size_t discard (const size_t count);
+    /// \brief Record that the consumer needed missing points it did not have.
+    void noteUnderrun (const size_t missing);
+
+    /// Statistics, safe from any thread.
+    /// @return the number of points currently queued.
+    size_t occupancy () const;
+    /// @return the number of callbacks that ran out of points.
+    unsigned long underruns () const;
+    /// @return the total number of points the consumer was short by.
+    unsigned long underrunPoints () const;
+private:
+    PointRing();
+    PointF *buffer;
+    size_t size_;
+    size_t mask;
+    // Written by the producer only, kept apart from the consumer position to avoid false sharing.
+    boost::atomic<size_t> writePos;
+    char pad0[64];
+    // Written by the consumer only.
+    boost::atomic<size_t> readPos;
+    char pad1[64];
+    boost::atomic<unsigned long> underrunCount;
+    boost::atomic<unsigned long> underrunPts;
+};
+
+typedef boost::shared_ptr<PointRing> PointRingPtr;
+
+#endif
@@ -56,9 +56,9 @@ void Resample::set_resampler()
     resampler.setup(input_pps/divisor,output_pps/divisor,5,16);
 }
 
-std::vector<PointF> Resample::run(std::vector<Point>& input)
+void Resample::run(std::vector<Point>& input, std::vector<PointF> &res)
 {
-    std::vector<PointF> res;
+    res.clear();
     size_t remaining_input = input.size();
     unsigned int block_num = 0;
     res.reserve(input.size() * output_pps / input_pps);
@@ -69,7 +69,7 @@ std::vector<PointF> Resample::run(std::vector<Point>& input)
         }
         remaining_input -= block;
         if (block == 0) {
-            return res;
+            return;
         }
         for (unsigned int i=0; i < block; i++) {
             Point &p = input[i + RESAMPLE_SZ * block_num];
@@ -106,5 +106,4 @@ std::vector<PointF> Resample::run(std::vector<Point>& input)
             resampler.out_data = output_buffer;
         }
     } while (1);
-    return res;
 }
@@ -32,7 +32,10 @@ public:
 
     /// Note this converts from Points to PointF structures as the colour
     /// data may no longer match exact values due to the resampling.
-    std::vector<PointF> run (std::vector<Point> &input);
+    /// @param[in] input is the frame to resample.
+    /// @param[out] res is cleared and filled with the output, passing the same vector each
+    /// time lets it keep its allocation from frame to frame.
+    void run (std::vector<Point> &input, std::vector<PointF> &res);
 private:
     Resampler resampler;
     unsigned int input_pps;
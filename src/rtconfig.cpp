@@ -0,0 +1,302 @@
+/* rtconfig.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "rtconfig.h"
+
+#include <algorithm>
+#include <QtCore>
+#include <string.h>
+#include <stdlib.h>
+#include "log.h"
+#if __unix
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <alloca.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/// Page size used for touching memory, smaller then any real page is harmless.
+#define RT_PAGE (4096)
+
+static QMutex reportLock;
+static std::vector<RTThreadReport> reports;
+static bool memoryLocked = false;
+static size_t heapPrefaulted = 0;
+#if __unix
+/// The CPUs we were started on, what a thread with no list of its own goes back to.
+static cpu_set_t processCPUs;
+static bool haveProcessCPUs = false;
+#endif
+
+static int defaultPriority(const QString role)
+{
+    if (role == "Engine") {
+        return 30;
+    } else if (role == "Head") {
+        return 20;
+    } else if (role == "Watchdog") {
+        return 40;
+    }
+    return 0;
+}
+
+std::vector<int> RTConfig::parseCPUs(const QString s)
+{
+    std::vector<int> res;
+    QStringList parts = s.split(",",QString::SkipEmptyParts);
+    for (int i=0; i < parts.size(); i++) {
+        QStringList range = parts[i].trimmed().split("-");
+        bool ok1 = false;
+        bool ok2 = true;
+        const int first = range[0].toInt(&ok1);
+        const int last = (range.size() > 1) ? range[1].toInt(&ok2) : first;
+        if (!ok1 || !ok2 || first < 0 || last < first) {
+            slog()->errorStream() << "Ignoring bad CPU list entry '" << parts[i].toStdString() << "'";
+            continue;
+        }
+        for (int c = first; c <= last; c++) {
+            res.push_back(c);
+        }
+    }
+    return res;
+}
+
+/// \brief The CPUs for a role with no list set.
+/// Threads inherit their creator's affinity, so this has to be set explicitly or everything
+/// started from a pinned GUI thread would end up on the GUI's CPUs. The engine and the heads
+/// keep off the GUI's CPUs unless that leaves them nowhere to run.
+static std::vector<int> defaultCPUs(const QString role, const std::vector<int> &gui)
+{
+    std::vector<int> all;
+#if __unix
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int c=0; c < CPU_SETSIZE; c++) {
+        if (haveProcessCPUs ? CPU_ISSET(c,&processCPUs) : (c < online)) {
+            all.push_back(c);
+        }
+    }
+#endif
+    if ((role != "Engine") && (role != "Head")) {
+        return all;
+    }
+    std::vector<int> res;
+    for (unsigned int i=0; i < all.size(); i++) {
+        if (std::find(gui.begin(),gui.end(),all[i]) == gui.end()) {
+            res.push_back(all[i]);
+        }
+    }
+    return res.empty() ? all : res;
+}
+
+QString RTConfig::cpuList(const std::vector<int>& cpus)
+{
+    QStringList l;
+    for (unsigned int i=0; i < cpus.size(); i++) {
+        l << QString::number(cpus[i]);
+    }
+    return l.isEmpty() ? QString("any") : l.join(",");
+}
+
+void RTConfig::setupProcess()
+{
+#if __unix
+    if (!sched_getaffinity(0,sizeof(processCPUs),&processCPUs)) {
+        haveProcessCPUs = true;
+    }
+    QSettings settings;
+    settings.beginGroup("Engine/Realtime");
+    bool lock = settings.value("Lock memory",false).toBool();
+    const size_t heapMB = settings.value("Prefault heap MB",16).toUInt();
+    settings.endGroup();
+    if (lock) {
+        // Every later mapping gets locked too, under a finite limit that ends in failed allocations
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_MEMLOCK,&rl) || (rl.rlim_cur != RLIM_INFINITY)) {
+            slog()->errorStream() << "Not locking memory, RLIMIT_MEMLOCK is not unlimited";
+            lock = false;
+        }
+    }
+    if (lock) {
+        if (mlockall(MCL_CURRENT)) {
+            slog()->errorStream() << "Failed to lock current memory :" << strerror(errno);
+        } else {
+            memoryLocked = true;
+#ifdef MCL_ONFAULT
+            // Later mappings only as they are touched, a mapped binary show would otherwise
+            // be read whole the moment it was opened
+            const int flags = MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT;
+#else
+            const int flags = MCL_CURRENT | MCL_FUTURE;
+#endif
+            if (mlockall(flags)) {
+                slog()->errorStream() << "Failed to lock future memory :" << strerror(errno);
+            }
+        }
+    }
+    if (!memoryLocked) {
+        // Prefaulting pages that can be paged out again buys nothing
+        return;
+    }
+#ifdef __GLIBC__
+    // Keep freed memory in the process, and big allocations off mmap, so the prefaulted
+    // heap is what later allocations actually get
+    mallopt(M_TRIM_THRESHOLD,-1);
+    mallopt(M_MMAP_MAX,0);
+#endif
+    if (heapMB) {
+        const size_t bytes = heapMB * 1048576;
+        char *p = (char *) malloc(bytes);
+        if (p) {
+            for (size_t i=0; i < bytes; i += RT_PAGE) {
+                p[i] = 0;
+            }
+            free(p);
+            heapPrefaulted = bytes;
+        }
+    }
+#endif
+}
+
+bool RTConfig::setupThread(const QString role, const int index)
+{
+    QSettings settings;
+    settings.beginGroup("Engine/Realtime");
+    const int priority = settings.value(role + " priority",defaultPriority(role)).toInt();
+    QString cpus = settings.value(role + " CPUs",QString("")).toString();
+    if (index >= 0) {
+        cpus = settings.value(QString().sprintf("%s %d CPUs",role.toStdString().c_str(),index + 1),cpus).toString();
+    }
+    const QString guiCPUs = settings.value("GUI CPUs",QString("")).toString();
+    const size_t stackKB = settings.value("Prefault stack KB",256).toUInt();
+    settings.endGroup();
+
+    RTThreadReport r;
+    r.name = (index >= 0) ? QString().sprintf("%s %d",role.toStdString().c_str(),index + 1) : role;
+    r.priorityWanted = priority;
+    r.priorityGot = 0;
+    r.stackPrefaulted = 0;
+    bool ok = true;
+#if __unix
+    pthread_t tid = pthread_self();
+    if (priority > 0) {
+        struct sched_param sp;
+        sp.sched_priority = priority;
+        const int err = pthread_setschedparam(tid,SCHED_FIFO,&sp);
+        if (err) {
+            slog()->errorStream() << "Failed to set RT scheduling for " << r.name.toStdString() << " thread :" << strerror(err);
+            ok = false;
+        }
+    }
+    int policy;
+    struct sched_param sp;
+    if (!pthread_getschedparam(tid,&policy,&sp) && (policy == SCHED_FIFO || policy == SCHED_RR)) {
+        r.priorityGot = sp.sched_priority;
+    }
+    std::vector<int> wanted = parseCPUs(cpus);
+    r.cpusWanted = cpuList(wanted);
+    if (wanted.empty()) {
+        wanted = defaultCPUs(role,parseCPUs(guiCPUs));
+    }
+    if (!wanted.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned int i=0; i < wanted.size(); i++) {
+            if (wanted[i] < CPU_SETSIZE) {
+                CPU_SET(wanted[i],&set);
+            }
+        }
+        const int err = pthread_setaffinity_np(tid,sizeof(set),&set);
+        if (err) {
+            slog()->errorStream() << "Failed to pin " << r.name.toStdString() << " thread to CPUs " << r.cpusWanted.toStdString() << " :" << strerror(err);
+            ok = false;
+        }
+    }
+    cpu_set_t got;
+    CPU_ZERO(&got);
+    std::vector<int> granted;
+    if (!pthread_getaffinity_np(tid,sizeof(got),&got)) {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        if (CPU_COUNT(&got) < online) {
+            for (int c=0; c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c,&got)) {
+                    granted.push_back(c);
+                }
+            }
+        }
+    }
+    r.cpusGot = cpuList(granted);
+    if (stackKB) {
+        // Touch the stack now so the first deep call in the real time loop does not page fault
+        const size_t bytes = stackKB * 1024;
+        volatile char *p = (volatile char *) alloca(bytes);
+        for (size_t i=0; i < bytes; i += RT_PAGE) {
+            p[i] = 0;
+        }
+        r.stackPrefaulted = bytes;
+    }
+#else
+    ok = (priority == 0) && cpus.isEmpty();
+#endif
+    slog()->infoStream() << "Thread " << r.name.toStdString() << ": priority " << r.priorityGot << " (wanted " << r.priorityWanted
+                         << "), CPUs " << r.cpusGot.toStdString() << " (wanted " << r.cpusWanted.toStdString() << ")";
+    QMutexLocker l(&reportLock);
+    reports.push_back(r);
+    return ok;
+}
+
+std::vector<RTThreadReport> RTConfig::threads()
+{
+    QMutexLocker l(&reportLock);
+    return reports;
+}
+
+void RTConfig::report()
+{
+#if __unix
+    struct rlimit rl;
+    std::string rtprio = "unknown";
+    if (!getrlimit(RLIMIT_RTPRIO,&rl)) {
+        rtprio = (rl.rlim_cur == RLIM_INFINITY) ? std::string("unlimited") : QString::number((qulonglong) rl.rlim_cur).toStdString();
+    }
+    std::string memlock = "unknown";
+    if (!getrlimit(RLIMIT_MEMLOCK,&rl)) {
+        memlock = (rl.rlim_cur == RLIM_INFINITY) ? std::string("unlimited") : QString::number((qulonglong) rl.rlim_cur / 1024).toStdString() + "KB";
+    }
+    slog()->infoStream() << "Realtime: memory " << (memoryLocked ? "locked" : "NOT locked") << ", " << heapPrefaulted / 1048576
+                         << "MB heap prefaulted, " << sysconf(_SC_NPROCESSORS_ONLN) << " CPUs, rtprio limit " << rtprio
+                         << ", memlock limit " << memlock;
+#endif
+    std::vector<RTThreadReport> t = threads();
+    bool short_ = false;
+    for (unsigned int i=0; i < t.size(); i++) {
+        slog()->infoStream() << "Realtime: " << t[i].name.toStdString() << " priority " << t[i].priorityGot << "/" << t[i].priorityWanted
+                             << ", CPUs " << t[i].cpusGot.toStdString() << "/" << t[i].cpusWanted.toStdString()
+                             << ", " << t[i].stackPrefaulted / 1024 << "KB stack prefaulted";
+        if (t[i].priorityGot != t[i].priorityWanted) {
+            short_ = true;
+        }
+    }
+    if (short_) {
+        slog()->errorStream() << "Realtime: some threads did not get the priority asked for, check the rtprio limit for this user";
+    }
+}
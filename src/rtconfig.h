@@ -0,0 +1,70 @@
+/* rtconfig.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RTCONFIG_INCL
+#define RTCONFIG_INCL
+
+#include <vector>
+#include <QString>
+
+/// Real time configuration of the process and its threads.
+
+/// Everything comes from the Engine/Realtime settings group:
+/// Lock memory (mlockall, default false), Prefault heap MB (default 16) and Prefault stack KB
+/// (default 256) for the process, then for each thread role (GUI, Engine, Head, Watchdog)
+/// "<role> priority" (SCHED_FIFO priority, 0 for the normal scheduler) and "<role> CPUs", a
+/// list like "2,3" or "1-3" to pin the thread to. Empty means any CPU the process may use,
+/// except that the Engine and Head threads keep off the GUI's CPUs. The heads are refilled by
+/// the head scheduler's workers, which may also be pinned individually with "Head N CPUs". The usual setup on a show laptop is to keep the GUI and
+/// the interrupt handlers on CPU 0 and give the heads the rest.
+/// Locking also locks everything mapped later, so it is only done when RLIMIT_MEMLOCK is
+/// unlimited (root, or a memlock entry in limits.conf) and the heap is only prefaulted and
+/// kept when it is.
+
+/// \brief What a thread asked for and what it actually got.
+class RTThreadReport
+{
+public:
+    QString name;
+    int priorityWanted;
+    int priorityGot;
+    QString cpusWanted;
+    QString cpusGot;
+    size_t stackPrefaulted;
+};
+
+class RTConfig
+{
+public:
+    /// \brief Lock and prefault memory, call once from main before the engine starts.
+    static void setupProcess ();
+    /// \brief Apply the scheduling and affinity settings to the calling thread.
+    /// @param[in] role is GUI, Engine, Head or Watchdog.
+    /// @param[in] index is the head scheduler worker number from 0, or -1 for the other roles.
+    /// @return true if everything asked for was granted.
+    static bool setupThread (const QString role, const int index = -1);
+    /// \brief Log what was asked for and what was granted so far.
+    static void report ();
+    /// @return the per thread results so far.
+    static std::vector<RTThreadReport> threads ();
+private:
+    static std::vector<int> parseCPUs (const QString s);
+    static QString cpuList (const std::vector<int> &cpus);
+};
+
+#endif
@@ -0,0 +1,359 @@
+/* showcodec.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "showcodec.h"
+
+#include <iomanip>
+#include <boost/make_shared.hpp>
+#include "gzipwriter.h"
+#include "qtiocompressor.h"
+#include "log.h"
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/// Bytes handed to a writer or asked of a reader at a time by the benchmark.
+#define CODEC_BLOCK (1024 * 1024)
+
+ShowStreamWriter::~ShowStreamWriter()
+{
+}
+
+#ifdef HAVE_ZSTD
+
+/// \brief Zstandard compression, on as many of zstd's own worker threads as we have cores.
+class ZstdWriter : public ShowStreamWriter
+{
+public:
+    ZstdWriter (QIODevice *out_, const int level) {
+        out = out_;
+        error = false;
+        ctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(ctx,ZSTD_c_compressionLevel,level);
+        ZSTD_CCtx_setParameter(ctx,ZSTD_c_checksumFlag,1);
+        // Fails harmlessly on a library built without threads, it then compresses inline
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx,ZSTD_c_nbWorkers,QThread::idealThreadCount()))) {
+            slog()->debugStream() << "Zstd has no worker threads, compressing in the saver";
+        }
+        buffer.resize(ZSTD_CStreamOutSize());
+    }
+    ~ZstdWriter () {
+        ZSTD_freeCCtx(ctx);
+    }
+    bool write (const QByteArray data) {
+        ZSTD_inBuffer in = {data.constData(),(size_t) data.size(),0};
+        while (!error && (in.pos < in.size)) {
+            compress(&in,ZSTD_e_continue);
+        }
+        return !error;
+    }
+    bool finish () {
+        ZSTD_inBuffer in = {NULL,0,0};
+        while (!error && compress(&in,ZSTD_e_end)) {
+        }
+        return !error;
+    }
+    QString errorString () const {
+        return errorString_;
+    }
+private:
+    /// @return what zstd still has to flush.
+    size_t compress (ZSTD_inBuffer *in, const ZSTD_EndDirective mode) {
+        ZSTD_outBuffer o = {buffer.data(),(size_t) buffer.size(),0};
+        const size_t remaining = ZSTD_compressStream2(ctx,&o,in,mode);
+        if (ZSTD_isError(remaining)) {
+            error = true;
+            errorString_ = ZSTD_getErrorName(remaining);
+            slog()->errorStream() << "Compression failed : " << errorString_.toStdString();
+            return 0;
+        }
+        if (o.pos && (out->write(buffer.constData(),o.pos) != (qint64) o.pos)) {
+            error = true;
+            errorString_ = out->errorString();
+            slog()->errorStream() << "Compressed write failed : " << errorString_.toStdString();
+        }
+        return remaining;
+    }
+    QIODevice *out;
+    ZSTD_CCtx *ctx;
+    QByteArray buffer;
+    bool error;
+    QString errorString_;
+};
+
+/// \brief A read only device inflating a Zstandard stream, the counterpart of QtIOCompressor.
+class ZstdReader : public QIODevice
+{
+public:
+    ZstdReader (QIODevice *in_) {
+        in = in_;
+        ctx = ZSTD_createDCtx();
+        buffer.resize(ZSTD_DStreamInSize());
+        input.src = NULL;
+        input.size = 0;
+        input.pos = 0;
+        pending = 0;
+    }
+    ~ZstdReader () {
+        close();
+        ZSTD_freeDCtx(ctx);
+    }
+    bool isSequential () const {
+        return true;
+    }
+    bool open (OpenMode mode) {
+        if (mode != QIODevice::ReadOnly) {
+            setErrorString("Zstd streams can only be read");
+            return false;
+        }
+        if (!in->isOpen() && !in->open(QIODevice::ReadOnly)) {
+            setErrorString(in->errorString());
+            return false;
+        }
+        return QIODevice::open(mode);
+    }
+    void close () {
+        if (isOpen()) {
+            QIODevice::close();
+            in->close();
+        }
+    }
+protected:
+    qint64 readData (char *data, qint64 maxSize) {
+        ZSTD_outBuffer o = {data,(size_t) maxSize,0};
+        while (o.pos == 0) {
+            if (input.pos == input.size) {
+                const qint64 got = in->read(buffer.data(),buffer.size());
+                if (got < 0) {
+                    setErrorString(in->errorString());
+                    return -1;
+                }
+                if (got == 0) {
+                    if (pending) {
+                        setErrorString("Truncated zstd stream");
+                        return -1;
+                    }
+                    return 0;
+                }
+                input.src = buffer.constData();
+                input.size = got;
+                input.pos = 0;
+            }
+            pending = ZSTD_decompressStream(ctx,&o,&input);
+            if (ZSTD_isError(pending)) {
+                setErrorString(ZSTD_getErrorName(pending));
+                slog()->errorStream() << "Decompression failed : " << ZSTD_getErrorName(pending);
+                return -1;
+            }
+        }
+        return o.pos;
+    }
+    qint64 writeData (const char *, qint64) {
+        return -1;
+    }
+private:
+    QIODevice *in;
+    ZSTD_DCtx *ctx;
+    QByteArray buffer;
+    ZSTD_inBuffer input;
+    /// Non zero while zstd is part way through a frame
+    size_t pending;
+};
+
+#endif
+
+/// \brief The gzip writer, as it was before there was a choice.
+class GzipWriter : public ShowStreamWriter
+{
+public:
+    GzipWriter (QIODevice *out, const int level) : z(out,level) {
+    }
+    bool write (const QByteArray data) {
+        return z.write(data);
+    }
+    bool finish () {
+        return z.finish();
+    }
+    QString errorString () const {
+        return z.errorString();
+    }
+private:
+    ParallelGzipWriter z;
+};
+
+ShowCodec::Codec ShowCodec::detect(const QString filename)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return GZIP;
+    }
+    const QByteArray magic = f.read(4);
+    f.close();
+    // Zstandard frames start 28 b5 2f fd, gzip members 1f 8b
+    if (magic == QByteArray("\x28\xb5\x2f\xfd",4)) {
+        return ZSTD;
+    }
+    return GZIP;
+}
+
+ShowCodec::Codec ShowCodec::fromName(const QString name)
+{
+    std::vector<Codec> c = available();
+    for (unsigned int i=0; i < c.size(); i++) {
+        if (name.compare(ShowCodec::name(c[i]),Qt::CaseInsensitive) == 0) {
+            return c[i];
+        }
+    }
+    slog()->errorStream() << "Codec " << name.toStdString() << " is not available, using gzip";
+    return GZIP;
+}
+
+QString ShowCodec::name(const Codec c)
+{
+    switch (c) {
+    case ZSTD:
+        return QString("zstd");
+    case GZIP:
+    default:
+        return QString("gzip");
+    }
+}
+
+std::vector<ShowCodec::Codec> ShowCodec::available()
+{
+    std::vector<Codec> c;
+    c.push_back(GZIP);
+#ifdef HAVE_ZSTD
+    c.push_back(ZSTD);
+#endif
+    return c;
+}
+
+int ShowCodec::level(const Codec c)
+{
+    QSettings settings;
+    settings.beginGroup("Engine/Saving");
+    if (c == ZSTD) {
+        return settings.value("Zstd level",3).toInt();
+    }
+    return settings.value("Compression level",6).toInt();
+}
+
+ShowStreamWriterPtr ShowCodec::writer(const Codec c, QIODevice* out, const int level)
+{
+#ifdef HAVE_ZSTD
+    if (c == ZSTD) {
+        return boost::make_shared<ZstdWriter>(out,level);
+    }
+#endif
+    return boost::make_shared<GzipWriter>(out,level);
+}
+
+QIODevice * ShowCodec::reader(const Codec c, QIODevice* in)
+{
+    QIODevice *d = NULL;
+#ifdef HAVE_ZSTD
+    if (c == ZSTD) {
+        d = new ZstdReader(in);
+    }
+#endif
+    if (!d) {
+        QtIOCompressor *z = new QtIOCompressor(in,6,10 * 1024 * 1024);
+        z->setStreamFormat(QtIOCompressor::GzipFormat);
+        d = z;
+    }
+    if (!d->open(QIODevice::ReadOnly)) {
+        slog()->errorStream() << "Couldn't open " << name(c).toStdString() << " stream : " << d->errorString().toStdString();
+        delete d;
+        return NULL;
+    }
+    return d;
+}
+
+/// \brief Read a whole stream a block at a time, the way the show loader does.
+static void readAll(QIODevice *d, QByteArray &out)
+{
+    out.clear();
+    QByteArray block;
+    while (!(block = d->read(CODEC_BLOCK)).isEmpty()) {
+        out.append(block);
+    }
+}
+
+bool ShowCodec::benchmark(const QString filename, std::ostream& out)
+{
+    QByteArray doc;
+    {
+        QFile f(filename);
+        QIODevice *d = reader(detect(filename),&f);
+        if (!d) {
+            return false;
+        }
+        readAll(d,doc);
+        delete d;
+    }
+    if (doc.isEmpty()) {
+        out << "Nothing read from " << filename.toStdString() << std::endl;
+        return false;
+    }
+    const double mb = doc.size() / (1024.0 * 1024.0);
+    out << filename.toStdString() << " : " << doc.size() << " bytes of xml, "
+        << QThread::idealThreadCount() << " threads" << std::endl;
+    out << std::setw(6) << "codec" << std::setw(7) << "level" << std::setw(12) << "bytes"
+        << std::setw(8) << "ratio" << std::setw(12) << "save MB/s" << std::setw(12) << "load MB/s" << std::endl;
+    bool ok = true;
+    std::vector<Codec> c = available();
+    for (unsigned int i=0; i < c.size(); i++) {
+        const int l = level(c[i]);
+        QByteArray packed;
+        QBuffer pb(&packed);
+        pb.open(QIODevice::WriteOnly);
+        QTime timer;
+        timer.start();
+        {
+            ShowStreamWriterPtr w = writer(c[i],&pb,l);
+            for (int p = 0; p < doc.size(); p += CODEC_BLOCK) {
+                w->write(doc.mid(p,CODEC_BLOCK));
+            }
+            if (!w->finish()) {
+                ok = false;
+            }
+        }
+        const int saveMs = timer.elapsed();
+        pb.close();
+        QByteArray unpacked;
+        QBuffer ub(&packed);
+        timer.restart();
+        QIODevice *d = reader(c[i],&ub);
+        if (d) {
+            readAll(d,unpacked);
+            delete d;
+        }
+        const int loadMs = timer.elapsed();
+        if (unpacked != doc) {
+            out << name(c[i]).toStdString() << " did not round trip the show" << std::endl;
+            ok = false;
+            continue;
+        }
+        out << std::setw(6) << name(c[i]).toStdString() << std::setw(7) << l << std::setw(12) << packed.size()
+            << std::setw(8) << std::setprecision(3) << (double) doc.size() / packed.size()
+            << std::setw(12) << std::setprecision(4) << mb * 1000.0 / (saveMs ? saveMs : 1)
+            << std::setw(12) << mb * 1000.0 / (loadMs ? loadMs : 1) << std::endl;
+    }
+    return ok;
+}
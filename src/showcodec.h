@@ -0,0 +1,78 @@
+/* showcodec.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef SHOWCODEC_INCL
+#define SHOWCODEC_INCL
+
+#include <vector>
+#include <ostream>
+#include <QtCore>
+#include <boost/shared_ptr.hpp>
+
+/// The compression applied to xml (.lsf) show files.
+
+/// Gzip is what every lucifer has always read and is still the default for saving. Zstandard
+/// (built in when the library is found, HAVE_ZSTD) inflates several times faster at a similar
+/// ratio, which matters as decompression is a large share of the time taken to load a show.
+/// Loading tells the two apart by their magic numbers, so the file name says nothing about it.
+
+/// \brief Where a show saver puts the document, the compression is hidden behind it.
+class ShowStreamWriter
+{
+public:
+    virtual ~ShowStreamWriter ();
+    /// \brief Compress and write some of the document.
+    /// @return false once a write has failed.
+    virtual bool write (const QByteArray data) = 0;
+    /// \brief Flush everything and end the stream.
+    /// @return false if anything failed.
+    virtual bool finish () = 0;
+    virtual QString errorString () const = 0;
+};
+
+typedef boost::shared_ptr<ShowStreamWriter> ShowStreamWriterPtr;
+
+class ShowCodec
+{
+public:
+    enum Codec {GZIP, ZSTD};
+    /// \brief Work out a file's codec from its first few bytes.
+    /// @return the codec, GZIP for anything not recognised as that is what used to be assumed.
+    static Codec detect (const QString filename);
+    /// @return the codec called name, GZIP if it is unknown or not built in.
+    static Codec fromName (const QString name);
+    static QString name (const Codec c);
+    /// @return the codecs this build can read and write.
+    static std::vector<Codec> available ();
+    /// @return the level from the settings, Engine/Saving/Compression level for gzip and
+    /// Engine/Saving/Zstd level for zstd.
+    static int level (const Codec c);
+    /// \brief A writer compressing onto out, which must already be open.
+    static ShowStreamWriterPtr writer (const Codec c, QIODevice *out, const int level);
+    /// \brief A device decompressing from in, opened for reading.
+    /// @return the device, owned by the caller, or NULL if it could not be opened.
+    static QIODevice * reader (const Codec c, QIODevice *in);
+    /// \brief Time saving and loading a show's document with each codec.
+    /// The document is held in memory, so this measures the codecs and not the disk.
+    /// @param[in] filename is the reference show, in any codec.
+    /// @param[out] out gets a table of ratio and throughput per codec.
+    /// @return false if the show could not be read or a codec failed to round trip it.
+    static bool benchmark (const QString filename, std::ostream &out);
+};
+
+#endif
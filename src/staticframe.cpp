@@ -21,14 +21,26 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <iostream>
 #include <boost/make_shared.hpp>
 #include <math.h>
+#include <algorithm>
 #include <arpa/inet.h>
+#include <boost/static_assert.hpp>
+#include <QtEndian>
 
 #include "log.h"
 #include "staticframe.h"
 #include "arcball.h"
+#include "config.h"
 #include <netinet/in.h>
 
 #define NAME "Static_frame"
+/// Cosine of the turn in the path beyond which repeated points are corner dwell (30 degrees).
+#define DECIMATE_CORNER (0.866f)
+/// How much each step must grow by away from a corner to count as the scanners speeding up,
+/// smaller changes are just rounding in how the artwork was sampled.
+#define DECIMATE_RAMP (1.25f)
+
+// The binary show format maps arrays of these directly
+BOOST_STATIC_ASSERT (sizeof(ILDAPoint) == 10);
 
 static SourceImplPtr makeStaticFrame()
 {
@@ -52,27 +64,244 @@ StaticFrame::StaticFrame () : FrameSource_impl(MAKES_FRAMES,NONE,NAME)
     dewell = 100;
     scale = 1.0f;
     useDewell = false;
+    mapped = NULL;
+    mappedSize = 0;
 }
 
 StaticFrame::~StaticFrame ()
 {
 }
 
+const ILDAPoint * StaticFrame::points () const
+{
+    if (mapped) {
+        return mapped;
+    }
+    return data.empty() ? NULL : &data[0];
+}
+
+size_t StaticFrame::pointCount () const
+{
+    return mapped ? mappedSize : data.size();
+}
+
+void StaticFrame::detach ()
+{
+    if (!mapped) {
+        return;
+    }
+    data.assign(mapped,mapped + mappedSize);
+    mapped = NULL;
+    mappedSize = 0;
+    mapping.reset();
+}
+
 void StaticFrame::reserve (size_t points)
 {
+    detach();
     data.reserve (points);
 }
 
 void StaticFrame::add_data (const ILDAPoint& p)
 {
+    detach();
     data.push_back(p);
 }
 
-void StaticFrame::save (QXmlStreamWriter* w)
+ILDAPoint * StaticFrame::resize (size_t points)
 {
-    assert (w);
-    slog()->debugStream()<< "Saving static frame : " << this;
-    w->writeAttribute("Points",QString().number(data.size()));
+    // Whatever was borrowed is being replaced, so there is nothing to copy
+    mapping.reset();
+    mapped = NULL;
+    mappedSize = 0;
+    data.resize(points);
+    return points ? &data[0] : NULL;
+}
+
+static bool samePoint(const ILDAPoint &a, const ILDAPoint &b)
+{
+    return (a.x() == b.x()) && (a.y() == b.y()) && (a.z() == b.z()) && (a.blanked() == b.blanked()) &&
+           (a.r() == b.r()) && (a.g() == b.g()) && (a.b() == b.b());
+}
+
+static bool sameAttributes(const ILDAPoint &a, const ILDAPoint &b)
+{
+    return (a.blanked() == b.blanked()) && (a.r() == b.r()) && (a.g() == b.g()) && (a.b() == b.b());
+}
+
+static QVector3D position(const ILDAPoint &p)
+{
+    return QVector3D(p.x(),p.y(),p.z());
+}
+
+/// @return the cosine of the turn at b going from a to c, -1 if there is no direction to compare.
+static float turn(const ILDAPoint &a, const ILDAPoint &b, const ILDAPoint &c)
+{
+    const QVector3D in = position(b) - position(a);
+    const QVector3D out = position(c) - position(b);
+    const float l = in.length() * out.length();
+    return (l > 0.0f) ? QVector3D::dotProduct(in,out) / l : -1.0f;
+}
+
+/// @return the distance of p from the segment a b.
+static float segmentDistance(const ILDAPoint &p, const ILDAPoint &a, const ILDAPoint &b)
+{
+    const QVector3D ab = position(b) - position(a);
+    const QVector3D ap = position(p) - position(a);
+    const float l = ab.lengthSquared();
+    if (l <= 0.0f) {
+        return ap.length();
+    }
+    float t = QVector3D::dotProduct(ap,ab) / l;
+    t = (t < 0.0f) ? 0.0f : ((t > 1.0f) ? 1.0f : t);
+    return (ap - ab * t).length();
+}
+
+size_t StaticFrame::decimate (const float tolerance, const float maxStep)
+{
+    const ILDAPoint *in = points();
+    const size_t before = pointCount();
+    if (before < 3) {
+        return before;
+    }
+    // Merge runs of repeated points unless they are there to let the scanners settle
+    std::vector<ILDAPoint> pts;
+    std::vector<char> keep;
+    pts.reserve(before);
+    keep.reserve(before);
+    size_t i = 0;
+    while (i < before) {
+        size_t j = i + 1;
+        while ((j < before) && samePoint(in[j],in[i])) {
+            j++;
+        }
+        bool dwell = false;
+        if (j - i > 1) {
+            dwell = (i == 0) || (j == before) || !sameAttributes(in[i - 1],in[i]) ||
+                    !sameAttributes(in[j],in[i]) || (turn(in[i - 1],in[i],in[j]) < DECIMATE_CORNER);
+        }
+        for (size_t k = i; k < (dwell ? j : i + 1); k++) {
+            pts.push_back(in[k]);
+            keep.push_back(dwell);
+        }
+        i = j;
+    }
+    // The ends and both sides of every blanking or colour change stay where they are
+    const size_t n = pts.size();
+    std::vector<char> anchor(n,0);
+    anchor[0] = anchor[n - 1] = true;
+    for (i = 1; i < n; i++) {
+        if (!sameAttributes(pts[i - 1],pts[i])) {
+            anchor[i - 1] = anchor[i] = true;
+        }
+    }
+    // As do corners
+    for (i = 1; i + 1 < n; i++) {
+        if (sameAttributes(pts[i - 1],pts[i]) && sameAttributes(pts[i],pts[i + 1]) &&
+                (turn(pts[i - 1],pts[i],pts[i + 1]) < DECIMATE_CORNER)) {
+            anchor[i] = true;
+        }
+    }
+    // Points closing up towards an anchor or spreading out from it are the scanners being
+    // slowed down and sped up again, that is dwell just as much as a repeated point is
+    std::vector<float> steps(n,0.0f);
+    for (i = 1; i < n; i++) {
+        steps[i] = (position(pts[i]) - position(pts[i - 1])).length();
+    }
+    for (i = 0; i < n; i++) {
+        if (!anchor[i]) {
+            continue;
+        }
+        keep[i] = true;
+        for (size_t k = i; (k >= 2) && sameAttributes(pts[k - 1],pts[i]) && (steps[k - 1] > steps[k] * DECIMATE_RAMP); k--) {
+            keep[k - 1] = true;
+        }
+        for (size_t k = i + 1; (k + 1 < n) && sameAttributes(pts[k],pts[i]) && (steps[k + 1] > steps[k] * DECIMATE_RAMP); k++) {
+            keep[k] = true;
+        }
+    }
+    // Ramer-Douglas-Peucker between each pair of fixed points, without recursion as a
+    // frame can hold 65535 points. A span too long to leave as one step is split anyway.
+    std::vector<std::pair<size_t,size_t> > spans;
+    size_t a = 0;
+    for (i = 1; i < n; i++) {
+        if (keep[i]) {
+            spans.push_back(std::pair<size_t,size_t>(a,i));
+            a = i;
+        }
+    }
+    while (!spans.empty()) {
+        const size_t s = spans.back().first;
+        const size_t e = spans.back().second;
+        spans.pop_back();
+        if (e <= s + 1) {
+            continue;
+        }
+        size_t split = s + 1;
+        float dmax = -1.0f;
+        for (size_t k = s + 1; k < e; k++) {
+            const float d = segmentDistance(pts[k],pts[s],pts[e]);
+            if (d > dmax) {
+                dmax = d;
+                split = k;
+            }
+        }
+        if (dmax <= tolerance) {
+            const float length = (position(pts[e]) - position(pts[s])).length();
+            if ((maxStep <= 0.0f) || (length <= maxStep)) {
+                continue;
+            }
+            // Too long to leave as one step, cut into as few pieces as the scanners can follow
+            const size_t pieces = (size_t) ceilf(length / maxStep);
+            size_t from = s;
+            for (size_t m = 1; m <= pieces; m++) {
+                const size_t to = s + ((e - s) * m) / pieces;
+                if (to > from) {
+                    keep[to] = true;
+                    spans.push_back(std::pair<size_t,size_t>(from,to));
+                    from = to;
+                }
+            }
+            continue;
+        }
+        keep[split] = true;
+        spans.push_back(std::pair<size_t,size_t>(s,split));
+        spans.push_back(std::pair<size_t,size_t>(split,e));
+    }
+    std::vector<ILDAPoint> out;
+    out.reserve(n);
+    for (i = 0; i < n; i++) {
+        if (keep[i]) {
+            out.push_back(pts[i]);
+        }
+    }
+    // Replaces any borrowed points, like resize()
+    mapping.reset();
+    mapped = NULL;
+    mappedSize = 0;
+    data.swap(out);
+    slog()->debugStream() << "Decimated frame " << this << " from " << before << " to " << data.size() << " points";
+    return data.size();
+}
+
+void StaticFrame::decimateTree (SourceImplPtr fs, const float tolerance, const float maxStep, size_t &before, size_t &after)
+{
+    if (!fs) {
+        return;
+    }
+    StaticFramePtr f = boost::dynamic_pointer_cast<StaticFrame>(fs);
+    if (f) {
+        before += f->pointCount();
+        after += f->decimate(tolerance,maxStep);
+    }
+    for (unsigned int i=0; i < fs->numChildren(); i++) {
+        decimateTree(fs->child(i),tolerance,maxStep,before,after);
+    }
+}
+
+void StaticFrame::saveAttributes (QXmlStreamWriter* w)
+{
+    w->writeAttribute("Points",QString().number(pointCount()));
     w->writeAttribute("Use_Dewell", useDewell ? "True" : "False");
     w->writeAttribute("Dewell",QString().number(dewell));
     w->writeAttribute("Repeats",QString().number(repeats));
@@ -83,12 +312,21 @@ void StaticFrame::save (QXmlStreamWriter* w)
             w->writeAttribute(QString().sprintf("Geometry%d%d",j,i), QString().number(geometry(j,i)));
         }
     }
+}
+
+void StaticFrame::save (QXmlStreamWriter* w)
+{
+    assert (w);
+    slog()->debugStream()<< "Saving static frame : " << this;
+    saveAttributes(w);
     // write out the point data
+    const ILDAPoint *pts = points();
+    const size_t count = pointCount();
     QByteArray b;
     // 10 bytes per point
-    b.reserve(10 * data.size());
-    for (unsigned int i = 0; i < data.size(); i++) {
-        const ILDAPoint p = data[i];
+    b.reserve(10 * count);
+    for (unsigned int i = 0; i < count; i++) {
+        const ILDAPoint p = pts[i];
         unsigned short u;
         u=htons(p.x());
         b.append((char *)&u,2);
@@ -108,15 +346,62 @@ void StaticFrame::save (QXmlStreamWriter* w)
     w->writeEndElement();
 }
 
-void StaticFrame::load(QXmlStreamReader* e)
+void StaticFrame::saveBinary (BinaryShowWriter* w)
+{
+    assert (w);
+    QByteArray b;
+    QXmlStreamWriter x(&b);
+    x.writeStartElement(NAME);
+    saveAttributes(&x);
+    x.writeEndElement();
+    w->writeParams(b);
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    w->writeData(points(),pointCount() * sizeof(ILDAPoint));
+#else
+    std::vector<ILDAPoint> le(points(),points() + pointCount());
+    for (size_t i = 0; i < le.size(); i++) {
+        le[i].setX(qToLittleEndian(le[i].x()));
+        le[i].setY(qToLittleEndian(le[i].y()));
+        le[i].setZ(qToLittleEndian(le[i].z()));
+    }
+    w->writeData(le.empty() ? NULL : &le[0],le.size() * sizeof(ILDAPoint));
+#endif
+}
+
+void StaticFrame::loadBinary (BinaryShowReader* r)
+{
+    assert (r);
+    QXmlStreamReader x(r->params());
+    x.readNextStartElement();
+    loadAttributes(&x);
+    data.clear();
+    mapping.reset();
+    mapped = NULL;
+    mappedSize = r->dataSize() / sizeof(ILDAPoint);
+    if (!mappedSize) {
+        return;
+    }
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    // Aligned by the writer and checked by the reader, so usable where it lies
+    mapping = r->file();
+    mapped = (const ILDAPoint *) r->data();
+#else
+    const ILDAPoint *p = (const ILDAPoint *) r->data();
+    data.assign(p,p + mappedSize);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i].setX(qFromLittleEndian(data[i].x()));
+        data[i].setY(qFromLittleEndian(data[i].y()));
+        data[i].setZ(qFromLittleEndian(data[i].z()));
+    }
+    mappedSize = 0;
+#endif
+}
+
+void StaticFrame::loadAttributes(QXmlStreamReader* e)
 {
-    assert (e);
-    int pointcount = 1;
     std::string udw = "False";
     dewell = 0;
     repeats = 1;
-    slog()->debugStream() << "Loading static frame : "<< this;
-    pointcount= e->attributes().value("Points").toString().toInt();
     udw = e->attributes().value("Use_Dewell").toString().toStdString();
     dewell = e->attributes().value("Dewell").toString().toInt();
     repeats = e->attributes().value("Repeats").toString().toInt();
@@ -131,7 +416,19 @@ void StaticFrame::load(QXmlStreamReader* e)
             geometry(j,i) = e->attributes().value(QString().sprintf("Geometry%d%d",j,i)).toString().toFloat();
         }
     }
+}
+
+void StaticFrame::load(QXmlStreamReader* e)
+{
+    assert (e);
+    int pointcount = 1;
+    slog()->debugStream() << "Loading static frame : "<< this;
+    pointcount= e->attributes().value("Points").toString().toInt();
+    loadAttributes(e);
     // Load the point list
+    mapped = NULL;
+    mappedSize = 0;
+    mapping.reset();
     data.clear();
     data.reserve(pointcount);
     slog()->debugStream() << "Points : " << pointcount;
@@ -195,8 +492,11 @@ FramePtr StaticFrame::frame() const
     FramePtr p = boost::make_shared<Frame>();
     p->geometry = geometry;
     p->geometry.scale(scale);
-    for (unsigned int i=0; i < data.size(); ++i) {
-        p->addPoint(data[i].point());
+    const ILDAPoint *pts = points();
+    const size_t count = pointCount();
+    p->reserve(count);
+    for (unsigned int i=0; i < count; ++i) {
+        p->addPoint(pts[i].point());
     }
     return p;
 }
@@ -233,11 +533,11 @@ void StaticFrame::copyDataTo(SourceImplPtr p) const
     sf->dewell = dewell;
     sf->repeats = repeats;
     sf->scale = scale;
-    sf->data.clear();
-    sf->data.reserve(data.size());
-    for (size_t i =0; i < data.size(); i++) {
-        sf->data.push_back(data[i]);
-    }
+    // Borrowed points stay borrowed, whichever copy is edited first takes its own
+    sf->data = data;
+    sf->mapping = mapping;
+    sf->mapped = mapped;
+    sf->mappedSize = mappedSize;
     sf->geometry = geometry;
     sf->setDescription(getDescription());
 }
@@ -286,7 +586,8 @@ void StaticFrameGui::set (StaticFrame * p)
     repeatSwitch->setChecked(!fp->useDewell);
     dewellEntry->setDisabled(!fp->useDewell);
     repeatEntry->setDisabled(fp->useDewell);
-    pointsDisplay->setNum((int)fp->data.size());
+    pointsDisplay->setNum((int)fp->pointCount());
+    decimateButton->setEnabled(true);
     dewellEntry->setValue(fp->dewell);
     repeatEntry->setValue (fp->repeats);
     size->setValue(100.0 * log10 (fp->scale));
@@ -325,6 +626,11 @@ StaticFrameGui::StaticFrameGui(QWidget* parent): FrameGui(parent)
     pointsDisplay->setSizePolicy(QSizePolicy::Preferred,QSizePolicy::Fixed);
     grid->addWidget(pointsLabel,1,0,1,1);
     grid->addWidget(pointsDisplay,1,1,1,1);
+    decimateButton = new QPushButton (tr("Decimate"),this);
+    decimateButton->setToolTip(tr("Remove points that add nothing to the drawing"));
+    decimateButton->setEnabled(false);
+    connect (decimateButton,SIGNAL(clicked()),this,SLOT(decimateData()));
+    grid->addWidget(decimateButton,6,0,1,2);
 
     dewellEntry = new QSpinBox (this);
     dewellEntry->setMinimum (40);
@@ -382,6 +688,18 @@ void StaticFrameGui::arcballUp()
     fp->geometry = arcball->rotate();
 }
 
+void StaticFrameGui::decimateData()
+{
+    assert (fp);
+    QSettings settings;
+    const size_t before = fp->pointCount();
+    settings.beginGroup("Engine/Import");
+    const size_t after = fp->decimate(settings.value("Decimate tolerance",DECIMATE_TOLERANCE).toDouble(),
+                                      settings.value("Decimate max step",DECIMATE_MAX_STEP).toDouble());
+    pointsDisplay->setText(QString("%1 (was %2)").arg(after).arg(before));
+    emit graphicsChanged(); // update the thumbnail
+}
+
 void StaticFrameGui::scaleChanged(int v)
 {
     fp->scale = pow (10.0,v/100.0);
@@ -29,6 +29,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "framesource.h"
 #include "displayframe.h"
 #include "arcball.h"
+#include "binaryshow.h"
 
 ///\brief A compact point representation for static frames
 
@@ -37,6 +38,9 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 /// the size of the point structure (10 bytes packed, probably 12 in reality).
 /// As most of the memory on a typical show goes on arrays of these, it is well
 /// worth doing.
+/// The layout (x, y, z as native shorts then blanked, r, g, b bytes, 10 bytes with no padding)
+/// is also the on disk layout of the binary show format on little endian hosts, which maps
+/// arrays of these straight out of the file.
 
 class ILDAPoint
 {
@@ -54,7 +58,7 @@ public:
         return z_;
     }
     bool blanked() const {
-        return blanked_;
+        return blanked_ != 0;
     }
     unsigned char r() const {
         return r_;
@@ -82,7 +86,7 @@ public:
         z_=v;
     }
     void setBlanked(bool b) {
-        blanked_ = b;
+        blanked_ = b ? 1 : 0;
     }
     void setR (unsigned char v) {
         r_=v;
@@ -97,7 +101,8 @@ private:
     short x_;
     short y_;
     short z_;
-    bool blanked_;
+    // Not a bool, a mapped file could hold any byte here
+    unsigned char blanked_;
     unsigned char r_;
     unsigned char g_;
     unsigned char b_;
@@ -137,6 +142,26 @@ public:
     /// \brief Add an ILDAPoint to the point data.
     /// @param [in] p is the point to add to the end of the points data. 
     void add_data (const ILDAPoint &p);
+    /// \brief Set the number of points and return the storage for a loader to fill in place.
+    /// @param [in] points is the number of points the frame is to hold.
+    /// @return the first of points writable points, good until the frame is next changed.
+    ILDAPoint * resize (size_t points);
+    /// \brief Drop the points that add nothing to what is drawn.
+    /// Dwell is kept: repeated points, and runs of points closing up into or opening out of
+    /// a corner, an end of the frame or a blanking or colour change, which is how artwork
+    /// slows the scanners down. Elsewhere repeats are merged and what is left is simplified
+    /// with Ramer-Douglas-Peucker, which merges points on straight lines and over sampled curves.
+    /// @param [in] tolerance is how far in ILDA units the path may move.
+    /// @param [in] maxStep is the longest step in ILDA units between lit points it may
+    /// create, the scan speed limit, as there is nothing after us to interpolate a longer one.
+    /// 0 for no limit.
+    /// @return the number of points now in the frame.
+    size_t decimate (const float tolerance, const float maxStep);
+    /// \brief Decimate every StaticFrame in a tree.
+    /// @param [in] fs is the root of the tree.
+    /// @param [in] tolerance and maxStep are as for decimate().
+    /// @param [in,out] before and after have the point counts added to them.
+    static void decimateTree (SourceImplPtr fs, const float tolerance, const float maxStep, size_t &before, size_t &after);
     /// \brief return the number of frames this frame source will generate.
     /// @return the number of frames this source will return.
     size_t frames ();
@@ -153,6 +178,10 @@ public:
     /// \brief load a StaticFrame from xml.
     /// @param [in] e is the xml stream to load from.
     void load (QXmlStreamReader *e);
+    /// \brief Save to a binary show, the points go in the data area as a raw ILDAPoint array.
+    void saveBinary (BinaryShowWriter *w);
+    /// \brief Load from a binary show, the points are used in place until the frame is edited.
+    void loadBinary (BinaryShowReader *r);
     /// \brief A geometry matrix for affine transforms.
     /// This can be manipulated directly and will propagate up the tree until a 
     /// renderer eventually uses it to render the frame.
@@ -168,7 +197,18 @@ private:
     PlaybackImplPtr newPlayback();
     void copyDataTo (SourceImplPtr p) const;
     FramePtr frame() const;
+    void saveAttributes (QXmlStreamWriter *w);
+    void loadAttributes (QXmlStreamReader *e);
+    /// The points, either our own or borrowed from a mapped show file.
+    const ILDAPoint * points () const;
+    size_t pointCount () const;
+    /// \brief Take a private copy of borrowed points before changing them.
+    void detach ();
     std::vector <ILDAPoint> data;
+    /// Points borrowed from a binary show, the file stays mapped while we hold it.
+    BinaryShowFilePtr mapping;
+    const ILDAPoint *mapped;
+    size_t mappedSize;
     unsigned int repeats;
     unsigned int  dewell;
     bool useDewell;
@@ -195,8 +235,10 @@ private slots:
     void arcballDown();
     void arcballUp();
     void scaleChanged (int);
+    void decimateData ();
 private:
     QLabel * pointsDisplay;
+    QPushButton * decimateButton;
     QGridLayout * grid;
     QButtonGroup * group;
     QSpinBox * dewellEntry;
@@ -0,0 +1,164 @@
+/* watchdog.cpp is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "watchdog.h"
+#include "engine.h"
+#include "head.h"
+#include "log.h"
+#include "rtconfig.h"
+#if __unix
+#include <time.h>
+#include <errno.h>
+#endif
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+Watchdog::Watchdog(Engine* e) : QThread()
+{
+    engine = e;
+    stopping.store(false);
+    QSettings settings;
+    settings.beginGroup("Engine/Watchdog");
+    periodMs = settings.value("Period ms",2).toUInt();
+    grace = settings.value("Grace ms",5.0).toDouble() / 1000.0;
+    recoverRefills = settings.value("Recover refills",50).toUInt();
+    settings.endGroup();
+    if (!periodMs) {
+        periodMs = 2;
+    }
+}
+
+Watchdog::HeadState::HeadState()
+{
+    tripped = false;
+    trippedAt = 0.0;
+    trippedProgress = 0;
+    stalls = 0;
+}
+
+Watchdog::~Watchdog()
+{
+    stop();
+    wait();
+}
+
+void Watchdog::stop()
+{
+    stopping.store(true);
+}
+
+unsigned long Watchdog::stalls(const unsigned int head) const
+{
+    QMutexLocker l(&statsLock);
+    return (head < heads.size()) ? heads[head].stalls : 0;
+}
+
+void Watchdog::run()
+{
+    // Must be above the head threads or a runaway head would starve us
+    RTConfig::setupThread("Watchdog");
+    slog()->infoStream() << "Watchdog running every " << periodMs << "ms, grace " << grace * 1000.0 << "ms";
+    timespec next;
+    clock_gettime(CLOCK_MONOTONIC,&next);
+    while (!stopping.load()) {
+        next.tv_nsec += periodMs * 1000000L;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&next,NULL) == EINTR) {
+        }
+        const double t = now();
+        const size_t n = engine->headCount();
+        if (n != heads.size()) {
+            for (unsigned int i=n; i < heads.size(); i++) {
+                release(heads[i]);
+            }
+            QMutexLocker l(&statsLock);
+            heads.resize(n);
+        }
+        for (unsigned int i=0; i < n; i++) {
+            check(heads[i],i,t);
+        }
+    }
+    // Do not leave anything blanked behind us
+    for (unsigned int i=0; i < heads.size(); i++) {
+        release(heads[i]);
+    }
+}
+
+void Watchdog::release(HeadState& s)
+{
+    if (s.tripped && s.trippedDriver) {
+        s.trippedDriver->ILDAInterlock(true);
+        s.trippedDriver->ILDABlank(Driver::BLANK_WATCHDOG,false);
+    }
+    s.trippedDriver = DriverPtr();
+    s.tripped = false;
+}
+
+void Watchdog::check(HeadState& s, const unsigned int head, const double t)
+{
+    LaserHeadPtr h = engine->getHead(head);
+    if (h != s.head) {
+        // A different head at this position now, start afresh
+        release(s);
+        s.head = h;
+    }
+    if (!h) {
+        return;
+    }
+    const double deadline = h->deadline();
+    const unsigned long progress = h->progress();
+    if (!s.tripped) {
+        if ((deadline == 0.0) || (t <= deadline + grace)) {
+            return;
+        }
+        DriverPtr d = h->getDriver();
+        if (!d) {
+            return;
+        }
+        d->ILDABlank(Driver::BLANK_WATCHDOG,true);
+        d->ILDAInterlock(false);
+        s.tripped = true;
+        s.trippedAt = t;
+        s.trippedProgress = progress;
+        s.trippedDriver = d;
+        {
+            QMutexLocker l(&statsLock);
+            s.stalls++;
+        }
+        slog()->critStream() << "Watchdog: head " << head + 1 << " stalled " << (t - deadline) * 1000.0
+                             << "ms past its deadline, output blanked. Refills " << progress
+                             << ", queued " << d->ILDABufferOccupancy() << " points, underruns " << d->ILDAUnderruns()
+                             << ", latency target " << h->latencyMs() << "ms at " << d->ILDAHwPointsPerSecond()
+                             << " pps, stall " << s.stalls << " on this head";
+        return;
+    }
+    // Healthy again once it has kept up for a while and is not currently late
+    if ((progress - s.trippedProgress >= recoverRefills) && ((deadline == 0.0) || (t <= deadline))) {
+        slog()->critStream() << "Watchdog: head " << head + 1 << " recovered, output restored after "
+                             << (t - s.trippedAt) * 1000.0 << "ms";
+        release(s);
+    }
+}
@@ -0,0 +1,75 @@
+/* watchdog.h is part of lucifer a laser show controller.
+
+Copyrignt 2011 Dan Mills <dmills@exponent.myzen.co.uk>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; version 2 dated June, 1991.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WATCHDOG_INCL
+#define WATCHDOG_INCL
+
+#include <vector>
+#include <QtCore>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include "driver.h"
+
+class Engine;
+class LaserHead;
+
+/// \brief Blanks the output of any head that misses its refill deadline.
+///
+/// Each head publishes a progress counter and the time its driver ring will run dry, this
+/// thread runs above the heads and checks them every few milliseconds. A head still not back
+/// by its deadline plus a grace period has stalled: its driver is blanked and the interlock
+/// opened, and a snapshot of the head's state is logged. Once the head has completed a run of
+/// refills on time again the output is restored without anyone having to touch anything.
+/// Settings are under Engine/Watchdog: Period ms, Grace ms and Recover refills.
+class Watchdog : public QThread
+{
+    Q_OBJECT
+public:
+    Watchdog (Engine *e);
+    ~Watchdog();
+    void run();
+    void stop();
+    /// @return the number of stalls seen on a head since startup.
+    unsigned long stalls (const unsigned int head) const;
+private:
+    /// \brief What we know about one head.
+    class HeadState
+    {
+    public:
+        HeadState();
+        boost::shared_ptr<LaserHead> head;
+        bool tripped;
+        double trippedAt;
+        unsigned long trippedProgress;
+        DriverPtr trippedDriver;
+        unsigned long stalls;
+    };
+    void check (HeadState &s, const unsigned int head, const double t);
+    /// \brief Put the output back, if we blanked it.
+    void release (HeadState &s);
+    Engine *engine;
+    boost::atomic<bool> stopping;
+    unsigned int periodMs;
+    double grace;
+    unsigned long recoverRefills;
+    /// Per head state, resized to follow the head count, statsLock covers it for stalls().
+    std::vector<HeadState> heads;
+    mutable QMutex statsLock;
+};
+
+#endif